@@ -0,0 +1,48 @@
+#include "profiler.hpp"
+
+using namespace std;
+using namespace std::chrono;
+using namespace profiler;
+
+// The same recursive workload under loggers with fewer and fewer features,
+// to show what each one costs per call
+using TreeLogger = BasicLogger<SteadyClock, NullSink, ContextTreeAggregation, MultiThreaded>;
+using FastLogger = BasicLogger<TscClock, NullSink, ContextTreeAggregation, SingleThreaded>;
+using TimerOnly = BasicLogger<TscClock, NullSink, NoAggregation, SingleThreaded>;
+
+template <typename LoggerType>
+long long fibonacci(CallGraph &graph, int n) {
+    LOG_CALL_AS(LoggerType, graph);
+    return n < 2 ? n : fibonacci<LoggerType>(graph, n - 1) + fibonacci<LoggerType>(graph, n - 2);
+}
+
+// fib(n) makes 2 * fib(n + 1) - 1 calls
+long long callsFor(int n) {
+    long long a = 0, b = 1;
+    for (int i = 0; i <= n; ++i) {
+        long long next = a + b;
+        a = b;
+        b = next;
+    }
+    return 2 * a - 1;
+}
+
+template <typename LoggerType>
+void measure(const string &name, int n) {
+    CallGraph graph;
+    fibonacci<LoggerType>(graph, n);  // Warm up: builds the tree, calibrates the TSC
+    auto start = high_resolution_clock::now();
+    long long result = fibonacci<LoggerType>(graph, n);
+    double elapsed = static_cast<double>(duration_cast<nanoseconds>(high_resolution_clock::now() - start).count());
+    cout << left << setw(12) << name << "fib(" << n << ") = " << result << ", " << fixed << setprecision(1)
+         << elapsed / callsFor(n) << " ns per call" << endl;
+}
+
+int main() {
+    Logger::setEventFormat(EventFormat::FlightRecorder);
+    measure<Logger>("Logger", 24);
+    measure<TreeLogger>("TreeLogger", 24);
+    measure<FastLogger>("FastLogger", 24);
+    measure<TimerOnly>("TimerOnly", 24);
+    return 0;
+}
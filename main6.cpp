@@ -7,6 +7,8 @@
 #include <iomanip>
 #include <set>
 #include <cstdlib>
+#include <unordered_map>
+#include <cstdint>
 
 #define LOG_CALL(graph) Logger log(__func__, graph)
 
@@ -20,6 +22,171 @@ struct PathInfo {
     int callCount = 0;
 };
 
+// Call graph flattened to integer node IDs with CSR adjacency, so
+// traversals neither recurse on the C++ stack nor compare strings. Memory
+// is a few ints per node and edge, and every traversal is O(V + E).
+class GraphTraversal {
+public:
+    explicit GraphTraversal(const map<string, vector<string>> &graph) {
+        // Callers get IDs first, in map order, so roots come out sorted
+        unordered_map<string, uint32_t> ids;
+        for (const auto &entry : graph) {
+            idOf(entry.first, ids);
+        }
+        vector<uint32_t> lastCaller;
+        for (const auto &entry : graph) {
+            uint32_t caller = static_cast<uint32_t>(offsets.size());
+            offsets.push_back(static_cast<uint32_t>(targets.size()));
+            // Each callee once, in first-call order
+            for (const string &calleeName : entry.second) {
+                uint32_t callee = idOf(calleeName, ids);
+                lastCaller.resize(names.size(), UINT32_MAX);
+                if (lastCaller[callee] != caller) {
+                    lastCaller[callee] = caller;
+                    targets.push_back(callee);
+                }
+            }
+        }
+        // Callee-only nodes have no edges
+        offsets.resize(names.size() + 1, static_cast<uint32_t>(targets.size()));
+    }
+
+    // Indented tree from the roots. A function's callees are expanded at
+    // its first occurrence only; later occurrences are marked, so shared
+    // subtrees and recursion show up without repeating output.
+    void writeTree(ostream &out) const {
+        vector<uint64_t> expanded(words()), onPath(words());
+        vector<Frame> stack;
+        for (uint32_t start : startOrder()) {
+            if (testBit(expanded, start)) {
+                continue;
+            }
+            out << names[start] << '\n';
+            setBit(expanded, start);
+            setBit(onPath, start);
+            stack.push_back({start, offsets[start]});
+            while (!stack.empty()) {
+                Frame &top = stack.back();
+                if (top.nextEdge == offsets[top.node + 1]) {
+                    clearBit(onPath, top.node);
+                    stack.pop_back();
+                    continue;
+                }
+                uint32_t callee = targets[top.nextEdge++];
+                out << string(stack.size() * 2, ' ') << names[callee];
+                if (testBit(onPath, callee)) {
+                    out << " (recursive)\n";
+                } else if (testBit(expanded, callee)) {
+                    out << " (see above)\n";
+                } else {
+                    out << '\n';
+                    setBit(expanded, callee);
+                    setBit(onPath, callee);
+                    stack.push_back({callee, offsets[callee]});
+                }
+            }
+        }
+    }
+
+    // Depth-first preorder, one "depth name" line per function
+    void writeDepthFirst(ostream &out) const {
+        vector<uint64_t> visited(words());
+        vector<Frame> stack;
+        for (uint32_t start : startOrder()) {
+            if (testBit(visited, start)) {
+                continue;
+            }
+            out << 0 << ' ' << names[start] << '\n';
+            setBit(visited, start);
+            stack.push_back({start, offsets[start]});
+            while (!stack.empty()) {
+                Frame &top = stack.back();
+                if (top.nextEdge == offsets[top.node + 1]) {
+                    stack.pop_back();
+                    continue;
+                }
+                uint32_t callee = targets[top.nextEdge++];
+                if (!testBit(visited, callee)) {
+                    out << stack.size() << ' ' << names[callee] << '\n';
+                    setBit(visited, callee);
+                    stack.push_back({callee, offsets[callee]});
+                }
+            }
+        }
+    }
+
+    // Breadth-first order, one "depth name" line per function
+    void writeBreadthFirst(ostream &out) const {
+        vector<uint64_t> visited(words());
+        vector<pair<uint32_t, uint32_t>> queue;  // (node, depth)
+        queue.reserve(names.size());
+        for (uint32_t start : startOrder()) {
+            if (testBit(visited, start)) {
+                continue;
+            }
+            size_t head = queue.size();
+            queue.push_back({start, 0});
+            setBit(visited, start);
+            for (; head < queue.size(); ++head) {
+                uint32_t node = queue[head].first;
+                uint32_t depth = queue[head].second;
+                out << depth << ' ' << names[node] << '\n';
+                for (uint32_t edge = offsets[node]; edge < offsets[node + 1]; ++edge) {
+                    if (!testBit(visited, targets[edge])) {
+                        setBit(visited, targets[edge]);
+                        queue.push_back({targets[edge], depth + 1});
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    struct Frame {
+        uint32_t node;
+        uint32_t nextEdge;
+    };
+
+    uint32_t idOf(const string &name, unordered_map<string, uint32_t> &ids) {
+        auto inserted = ids.emplace(name, static_cast<uint32_t>(names.size()));
+        if (inserted.second) {
+            names.push_back(name);
+        }
+        return inserted.first->second;
+    }
+
+    // Roots (in-degree 0) first, then every node a root doesn't reach,
+    // which only happens inside cycles
+    vector<uint32_t> startOrder() const {
+        vector<uint32_t> inDegree(names.size(), 0);
+        for (uint32_t callee : targets) {
+            inDegree[callee]++;
+        }
+        vector<uint32_t> order;
+        order.reserve(names.size());
+        for (uint32_t node = 0; node < names.size(); ++node) {
+            if (inDegree[node] == 0) {
+                order.push_back(node);
+            }
+        }
+        for (uint32_t node = 0; node < names.size(); ++node) {
+            if (inDegree[node] != 0) {
+                order.push_back(node);
+            }
+        }
+        return order;
+    }
+
+    size_t words() const { return (names.size() + 63) / 64; }
+    static bool testBit(const vector<uint64_t> &bits, uint32_t node) { return bits[node / 64] >> (node % 64) & 1; }
+    static void setBit(vector<uint64_t> &bits, uint32_t node) { bits[node / 64] |= 1ULL << (node % 64); }
+    static void clearBit(vector<uint64_t> &bits, uint32_t node) { bits[node / 64] &= ~(1ULL << (node % 64)); }
+
+    vector<string> names;
+    vector<uint32_t> offsets;  // Edges of node n are targets[offsets[n] .. offsets[n + 1])
+    vector<uint32_t> targets;
+};
+
 class CallGraph {
 public:
     void addCall(const string &caller, const string &callee) {
@@ -31,35 +198,26 @@ public:
         ofstream graphFile("call_graph.txt");
 
         graphFile << "Call Graph Tree:\n";
-        set<string> visited;  // Set to track visited nodes and prevent infinite recursion
-
-        // Start with the top-level calls (those that are never called by others)
-        for (const auto &entry : callGraph) {
-            if (visited.find(entry.first) == visited.end()) {
-                printGraphHelper(entry.first, visited, 0, graphFile);
-            }
-        }
+        GraphTraversal(callGraph).writeTree(graphFile);
 
         graphFile.close();
     }
 
-    // Helper function for printGraph
-    void printGraphHelper(const string &node, set<string> &visited, int depth, ofstream &graphFile) const {
-        if (visited.find(node) != visited.end()) {
-            return;  // Prevent infinite recursion in case of cycles
+    // Depth-first and breadth-first orderings of the call graph
+    void printGraphOrders(const string &filename = "call_graph_order.txt") const {
+        ofstream orderFile(filename);
+        if (!orderFile) {
+            cerr << "Error: Could not open the file " << filename << " for writing." << endl;
+            return;
         }
-        visited.insert(node);
 
-        // Print the current node with indentation based on the depth in the call hierarchy
-        graphFile << string(depth * 2, ' ') << node << endl;
+        GraphTraversal traversal(callGraph);
+        orderFile << "Depth-first order (depth function):\n";
+        traversal.writeDepthFirst(orderFile);
+        orderFile << "\nBreadth-first order (depth function):\n";
+        traversal.writeBreadthFirst(orderFile);
 
-        // Recursively print each child node
-        auto it = callGraph.find(node);
-        if (it != callGraph.end()) {
-            for (const string &callee : it->second) {
-                printGraphHelper(callee, visited, depth + 1, graphFile);
-            }
-        }
+        orderFile.close();
     }
 
     // New method to generate a DOT file for Graphviz visualization
@@ -258,6 +416,7 @@ int main() {
     functionD(callGraph);
 
     callGraph.printGraph();
+    callGraph.printGraphOrders();
 
     // Generate dynamic call graph
     callGraph.generateDotFile(true, "dynamic_call_graph.dot", "dynamic_call_graph.png");
@@ -1,217 +1,8 @@
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <map>
-#include <vector>
-#include <chrono>
-#include <iomanip>
-#include <set>
-#include <cstdlib>
-
-#define LOG_CALL(graph) Logger log(__func__, graph)
+#include "profiler.hpp"
 
 using namespace std;
 using namespace std::chrono;
-
-
-
-struct PathInfo {
-    long long totalTime = 0;
-    int callCount = 0;
-};
-
-class CallGraph {
-public:
-    void addCall(const string &caller, const string &callee) {
-        callGraph[caller].push_back(callee);
-    }
-
-    // Original printGraph function to output the call graph in text format
-    void printGraph() const {
-        ofstream graphFile("call_graph.txt");
-
-        graphFile << "Call Graph Tree:\n";
-        set<string> visited;  // Set to track visited nodes and prevent infinite recursion
-
-        // Start with the top-level calls (those that are never called by others)
-        for (const auto &entry : callGraph) {
-            if (visited.find(entry.first) == visited.end()) {
-                printGraphHelper(entry.first, visited, 0, graphFile);
-            }
-        }
-
-        graphFile.close();
-    }
-
-    // Helper function for printGraph
-    void printGraphHelper(const string &node, set<string> &visited, int depth, ofstream &graphFile) const {
-        if (visited.find(node) != visited.end()) {
-            return;  // Prevent infinite recursion in case of cycles
-        }
-        visited.insert(node);
-
-        // Print the current node with indentation based on the depth in the call hierarchy
-        graphFile << string(depth * 2, ' ') << node << endl;
-
-        // Recursively print each child node
-        auto it = callGraph.find(node);
-        if (it != callGraph.end()) {
-            for (const string &callee : it->second) {
-                printGraphHelper(callee, visited, depth + 1, graphFile);
-            }
-        }
-    }
-
-    // New method to generate a DOT file for Graphviz visualization
-
-
-    void generateDotFile(bool isDynamicCallTree, const string &dotFilename, const string &pngFilename) const {
-        for (const auto &entry : callGraph) {
-            cout << "Key: " << entry.first << ", Value: ";
-
-            // Iterate through the vector stored as the value in the map
-            for (const auto &str : entry.second) {
-                cout << str << " ";
-            }
-
-            cout << endl;
-        }
-        ofstream dotFile(dotFilename);
-
-        if (!dotFile) {
-            cerr << "Error: Could not open the file " << dotFilename << " for writing." << endl;
-            return;
-        }
-
-        dotFile << "digraph CallGraph {\n";
-        dotFile << "    bgcolor=\"lightgray\";\n";
-        dotFile << "    node [style=filled, color=lightblue, shape=oval, fontname=\"Arial\"];\n";
-        dotFile << "    edge [fontname=\"Arial\", fontsize=10];\n";
-
-        if (isDynamicCallTree) {
-            for (const auto &entry : callGraph) {
-                const string &caller = entry.first;
-
-                for (const string &callee : entry.second) {
-                    // Create multiple nodes with the same name for each call
-                    static int instanceCounter = 1;  // Counter to differentiate nodes internally
-                    string calleeNodeName = callee + to_string(instanceCounter++);
-
-                    // Add the edge from the caller to this callee node
-                    dotFile << "    \"" << caller << "\" -> \"" << calleeNodeName << "\";\n";
-
-                    // Declare the callee node with the same label as the function name
-                    dotFile << "    \"" << calleeNodeName << "\" [label=\"" << callee << "\"];\n";
-                }
-            }
-        } else {
-            map<pair<string, string>, int> callCounts;
-
-            for (const auto &entry : callGraph) {
-                for (const auto &callee : entry.second) {
-                    callCounts[{entry.first, callee}]++;
-                }
-            }
-
-            for (const auto &entry : callCounts) {
-                dotFile << "    \"" << entry.first.first << "\" -> \"" << entry.first.second << "\" [label=\"" << entry.second << "\"];\n";
-            }
-        }
-
-        dotFile << "}\n";
-        dotFile.close();
-
-        cout << "DOT file created successfully: " << dotFilename << endl;
-
-        // Run Graphviz to create the PNG file
-        string command = "dot -Tpng \"" + dotFilename + "\" -o \"" + pngFilename + "\"";
-        int result = system(command.c_str());
-
-        if (result == 0) {
-            cout << "PNG file created successfully: " << pngFilename << endl;
-        } else {
-            cerr << "Error: Failed to generate PNG file. Please check if Graphviz is installed and accessible." << endl;
-        }
-    }
-
-
-
-
-
-
-    // Function to log paths and their time and call counts
-    void logPaths() const {
-        ofstream pathFile("path_profiles.txt");
-
-        pathFile << left << setw(60) << "Path"
-                 << setw(20) << "Total Time (µs)"
-                 << setw(15) << "Call Count" << endl;
-
-        pathFile << string(95, '-') << endl;
-
-        for (const auto &entry : pathProfiles) {
-            pathFile << left << setw(60) << entry.first
-                     << setw(20) << entry.second.totalTime
-                     << setw(15) << entry.second.callCount << endl;
-        }
-        pathFile.close();
-    }
-
-    void updatePathProfile(const string &path, long long duration) {
-        pathProfiles[path].totalTime += duration;
-        pathProfiles[path].callCount += 1;
-    }
-
-private:
-    map<string, vector<string>> callGraph;
-    map<string, PathInfo> pathProfiles;
-};
-
-// Logger class to log function entry, exit, and timing
-class Logger {
-public:
-    Logger(const string &functionName, CallGraph &graph)
-            : funcName(functionName), callGraph(graph) {
-
-        startTime = high_resolution_clock::now();
-        logFile.open("event_log.txt", ios_base::app);
-        logFile << "Entering " << funcName << "\n";
-
-        if (!callStack.empty()) {
-            callGraph.addCall(callStack.back(), funcName);
-        }
-        callStack.push_back(funcName);
-    }
-
-    ~Logger() {
-        auto endTime = high_resolution_clock::now();
-        auto duration = duration_cast<microseconds>(endTime - startTime).count();
-
-        logFile << "Exiting " << funcName << " (Execution Time: " << duration << " µs)\n";
-        callStack.pop_back();
-
-        // Construct the path string
-        string path;
-        for (const string &func : callStack) {
-            path += func + " -> ";
-        }
-        path += funcName;
-
-        // Update path profile with timing and call count
-        callGraph.updatePathProfile(path, duration);
-
-        logFile.close();
-    }
-
-private:
-    string funcName;
-    CallGraph &callGraph;
-    ofstream logFile;
-    static vector<string> callStack;
-    high_resolution_clock::time_point startTime;
-};
-
-vector<string> Logger::callStack;
+using namespace profiler;
 
 void functionD(CallGraph &graph);
 void functionC(CallGraph &graph);
@@ -251,14 +42,231 @@ void functionD(CallGraph &graph) {
     functionB(graph);
 }
 
-int main() {
+// Worker that contends with its siblings on a shared mutex
+void functionE(CallGraph &graph, ProfiledMutex &sharedMutex, int &sharedCounter) {
+    LOG_CALL(graph);
+    LOG_SCOPE(graph, "incrementLoop");
+    for (int i = 0; i < 1000; ++i) {
+        lock_guard<ProfiledMutex> guard(sharedMutex);
+        sharedCounter++;
+        LOG_COUNT(graph, "increments", 1);
+    }
+}
+
+int main(int argc, char *argv[]) {
     CallGraph callGraph;
 
+    // main7 decode <trace file>: rebuild path_profiles.txt from a compressed trace
+    if (argc == 3 && string(argv[1]) == "decode") {
+        TraceDecoder decoder;
+        if (!decoder.decode(argv[2], callGraph)) {
+            return 1;
+        }
+        callGraph.logPaths();
+        callGraph.writeFunctionOrder();
+        callGraph.writeButterfly();
+        return 0;
+    }
+
+    // main7 analyze <event log>: rebuild the call graph and path profiles
+    // from a text event_log.txt
+    if (argc == 3 && string(argv[1]) == "analyze") {
+        EventLogAnalyzer analyzer;
+        if (!analyzer.analyze(argv[2], callGraph)) {
+            return 1;
+        }
+        callGraph.printGraph();
+        callGraph.logPaths();
+        callGraph.writeFunctionOrder();
+        callGraph.writeButterfly();
+        return 0;
+    }
+
+    // main7 shm-report <name>: print the profile aggregated in a shared store
+    if (argc == 3 && string(argv[1]) == "shm-report") {
+        unique_ptr<SharedProfileStore> store = SharedProfileStore::attach(argv[2]);
+        if (!store) {
+            return 1;
+        }
+        store->importInto(callGraph);
+        store->writeReport(cout);
+        callGraph.printGraph();
+        callGraph.logPaths();
+        return 0;
+    }
+
+    // main7 archive <store dir> <path_profiles.txt> <run> <host> [unix time]:
+    // add a saved report to a columnar profile store
+    if ((argc == 6 || argc == 7) && string(argv[1]) == "archive") {
+        ProfileTables tables;
+        if (!ProfileArchive::readPathReport(argv[3], tables)) {
+            return 1;
+        }
+        long long timestamp = argc == 7 ? atoll(argv[6]) : static_cast<long long>(time(nullptr));
+        return ProfileArchive::append(argv[2], argv[4], argv[5], timestamp, tables) ? 0 : 1;
+    }
+
+    // main7 query <store dir> [--run R] [--host H] [--from T] [--to T]
+    //   [--prefix P] [--metric total|self|calls] [--by path|function|run] [--min N]
+    if (argc >= 3 && argc % 2 == 1 && string(argv[1]) == "query") {
+        ProfileArchive::Query query;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            string value = argv[i + 1];
+            if (option == "--run") {
+                query.run = value;
+            } else if (option == "--host") {
+                query.host = value;
+            } else if (option == "--from") {
+                query.from = atoll(value.c_str());
+            } else if (option == "--to") {
+                query.to = atoll(value.c_str());
+            } else if (option == "--prefix") {
+                query.pathPrefix = value;
+            } else if (option == "--min") {
+                query.minValue = atoll(value.c_str());
+            } else if (option == "--metric" && (value == "total" || value == "self" || value == "calls")) {
+                query.metric = value == "total" ? ProfileArchive::TotalTime
+                               : value == "self" ? ProfileArchive::SelfTime
+                                                 : ProfileArchive::CallCount;
+            } else if (option == "--by" && (value == "path" || value == "function" || value == "run")) {
+                query.groupBy = value == "path" ? ProfileArchive::GroupBy::Path
+                                : value == "function" ? ProfileArchive::GroupBy::Function
+                                                      : ProfileArchive::GroupBy::Run;
+            } else {
+                cerr << "Error: Unknown query option " << option << " " << value << "." << endl;
+                return 1;
+            }
+        }
+        ProfileArchive::writeQueryResult(ProfileArchive::query(argv[2], query), cout);
+        return 0;
+    }
+
+    CrashHandler::install(callGraph);
+
+    // PROFILER_FILTER / PROFILER_FILTER_FILE: record only part of the calls
+    if (!CallFilter::loadFromEnvironment()) {
+        return 1;
+    }
+
+    // main7 stress [key=value ...]: synthetic workload, see ReplayDriver::Spec
+    // main7 replay <trace file> [repeat] [key=value ...]: replay a compressed trace
+    // Both record in memory only (format=flight) unless told otherwise.
+    bool stress = argc >= 2 && string(argv[1]) == "stress";
+    if (stress || (argc >= 3 && string(argv[1]) == "replay")) {
+        ReplayDriver::Spec spec;
+        Logger::setEventFormat(EventFormat::FlightRecorder);
+        int first = stress ? 2 : 3;
+        int repeat = 1;
+        if (!stress && argc >= 4 && isdigit(static_cast<unsigned char>(argv[3][0]))) {
+            repeat = max(1, atoi(argv[3]));
+            first = 4;
+        }
+        for (int i = first; i < argc; ++i) {
+            if (!ReplayDriver::parseSetting(argv[i], spec)) {
+                cerr << "Error: Unknown setting " << argv[i] << "." << endl;
+                return 1;
+            }
+        }
+        if (stress) {
+            ReplayDriver::runSynthetic(spec, callGraph);
+        } else if (!ReplayDriver::runTrace(argv[2], repeat, callGraph)) {
+            return 1;
+        }
+        Logger::flushTrace();
+        return 0;
+    }
+
+    // main7 --shared <name>: also aggregate into a shared-memory store that
+    // other processes can record into and shm-report can read
+    if (argc == 3 && string(argv[1]) == "--shared" && !Logger::setSharedStore(argv[2])) {
+        return 1;
+    }
+
+    // main7 --compressed: record to event_trace.bin instead of event_log.txt
+    if (argc == 2 && string(argv[1]) == "--compressed") {
+        Logger::setEventFormat(EventFormat::Compressed);
+    }
+
+    // main7 --flight-recorder: keep recent events in memory only; kill -USR1
+    // or a call slower than 1 ms dumps them, and the run ends with a dump
+    bool flightRecorder = argc == 2 && string(argv[1]) == "--flight-recorder";
+    if (flightRecorder) {
+        Logger::setEventFormat(EventFormat::FlightRecorder);
+        FlightRecorder::installSignalTrigger(SIGUSR1);
+        FlightRecorder::setLatencyTrigger(1000);
+    }
+
+    // main7 --fold-recursion: one context per recursive function, with a depth histogram
+    if (argc == 2 && string(argv[1]) == "--fold-recursion") {
+        Logger::setRecursionFolding(true);
+    }
+
+    // main7 --bounded-paths <k>: keep only the k heaviest paths, in fixed memory
+    if (argc == 3 && string(argv[1]) == "--bounded-paths") {
+        Logger::setBoundedPaths(strtoul(argv[2], nullptr, 10));
+    }
+
+    // main7 --exemplars <n>: keep the n slowest calls of each path, with the
+    // calls beneath them, and list them at the end of path_profiles.txt
+    if (argc == 3 && string(argv[1]) == "--exemplars") {
+        Logger::setExemplars(strtoul(argv[2], nullptr, 10));
+    }
+
+    // main7 --placement: per-path NUMA node times and CPU migrations
+    if (argc == 2 && string(argv[1]) == "--placement") {
+        Logger::setPlacementTracking(true);
+    }
+
+    // main7 --archive <store dir>: also add this run's profile to a columnar
+    // profile store for query
+    string archiveDirectory = argc == 3 && string(argv[1]) == "--archive" ? argv[2] : "";
+
+    // main7 --series: sample the path profiles every millisecond (the demo
+    // is short) and write the windows to profile_series.csv
+    unique_ptr<ProfileSeries> series;
+    if (argc == 2 && string(argv[1]) == "--series") {
+        series.reset(new ProfileSeries(callGraph));
+        series->start(milliseconds(1));
+    }
+
+    // Do the profiler's startup work before the first call; with
+    // main7 --background-init, the process-wide part runs on its own thread
+    Logger::InitOptions initOptions;
+    initOptions.background = argc == 2 && string(argv[1]) == "--background-init";
+    initOptions.names = {"main", "functionA", "functionB", "functionC", "functionD", "functionE"};
+    Logger::init(callGraph, initOptions);
+
     LOG_CALL(callGraph);
 
     functionD(callGraph);
 
+    // Lock contention demo
+    ProfiledMutex counterMutex("counterMutex", callGraph);
+    int sharedCounter = 0;
+    vector<thread> workers;
+    for (int i = 0; i < 4; ++i) {
+        workers.emplace_back(functionE, ref(callGraph), ref(counterMutex), ref(sharedCounter));
+    }
+    for (thread &worker : workers) {
+        worker.join();
+    }
+
+    // Work handed to another thread is profiled under the context that created it
+    thread handoff(ContextHandle::capture(callGraph).bind([&callGraph] { functionA(callGraph); }));
+    handoff.join();
+
     callGraph.printGraph();
+    callGraph.printGraphOrders();
+
+    // Indexed queries
+    CallGraphIndex index;
+    index.update(callGraph);
+    cout << "Hottest functions under functionD:";
+    for (uint32_t function : index.hottestDescendants(index.find("functionD"), 3)) {
+        cout << " " << index.name(function) << " (" << index.statsOf(function).selfTime << " µs)";
+    }
+    cout << endl;
 
     // Generate dynamic call graph
     callGraph.generateDotFile(true, "dynamic_call_graph.dot", "dynamic_call_graph.png");
@@ -268,6 +276,28 @@ int main() {
     // Iterate through the map
 
     callGraph.logPaths();
+    callGraph.writeFunctionOrder();
+    callGraph.writeButterfly();
+    ProfilerMemory::writeReport(cout);
+    Logger::StartupCost startup = Logger::startupCost();
+    cout << "Profiler startup: " << startup.process << " µs process-wide, " << startup.threads << " µs preparing threads" << endl;
+
+    if (!archiveDirectory.empty()) {
+        char host[256] = "";
+        gethostname(host, sizeof(host) - 1);
+        ProfileTables tables = callGraph.snapshot();
+        tables.deriveSelfTimes();
+        ProfileArchive::append(archiveDirectory, "pid-" + to_string(getpid()), host, static_cast<long long>(time(nullptr)), tables);
+    }
+
+    if (flightRecorder) {
+        FlightRecorder::dump("flight_recorder.bin");
+    }
+
+    if (series) {
+        series->stop();
+        series->writeCsv("profile_series.csv");
+    }
 
     return 0;
 }
@@ -0,0 +1,7128 @@
+// Call-path profiler, header only. Instrument functions with LOG_CALL /
+// LOG_SCOPE / LOG_COUNT against a CallGraph, then write its reports
+// (logPaths, generateDotFile, ...). main7.cpp is the demo and the command
+// line tool for traces, archives and replays.
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <iomanip>
+#include <set>
+#include <cstdlib>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <array>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <csignal>
+#include <memory>
+#include <new>
+#include <deque>
+#include <optional>
+#include <cstring>
+#include <cerrno>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <ctime>
+#include <string_view>
+#include <algorithm>
+#include <climits>
+#include <charconv>
+#include <sched.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The function ID is interned once per call site rather than on every call
+#define LOG_CALL(graph) LOG_CALL_AS(::profiler::Logger, graph)
+
+// LOG_CALL with another logger type, such as a BasicLogger
+#define LOG_CALL_AS(LoggerType, graph) \
+    static const uint32_t logFunctionId = ::profiler::FunctionRegistry::intern(__func__); \
+    LoggerType log(logFunctionId, graph)
+
+#define LOG_CONCAT_INNER(a, b) a##b
+#define LOG_CONCAT(a, b) LOG_CONCAT_INNER(a, b)
+
+// Times the rest of the enclosing block as a child context named
+// "function:name"; several scopes can share a function
+#define LOG_SCOPE(graph, name) \
+    static const uint32_t LOG_CONCAT(logScopeId, __LINE__) = ::profiler::FunctionRegistry::intern(std::string(__func__) + ":" + name); \
+    ::profiler::Logger LOG_CONCAT(logScope, __LINE__)(LOG_CONCAT(logScopeId, __LINE__), graph)
+
+// Adds `amount` to the counter `name` (a string literal) of the current
+// calling context
+#define LOG_COUNT(graph, name, amount) \
+    do { \
+        static const uint32_t logCounterId = ::profiler::FunctionRegistry::intern("[count " name "]"); \
+        ::profiler::Logger::count(logCounterId, graph, amount); \
+    } while (0)
+
+namespace profiler {
+
+// Only the std names this header uses, so `using namespace profiler` in client
+// code doesn't drag all of std (and std::chrono) in with it
+using std::array;
+using std::atomic;
+using std::atomic_flag;
+using std::cerr;
+using std::chars_format;
+using std::condition_variable;
+using std::condition_variable_any;
+using std::copy;
+using std::cout;
+using std::cv_status;
+using std::endl;
+using std::fill;
+using std::fixed;
+using std::flush;
+using std::forward;
+using std::from_chars;
+using std::ifstream;
+using std::ios;
+using std::ios_base;
+using std::left;
+using std::lock_guard;
+using std::lower_bound;
+using std::map;
+using std::max;
+using std::memory_order_acq_rel;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::min;
+using std::move;
+using std::mutex;
+using std::ofstream;
+using std::optional;
+using std::ostream;
+using std::pair;
+using std::pop_heap;
+using std::remove_if;
+using std::push_heap;
+using std::set;
+using std::setprecision;
+using std::setw;
+using std::shared_mutex;
+using std::sort;
+using std::stable_sort;
+using std::string;
+using std::string_view;
+using std::swap;
+using std::thread;
+using std::to_chars;
+using std::to_string;
+using std::unique;
+using std::unique_lock;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::high_resolution_clock;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::chrono::time_point;
+namespace chrono = std::chrono;
+namespace this_thread = std::this_thread;
+
+struct PathInfo {
+    long long totalTime = 0;
+    int callCount = 0;
+    long long selfTime = -1;  // -1 when the source only had inclusive times
+};
+
+// Struct to store lock wait/hold information for one calling context
+struct LockInfo {
+    long long waitTime = 0;     // Time spent blocked acquiring the lock (ns)
+    long long holdTime = 0;     // Time the lock was held (ns)
+    long long condWaitTime = 0; // Time spent blocked on a condition variable (ns)
+    int acquireCount = 0;
+    int contentionCount = 0;    // Acquisitions that found the lock already taken
+    int condWaitCount = 0;
+};
+
+// Struct to store a user counter (LOG_COUNT) for one calling context
+struct CounterInfo {
+    long long total = 0;
+    long long updates = 0;
+};
+
+// Accounting and page source for everything the profiler allocates at run
+// time. Pages come straight from mmap, so profiler growth never competes
+// with (or fragments) the application's malloc heap, and the total can be
+// capped with setLimit().
+class ProfilerMemory {
+public:
+    enum Category { ContextNodes, LockRecords, Names, EventBuffers, ThreadState, PathSketches, Exemplars, CategoryCount };
+
+    // 0 means unlimited. Allocations that would exceed the limit fail and
+    // the caller degrades (new contexts fold into an overflow node, events
+    // are dropped) instead of growing further. Per-thread bookkeeping (one
+    // ThreadProfile per thread and graph) is always granted, so it is kept
+    // outside the limit and reported on its own.
+    static void setLimit(size_t bytes) { limit.store(bytes, memory_order_relaxed); }
+
+    // With `prefault`, the pages are faulted in now rather than on first
+    // touch. Pages mapped without `enforceLimit` are exempt from the limit
+    // and never unmapped.
+    static void *mapPages(size_t bytes, bool enforceLimit = true, bool prefault = false) {
+        atomic<size_t> &counter = enforceLimit ? reserved : exempt;
+        size_t current = counter.load(memory_order_relaxed);
+        do {
+            size_t cap = limit.load(memory_order_relaxed);
+            if (enforceLimit && cap != 0 && current + bytes > cap) {
+                failedAllocations.fetch_add(1, memory_order_relaxed);
+                return nullptr;
+            }
+        } while (!counter.compare_exchange_weak(current, current + bytes, memory_order_relaxed));
+
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | (prefault ? MAP_POPULATE : 0);
+        void *pages = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (pages == MAP_FAILED) {
+            counter.fetch_sub(bytes, memory_order_relaxed);
+            failedAllocations.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+        return pages;
+    }
+
+    static void unmapPages(void *pages, size_t bytes) {
+        munmap(pages, bytes);
+        reserved.fetch_sub(bytes, memory_order_relaxed);
+    }
+
+    static void account(Category category, size_t bytes) {
+        used[category].fetch_add(bytes, memory_order_relaxed);
+    }
+
+    static size_t pageRound(size_t bytes) {
+        static const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return (bytes + pageSize - 1) / pageSize * pageSize;
+    }
+
+    // Everything mapped, whether or not it counts against the limit
+    static size_t reservedBytes() { return reserved.load(memory_order_relaxed) + exempt.load(memory_order_relaxed); }
+
+    static void writeReport(ostream &out) {
+        static const char *names[CategoryCount] = {"Context nodes", "Lock records", "Names", "Event buffers", "Thread state",
+                                                   "Path sketches", "Exemplars"};
+        out << "Profiler memory: " << reserved.load(memory_order_relaxed) / 1024 << " KiB reserved";
+        size_t cap = limit.load(memory_order_relaxed);
+        if (cap != 0) {
+            out << " of " << cap / 1024 << " KiB limit";
+        }
+        out << ", plus " << exempt.load(memory_order_relaxed) / 1024 << " KiB of thread state outside the limit" << endl;
+        for (int c = 0; c < CategoryCount; ++c) {
+            out << "  " << left << setw(16) << names[c] << used[c].load(memory_order_relaxed) / 1024 << " KiB used" << endl;
+        }
+        size_t failed = failedAllocations.load(memory_order_relaxed);
+        if (failed > 0) {
+            out << "  " << failed << " allocation(s) refused by the limit" << endl;
+        }
+    }
+
+private:
+    static atomic<size_t> reserved;
+    static atomic<size_t> exempt;
+    static atomic<size_t> limit;
+    static atomic<size_t> failedAllocations;
+    static atomic<size_t> used[CategoryCount];
+};
+
+inline atomic<size_t> ProfilerMemory::reserved{0};
+inline atomic<size_t> ProfilerMemory::exempt{0};
+inline atomic<size_t> ProfilerMemory::limit{0};
+inline atomic<size_t> ProfilerMemory::failedAllocations{0};
+inline atomic<size_t> ProfilerMemory::used[ProfilerMemory::CategoryCount];
+
+// Bump allocator over ProfilerMemory pages. Objects are never freed one
+// by one: an arena lives as long as the profile data it holds. Not
+// thread-safe; each thread owns its own arena, shared arenas are guarded
+// by their owner's mutex.
+class ProfilerArena {
+public:
+    explicit ProfilerArena(size_t blockSize = 64 * 1024) : blockSize(blockSize) {}
+
+    ProfilerArena(const ProfilerArena &) = delete;
+    ProfilerArena &operator=(const ProfilerArena &) = delete;
+
+    void *allocate(size_t size, size_t alignment, ProfilerMemory::Category category) {
+        uintptr_t start = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(alignment - 1);
+        if (!cursor || start + size > reinterpret_cast<uintptr_t>(limit)) {
+            size_t bytes = ProfilerMemory::pageRound(max(blockSize, size + alignment));
+            char *block = static_cast<char *>(ProfilerMemory::mapPages(bytes));
+            if (!block) {
+                return nullptr;
+            }
+            cursor = block;
+            limit = block + bytes;
+            start = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(alignment - 1);
+        }
+        cursor = reinterpret_cast<char *>(start + size);
+        ProfilerMemory::account(category, size);
+        return reinterpret_cast<void *>(start);
+    }
+
+    template <typename T, typename... Args>
+    T *create(ProfilerMemory::Category category, Args &&...args) {
+        void *slot = allocate(sizeof(T), alignof(T), category);
+        return slot ? new (slot) T(forward<Args>(args)...) : nullptr;
+    }
+
+    // Makes sure the next `bytes` of allocations come from pages that are
+    // already mapped and faulted in
+    bool reserve(size_t bytes) {
+        if (cursor && static_cast<size_t>(limit - cursor) >= bytes) {
+            return true;
+        }
+        size_t size = ProfilerMemory::pageRound(max(blockSize, bytes));
+        char *block = static_cast<char *>(ProfilerMemory::mapPages(size, true, true));
+        if (!block) {
+            return false;
+        }
+        cursor = block;
+        limit = block + size;
+        return true;
+    }
+
+private:
+    size_t blockSize;
+    char *cursor = nullptr;
+    char *limit = nullptr;
+};
+
+// Fixed-size object pool on top of an arena, for records that come and go
+template <typename T>
+class NodePool {
+public:
+    NodePool(ProfilerArena &arena, ProfilerMemory::Category category) : arena(arena), category(category) {}
+
+    template <typename... Args>
+    T *create(Args &&...args) {
+        void *slot = freeList;
+        if (slot) {
+            freeList = freeList->next;
+        } else {
+            slot = arena.allocate(sizeof(Slot), alignof(Slot), category);
+            if (!slot) {
+                return nullptr;
+            }
+        }
+        return new (slot) T(forward<Args>(args)...);
+    }
+
+    void destroy(T *object) {
+        object->~T();
+        FreeSlot *slot = reinterpret_cast<FreeSlot *>(object);
+        slot->next = freeList;
+        freeList = slot;
+    }
+
+private:
+    struct FreeSlot {
+        FreeSlot *next;
+    };
+    union Slot {
+        FreeSlot free;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    ProfilerArena &arena;
+    ProfilerMemory::Category category;
+    FreeSlot *freeList = nullptr;
+};
+
+// Growable array of trivially copyable elements backed by ProfilerMemory
+// pages, used for per-thread event buffers. Growth returns false instead
+// of allocating once the memory limit is reached.
+template <typename T>
+class PagedBuffer {
+public:
+    explicit PagedBuffer(ProfilerMemory::Category category) : category(category) {}
+
+    PagedBuffer(const PagedBuffer &) = delete;
+    PagedBuffer &operator=(const PagedBuffer &) = delete;
+
+    ~PagedBuffer() {
+        if (items) {
+            ProfilerMemory::unmapPages(items, mappedBytes);
+        }
+    }
+
+    bool reserve(size_t minimum, bool prefault = false) {
+        if (minimum <= capacity) {
+            return true;
+        }
+        size_t bytes = ProfilerMemory::pageRound(max(minimum, capacity * 2) * sizeof(T));
+        T *larger = static_cast<T *>(ProfilerMemory::mapPages(bytes, true, prefault));
+        if (!larger) {
+            return false;
+        }
+        if (count > 0) {
+            memcpy(larger, items, count * sizeof(T));
+        }
+        if (items) {
+            ProfilerMemory::unmapPages(items, mappedBytes);
+        }
+        ProfilerMemory::account(category, bytes - mappedBytes);
+        items = larger;
+        mappedBytes = bytes;
+        capacity = bytes / sizeof(T);
+        return true;
+    }
+
+    bool push_back(const T &value) {
+        if (count == capacity && !reserve(count + 1)) {
+            return false;
+        }
+        items[count++] = value;
+        return true;
+    }
+
+    // Only shrinks, or grows within the reserved capacity
+    void resize(size_t size) { count = min(size, capacity); }
+
+    void pop_back() { --count; }
+    void clear() { count = 0; }
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    T *data() { return items; }
+    const T *begin() const { return items; }
+    const T *end() const { return items + count; }
+
+private:
+    ProfilerMemory::Category category;
+    T *items = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t mappedBytes = 0;
+};
+
+// Formats text into a fixed stack buffer and emits it with write(2); the
+// only output path used from inside signal handlers
+class SignalSafeWriter {
+public:
+    explicit SignalSafeWriter(int fd) : fd(fd) {}
+
+    ~SignalSafeWriter() { flush(); }
+
+    SignalSafeWriter &operator<<(const char *text) {
+        while (*text) {
+            put(*text++);
+        }
+        return *this;
+    }
+
+    SignalSafeWriter &operator<<(long long value) {
+        char digits[24];
+        int count = 0;
+        unsigned long long magnitude = value < 0 ? 0ULL - static_cast<unsigned long long>(value) : value;
+        do {
+            digits[count++] = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+        if (value < 0) {
+            put('-');
+        }
+        while (count > 0) {
+            put(digits[--count]);
+        }
+        return *this;
+    }
+
+    void flush() {
+        size_t done = 0;
+        while (done < used) {
+            ssize_t written = ::write(fd, buffer + done, used - done);
+            if (written <= 0) {
+                break;
+            }
+            done += static_cast<size_t>(written);
+        }
+        used = 0;
+    }
+
+private:
+    void put(char c) {
+        if (used == sizeof(buffer)) {
+            flush();
+        }
+        buffer[used++] = c;
+    }
+
+    int fd;
+    char buffer[4096];
+    size_t used = 0;
+};
+
+// Maps function names to small integer IDs so traces and hot-path lookups
+// don't have to carry strings around. Names are copied into the registry
+// arena once, when a call site is first reached.
+class FunctionRegistry {
+public:
+    static const uint32_t kUnknown = UINT32_MAX;
+
+    static uint32_t intern(string_view name) {
+        lock_guard<mutex> guard(registryMutex);
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        char *stored = static_cast<char *>(arena.allocate(name.size() + 1, 1, ProfilerMemory::Names));
+        if (!stored) {
+            return kUnknown;
+        }
+        memcpy(stored, name.data(), name.size());
+        stored[name.size()] = '\0';
+
+        uint32_t id = static_cast<uint32_t>(names.size());
+        names.push_back(stored);
+        ids.emplace(string_view(stored, name.size()), id);
+        if (id < kMaxSignalSafeNames) {
+            signalSafeNames[id].store(stored, memory_order_release);
+        }
+        return id;
+    }
+
+    // Names are never freed, so the pointer stays valid for the whole run
+    static const char *nameOf(uint32_t id) {
+        if (id < kMaxSignalSafeNames) {
+            return signalSafeName(id);
+        }
+        lock_guard<mutex> guard(registryMutex);
+        return id < names.size() ? names[id] : "(unknown)";
+    }
+
+    static string name(uint32_t id) {
+        return nameOf(id);
+    }
+
+    // Lock- and allocation-free lookup for use inside signal handlers
+    static const char *signalSafeName(uint32_t id) {
+        const char *name = id < kMaxSignalSafeNames ? signalSafeNames[id].load(memory_order_acquire) : nullptr;
+        return name ? name : "(unknown)";
+    }
+
+    // Room for `functions` names, so interning them doesn't rehash or
+    // map memory
+    static void reserve(size_t functions) {
+        lock_guard<mutex> guard(registryMutex);
+        ids.reserve(functions);
+        names.reserve(functions);
+        arena.reserve(functions * 32);
+    }
+
+    // Names interned at or after `from`, used to stream the name table
+    static vector<string> namesSince(uint32_t from) {
+        lock_guard<mutex> guard(registryMutex);
+        if (from >= names.size()) {
+            return {};
+        }
+        return vector<string>(names.begin() + from, names.end());
+    }
+
+private:
+    static const uint32_t kMaxSignalSafeNames = 65536;
+
+    static mutex registryMutex;
+    static ProfilerArena arena;
+    static unordered_map<string_view, uint32_t> ids;
+    static vector<const char *> names;
+    static atomic<const char *> signalSafeNames[kMaxSignalSafeNames];
+};
+
+inline mutex FunctionRegistry::registryMutex;
+inline ProfilerArena FunctionRegistry::arena(16 * 1024);
+inline unordered_map<string_view, uint32_t> FunctionRegistry::ids;
+inline vector<const char *> FunctionRegistry::names;
+inline atomic<const char *> FunctionRegistry::signalSafeNames[FunctionRegistry::kMaxSignalSafeNames];
+
+// Fixed-size per-thread copy of the call stack as function IDs. Slots
+// live in a static table so a signal handler can walk every thread's
+// stack without locks or allocation, even for threads that are exiting.
+// A thread claiming a slot also gets an alternate signal stack, so the
+// crash handler can still run on it after a stack overflow.
+class ShadowStack {
+public:
+    static const int kMaxThreads = 256;
+    static const int kMaxDepth = 256;
+
+    struct Slot {
+        atomic<bool> inUse{false};
+        atomic<int> depth{0};  // May exceed kMaxDepth; deeper frames aren't stored
+        atomic<uint32_t> frames[kMaxDepth];
+        uint32_t thread = 0;
+        pid_t tid = 0;
+    };
+
+    static void push(uint32_t functionId) {
+        Slot *slot = local.slot;
+        if (!slot) {
+            return;
+        }
+        int depth = slot->depth.load(memory_order_relaxed);
+        if (depth < kMaxDepth) {
+            slot->frames[depth].store(functionId, memory_order_relaxed);
+        }
+        slot->depth.store(depth + 1, memory_order_release);
+    }
+
+    static void pop() {
+        Slot *slot = local.slot;
+        if (slot) {
+            slot->depth.store(slot->depth.load(memory_order_relaxed) - 1, memory_order_release);
+        }
+    }
+
+    static Slot &slot(int index) { return slots[index]; }
+
+    // Claims the calling thread's slot (and signal stack) now instead of
+    // on its first call; false if there was no slot left
+    static bool prepareThread() { return local.slot != nullptr; }
+
+private:
+    // Claims a slot for the thread on first use and frees it at thread exit
+    struct Holder {
+        Slot *slot = nullptr;
+        void *signalStack = nullptr;
+        size_t signalStackSize = ProfilerMemory::pageRound(max<size_t>(SIGSTKSZ, 64 * 1024));
+
+        Holder() {
+            // Kept if the program already gave the thread one
+            stack_t current{};
+            if (sigaltstack(nullptr, &current) == 0 && (current.ss_flags & SS_DISABLE)) {
+                signalStack = mmap(nullptr, signalStackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                stack_t ss{};
+                ss.ss_sp = signalStack;
+                ss.ss_size = signalStackSize;
+                if (signalStack == MAP_FAILED || sigaltstack(&ss, nullptr) != 0) {
+                    if (signalStack != MAP_FAILED) {
+                        munmap(signalStack, signalStackSize);
+                    }
+                    signalStack = nullptr;
+                }
+            }
+            for (Slot &candidate : slots) {
+                bool expected = false;
+                if (candidate.inUse.compare_exchange_strong(expected, true)) {
+                    candidate.depth.store(0, memory_order_relaxed);
+                    candidate.thread = threadCounter++;
+                    candidate.tid = static_cast<pid_t>(syscall(SYS_gettid));
+                    slot = &candidate;
+                    return;
+                }
+            }
+            // More than kMaxThreads live threads: this one goes unrecorded
+        }
+
+        ~Holder() {
+            if (slot) {
+                slot->inUse.store(false, memory_order_release);
+            }
+            if (signalStack) {
+                stack_t ss{};
+                ss.ss_flags = SS_DISABLE;
+                sigaltstack(&ss, nullptr);
+                munmap(signalStack, signalStackSize);
+            }
+        }
+    };
+
+    static Slot slots[kMaxThreads];
+    static thread_local Holder local;
+    static atomic<uint32_t> threadCounter;
+};
+
+inline ShadowStack::Slot ShadowStack::slots[ShadowStack::kMaxThreads];
+inline thread_local ShadowStack::Holder ShadowStack::local;
+inline atomic<uint32_t> ShadowStack::threadCounter{0};
+
+// Single-writer counter update. Only the owning thread writes these
+// counters and readers just need untorn values, so a plain load and store
+// is enough; no locked read-modify-write on the hot path.
+template <typename T>
+inline void bump(atomic<T> &counter, T amount) {
+    counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Lock statistics attached to a lock pseudo-frame in a context tree
+struct LiveLockInfo {
+    atomic<long long> waitTime{0};     // ns
+    atomic<long long> holdTime{0};     // ns
+    atomic<long long> condWaitTime{0}; // ns
+    atomic<long long> acquireCount{0};
+    atomic<long long> contentionCount{0};
+    atomic<long long> condWaitCount{0};
+};
+
+// Recursion-depth histogram of a folded context: how deep each outermost
+// activation nested, in power-of-two buckets (1, 2-3, 4-7, ...)
+struct LiveRecursion {
+    static const int kBuckets = 16;
+
+    static int bucket(int depth) {
+        return min(kBuckets - 1, 31 - __builtin_clz(static_cast<unsigned>(depth)));
+    }
+
+    atomic<long long> depthCounts[kBuckets] = {};
+};
+
+struct LiveExemplars;
+
+// Where the calling thread runs, for placement tracking. On x86-64 Linux
+// the kernel sets rdtscp's aux value to (node << 12 | cpu) on every CPU,
+// which is cheaper to read than calling sched_getcpu(); elsewhere the NUMA
+// node is looked up in a table read from sysfs.
+class CpuPlacement {
+public:
+    static const uint32_t kMaxNodes = 8;  // Higher nodes are counted as the last one
+
+    struct Location {
+        uint32_t cpu;
+        uint32_t node;
+    };
+
+    static void init() {
+        for (uint32_t node = 0; node < 1024; ++node) {
+            ifstream cpuList("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+            string ranges;
+            if (!cpuList || !getline(cpuList, ranges)) {
+                continue;
+            }
+            // "0-3,8-11"
+            for (size_t start = 0; start < ranges.size();) {
+                size_t end = ranges.find(',', start);
+                string range = ranges.substr(start, end == string::npos ? string::npos : end - start);
+                size_t dash = range.find('-');
+                uint32_t first = static_cast<uint32_t>(strtoul(range.c_str(), nullptr, 10));
+                uint32_t last = dash == string::npos ? first : static_cast<uint32_t>(strtoul(range.c_str() + dash + 1, nullptr, 10));
+                if (cpuNodes.size() <= last) {
+                    cpuNodes.resize(last + 1, 0);
+                }
+                for (uint32_t cpu = first; cpu <= last; ++cpu) {
+                    cpuNodes[cpu] = min(node, kMaxNodes - 1);
+                }
+                start = end == string::npos ? ranges.size() : end + 1;
+            }
+        }
+#if defined(__x86_64__)
+        unsigned eax, ebx, ecx, edx;
+        useRdtscp = __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & (1u << 27));
+#endif
+    }
+
+    static Location current() {
+#if defined(__x86_64__)
+        if (useRdtscp) {
+            unsigned aux;
+            __rdtscp(&aux);
+            return {aux & 0xFFF, min(aux >> 12, kMaxNodes - 1)};
+        }
+#endif
+        int cpu = sched_getcpu();
+        if (cpu < 0) {
+            return {0, 0};
+        }
+        return {static_cast<uint32_t>(cpu), static_cast<size_t>(cpu) < cpuNodes.size() ? cpuNodes[cpu] : 0};
+    }
+
+private:
+    static vector<uint32_t> cpuNodes;
+    static bool useRdtscp;
+};
+
+inline vector<uint32_t> CpuPlacement::cpuNodes;
+inline bool CpuPlacement::useRdtscp = false;
+
+// Placement of a context's calls (placement tracking): where its time was
+// spent and how often its thread was moved while it was the running call
+struct LivePlacement {
+    atomic<long long> nodeTime[CpuPlacement::kMaxNodes] = {};  // µs; a call that changed node is split evenly
+    atomic<long long> migrations{0};                           // CPU changes seen while it was running
+    atomic<long long> nodeMigrations{0};                       // Of those, changes of NUMA node
+};
+
+// Where a path ran, as reported
+struct PlacementInfo {
+    array<long long, CpuPlacement::kMaxNodes> nodeTime = {};  // µs per NUMA node
+    long long migrations = 0;
+    long long nodeMigrations = 0;
+};
+
+// One node of a thread's calling-context tree: a function reached through
+// one particular chain of callers. Children are appended to a sibling list
+// with a release store, so reports and crash dumps can walk a tree while
+// its thread keeps extending it.
+struct ContextNode {
+    // Recursion: folded back edge to an ancestor. Counter: a LOG_COUNT
+    // counter, with its sum in totalTime and number of updates in callCount.
+    enum Kind : uint8_t { Function, Lock, Recursion, Counter };
+
+    ContextNode(uint32_t functionId, Kind kind, ContextNode *parent)
+        : functionId(functionId), kind(kind), parent(parent) {}
+
+    uint32_t functionId;
+    Kind kind;
+    ContextNode *parent;
+    atomic<ContextNode *> firstChild{nullptr};
+    atomic<ContextNode *> nextSibling{nullptr};
+    atomic<long long> entries{0};    // Calls started; call-graph edge counts
+    atomic<long long> callCount{0};  // Calls completed
+    atomic<long long> totalTime{0};  // µs, completed calls only
+    atomic<long long> selfTime{0};   // µs, totalTime minus the time spent in callees
+    LiveLockInfo *lock = nullptr;    // Lock nodes only
+    atomic<LiveRecursion *> recursion{nullptr};  // Folded contexts that recursed
+    atomic<LiveExemplars *> exemplars{nullptr};  // Exemplar mode only
+    atomic<LivePlacement *> placement{nullptr};  // Placement tracking only
+    int active = 0;                  // Activations in flight (folding mode; owner thread only)
+    int deepest = 0;                 // Deepest nesting of the current outermost activation
+    uint32_t sharedNode = 0;         // SharedProfileStore slot + 1 (owner thread only)
+};
+
+// Test-and-test-and-set lock for per-thread structures that are only
+// contended when a report reads them
+class SpinLock {
+public:
+    void lock() {
+        while (locked.exchange(true, memory_order_acquire)) {
+            while (locked.load(memory_order_relaxed)) {
+                this_thread::yield();
+            }
+        }
+    }
+
+    bool try_lock() { return !locked.exchange(true, memory_order_acquire); }
+
+    void unlock() { locked.store(false, memory_order_release); }
+
+private:
+    atomic<bool> locked{false};
+};
+
+// A completed call, as kept for exemplar sub-traces
+struct TraceRecord {
+    uint32_t functionId;
+    uint32_t depth;      // Nesting level on its thread; 1 for an outermost call
+    uint64_t start;      // ns
+    long long duration;  // µs
+};
+
+// The slowest calls of one context (Logger::setExemplars), each with the
+// calls made beneath it. The slots are a min-heap on duration, so the bar
+// a new call has to clear is a single relaxed load; only calls that clear
+// it take the lock.
+struct LiveExemplars {
+    struct Exemplar {
+        long long duration;  // µs
+        uint64_t start;      // ns
+        uint32_t callCount;  // Entries of `calls` in use, in start order
+        bool truncated;      // Some of the calls beneath it weren't kept
+        TraceRecord *calls;
+    };
+
+    explicit LiveExemplars(long long threshold = -1) : threshold(threshold) {}
+
+    atomic<long long> threshold;  // Shortest kept duration once every slot is used
+    mutable SpinLock lock;
+    uint32_t used = 0;
+    Exemplar *slots = nullptr;
+};
+
+// Bounded-memory summary of the heaviest calling-context paths, used
+// instead of the context tree when Logger::setBoundedPaths() is on.
+//
+// Time is tracked with weighted Space-Saving: k counters, and a path that
+// isn't tracked evicts the counter with the least time and inherits that
+// time as its error. Every path with more than total/k µs is guaranteed to
+// be present and no estimate is over by more than total/k. Call counts come
+// from a Count-Min sketch (an upper bound, over by at most e*calls/width
+// with probability 1 - e^-depth) paired with the exact count since the
+// path was last inserted (a lower bound).
+class PathSketch {
+public:
+    static const int kMaxPathDepth = 64;
+    static const int kCountMinDepth = 4;
+
+    struct Counter {
+        uint64_t key;
+        long long time;         // Upper bound on the path's total time (µs)
+        long long timeError;    // time - timeError is a lower bound
+        long long callsSince;   // Calls since insertion, a lower bound
+        uint16_t depth;         // Innermost frames kept, outermost first
+        bool truncated;         // Outer frames didn't fit
+        uint32_t frames[kMaxPathDepth];
+    };
+
+    // All storage comes from `arena`; returns false if it can't be had
+    bool init(ProfilerArena &arena, size_t counters) {
+        capacity = max<size_t>(1, counters);
+        slotMask = 1;
+        while (slotMask < capacity * 2) {
+            slotMask <<= 1;
+        }
+        // Count-Min cells are small, so the rows are made much wider than
+        // the counter table to keep the call-count error low
+        countMinWidth = slotMask * 8;
+        slotMask -= 1;
+        auto category = ProfilerMemory::PathSketches;
+        table = static_cast<Counter *>(arena.allocate(sizeof(Counter) * capacity, alignof(Counter), category));
+        heap = static_cast<uint32_t *>(arena.allocate(sizeof(uint32_t) * capacity * 2, alignof(uint32_t), category));
+        slots = static_cast<int32_t *>(arena.allocate(sizeof(int32_t) * (slotMask + 1), alignof(int32_t), category));
+        countMin = static_cast<long long *>(arena.allocate(sizeof(long long) * countMinWidth * kCountMinDepth,
+                                                           alignof(long long), category));
+        if (!table || !heap || !slots || !countMin) {
+            capacity = 0;
+            return false;
+        }
+        heapIndex = heap + capacity;
+        fill(slots, slots + slotMask + 1, -1);
+        fill(countMin, countMin + countMinWidth * kCountMinDepth, 0LL);
+        return true;
+    }
+
+    // `path` holds the innermost `depth` frames, outermost first
+    void add(uint64_t key, long long time, const uint32_t *path, size_t depth, bool truncated) {
+        if (capacity == 0) {
+            return;
+        }
+        totalTime += time;
+        for (int row = 0; row < kCountMinDepth; ++row) {
+            countMin[row * countMinWidth + countMinColumn(key, row)] += 1;
+        }
+
+        int32_t index = find(key);
+        if (index < 0) {
+            if (used < capacity) {
+                index = static_cast<int32_t>(used++);
+                table[index] = Counter{key, 0, 0, 0, 0, false, {}};
+                heap[index] = index;
+                heapIndex[index] = index;
+                siftUp(index);
+            } else {
+                // Evict the minimum: the newcomer inherits its time as error
+                index = static_cast<int32_t>(heap[0]);
+                erase(table[index].key);
+                table[index].key = key;
+                table[index].timeError = table[index].time;
+                table[index].callsSince = 0;
+            }
+            insert(key, index);
+            storePath(table[index], path, depth, truncated);
+        }
+        table[index].time += time;
+        table[index].callsSince += 1;
+        siftDown(heapIndex[index]);
+    }
+
+    size_t size() const { return used; }
+    size_t limit() const { return capacity; }
+    bool full() const { return capacity > 0 && used == capacity; }
+    const Counter &counter(size_t i) const { return table[i]; }
+    long long minTime() const { return full() ? table[heap[0]].time : 0; }
+    long long total() const { return totalTime; }
+    size_t width() const { return countMinWidth; }
+
+    // Count-Min sketches with the same width merge by adding cells
+    void addCountsTo(vector<long long> &cells) const {
+        cells.resize(countMinWidth * kCountMinDepth, 0);
+        for (size_t i = 0; i < cells.size(); ++i) {
+            cells[i] += countMin[i];
+        }
+    }
+
+    static size_t countMinColumn(uint64_t key, int row, size_t width) {
+        uint64_t h = (key ^ (0x9E3779B97F4A7C15ULL * (row + 1))) * 0xBF58476D1CE4E5B9ULL;
+        return static_cast<size_t>(h >> 32) & (width - 1);
+    }
+
+private:
+    size_t countMinColumn(uint64_t key, int row) const { return countMinColumn(key, row, countMinWidth); }
+
+    static void storePath(Counter &counter, const uint32_t *path, size_t depth, bool truncated) {
+        size_t keep = min<size_t>(depth, kMaxPathDepth);
+        copy(path + depth - keep, path + depth, counter.frames);
+        counter.depth = static_cast<uint16_t>(keep);
+        counter.truncated = truncated || keep < depth;
+    }
+
+    int32_t find(uint64_t key) const {
+        for (size_t slot = key & slotMask;; slot = (slot + 1) & slotMask) {
+            int32_t index = slots[slot];
+            if (index < 0 || table[index].key == key) {
+                return index;
+            }
+        }
+    }
+
+    void insert(uint64_t key, int32_t index) {
+        size_t slot = key & slotMask;
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & slotMask;
+        }
+        slots[slot] = index;
+    }
+
+    // Linear-probing delete with backward shift, so no tombstones build up
+    void erase(uint64_t key) {
+        size_t slot = key & slotMask;
+        while (table[slots[slot]].key != key) {
+            slot = (slot + 1) & slotMask;
+        }
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & slotMask; slots[next] >= 0; next = (next + 1) & slotMask) {
+            size_t home = table[slots[next]].key & slotMask;
+            // Move the entry back if its home isn't in (hole, next]
+            if (((next - home) & slotMask) >= ((next - hole) & slotMask)) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole] = -1;
+    }
+
+    void swapHeap(size_t a, size_t b) {
+        swap(heap[a], heap[b]);
+        heapIndex[heap[a]] = static_cast<uint32_t>(a);
+        heapIndex[heap[b]] = static_cast<uint32_t>(b);
+    }
+
+    void siftUp(size_t pos) {
+        while (pos > 0 && table[heap[(pos - 1) / 2]].time > table[heap[pos]].time) {
+            swapHeap(pos, (pos - 1) / 2);
+            pos = (pos - 1) / 2;
+        }
+    }
+
+    void siftDown(size_t pos) {
+        for (;;) {
+            size_t smallest = pos;
+            for (size_t child = pos * 2 + 1; child <= pos * 2 + 2 && child < used; ++child) {
+                if (table[heap[child]].time < table[heap[smallest]].time) {
+                    smallest = child;
+                }
+            }
+            if (smallest == pos) {
+                return;
+            }
+            swapHeap(pos, smallest);
+            pos = smallest;
+        }
+    }
+
+    Counter *table = nullptr;
+    uint32_t *heap = nullptr;       // Min-heap of counter indices by time
+    uint32_t *heapIndex = nullptr;  // Counter index -> heap position
+    int32_t *slots = nullptr;       // Open-addressing index: key -> counter
+    long long *countMin = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t slotMask = 0;
+    size_t countMinWidth = 0;
+    long long totalTime = 0;
+};
+
+// Caller -> callee call counts by function ID, for the bounded mode that
+// doesn't keep a context tree. Edges are kept in first-call order with an
+// open-addressing index over them; the number of distinct edges is bounded
+// by the program, not by the length of the run.
+class EdgeTable {
+public:
+    struct Edge {
+        uint32_t caller;
+        uint32_t callee;
+        long long count;
+    };
+
+    void add(uint32_t caller, uint32_t callee) {
+        if ((edges.size() + 1) * 2 > slots.size() && !rehash(max<size_t>(64, slots.size() * 2))) {
+            return;
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t slot = hash(caller, callee) & mask;; slot = (slot + 1) & mask) {
+            int32_t index = slots.data()[slot];
+            if (index < 0) {
+                if (edges.push_back({caller, callee, 1})) {
+                    slots.data()[slot] = static_cast<int32_t>(edges.size() - 1);
+                }
+                return;
+            }
+            Edge &edge = edges.data()[index];
+            if (edge.caller == caller && edge.callee == callee) {
+                edge.count++;
+                return;
+            }
+        }
+    }
+
+    const Edge *begin() const { return edges.begin(); }
+    const Edge *end() const { return edges.end(); }
+
+private:
+    static size_t hash(uint32_t caller, uint32_t callee) {
+        return static_cast<size_t>(((static_cast<uint64_t>(caller) << 32 | callee) * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+
+    bool rehash(size_t size) {
+        if (!slots.reserve(size)) {
+            return false;
+        }
+        slots.resize(size);
+        fill(slots.data(), slots.data() + size, -1);
+        for (size_t i = 0; i < edges.size(); ++i) {
+            const Edge &edge = edges.begin()[i];
+            size_t slot = hash(edge.caller, edge.callee) & (size - 1);
+            while (slots.data()[slot] >= 0) {
+                slot = (slot + 1) & (size - 1);
+            }
+            slots.data()[slot] = static_cast<int32_t>(i);
+        }
+        return true;
+    }
+
+    PagedBuffer<Edge> edges{ProfilerMemory::PathSketches};
+    PagedBuffer<int32_t> slots{ProfilerMemory::PathSketches};
+};
+
+// Per-thread profiling state: the calling-context tree with the arena and
+// node pool it lives in (or, in bounded mode, the path sketch), and the
+// instrumented locks currently held.
+// Profiles stay mapped, so data from threads that have exited stays
+// available to reports and crash dumps. Once its graph is destroyed, a
+// profile is reused for the next graph its thread attaches to, or by any
+// thread once its own has exited.
+class ThreadProfile {
+public:
+    static const int kMaxHeldLocks = 64;
+
+    struct HeldLock {
+        const void *lock;
+        ContextNode *node;
+        high_resolution_clock::time_point acquiredAt;
+    };
+
+    // The calling thread's profile for `owner` (a CallGraph's id())
+    static ThreadProfile &forOwner(uint64_t owner) {
+        ThreadProfile *profile = local;
+        if (profile && profile->owner.load(memory_order_relaxed) == owner) {
+            return *profile;
+        }
+        return attach(owner);
+    }
+
+    // Called as `owner`'s graph is destroyed: its profiles become free for
+    // reuse, right away for threads that have exited
+    static void retire(uint64_t owner) {
+        lock_guard<mutex> guard(freeMutex);
+        for (ThreadProfile *profile = first(); profile; profile = profile->next) {
+            if (profile->owner.load(memory_order_relaxed) == owner) {
+                profile->owner.store(kRetired, memory_order_relaxed);
+                if (profile->exited) {
+                    profile->release();
+                }
+            }
+        }
+    }
+
+    // All profiles, newest first; safe to walk at any time
+    static ThreadProfile *first() { return all.load(memory_order_acquire); }
+    ThreadProfile *nextProfile() const { return next; }
+
+    ContextNode *child(ContextNode *parent, uint32_t functionId, ContextNode::Kind kind = ContextNode::Function) {
+        CacheEntry &cached = cacheSlot(parent, functionId);
+        if (cached.parent == parent && cached.functionId == functionId && cached.kind == kind && !cached.folded) {
+            return cached.node;
+        }
+
+        ContextNode *last = nullptr;
+        for (ContextNode *node = parent->firstChild.load(memory_order_relaxed); node;
+             node = node->nextSibling.load(memory_order_relaxed)) {
+            if (node->functionId == functionId && node->kind == kind) {
+                cached = {parent, functionId, kind, false, node};
+                return node;
+            }
+            last = node;
+        }
+
+        LiveLockInfo *lockInfo = nullptr;
+        if (kind == ContextNode::Lock && !(lockInfo = arena.create<LiveLockInfo>(ProfilerMemory::LockRecords))) {
+            return capped();
+        }
+        ContextNode *node = nodes.create(functionId, kind, parent);
+        if (!node) {
+            return capped();
+        }
+        node->lock = lockInfo;
+        (last ? last->nextSibling : parent->firstChild).store(node, memory_order_release);
+        cached = {parent, functionId, kind, false, node};
+        return node;
+    }
+
+    // Recursion folding (setRecursionFolding): a call to a function that is
+    // already on the context's ancestor chain re-enters that ancestor's node
+    // instead of growing the tree, so direct and mutual recursion cost one
+    // node per function. The back edge is kept as a Recursion pseudo-child
+    // of the caller for the call graph.
+    ContextNode *enterFolded(ContextNode *parent, uint32_t functionId) {
+        CacheEntry &cached = cacheSlot(parent, functionId);
+        ContextNode *node;
+        if (cached.parent == parent && cached.functionId == functionId && cached.kind == ContextNode::Function &&
+            cached.folded) {
+            node = cached.node;
+        } else {
+            node = parent;
+            while (node->parent && !(node->functionId == functionId && node->kind == ContextNode::Function)) {
+                node = node->parent;
+            }
+            if (!node->parent) {
+                node = child(parent, functionId);
+            }
+            cached = {parent, functionId, ContextNode::Function, true, node};
+        }
+
+        if (node->parent == parent || node == &overflow) {
+            bump(node->entries, 1LL);
+        } else {
+            ContextNode *backEdge = child(parent, functionId, ContextNode::Recursion);
+            if (backEdge->kind == ContextNode::Recursion) {
+                bump(backEdge->entries, 1LL);
+            }
+        }
+
+        // Only the outermost activation adds to the inclusive time; nested
+        // ones just extend its depth
+        if (++node->active == 1) {
+            node->deepest = 1;
+        } else {
+            node->deepest = max(node->deepest, node->active);
+            if (node->active == 2 && !node->recursion.load(memory_order_relaxed)) {
+                LiveRecursion *recursion = arena.create<LiveRecursion>(ProfilerMemory::ContextNodes);
+                if (recursion) {
+                    // Every activation completed so far had depth 1
+                    recursion->depthCounts[0].store(node->callCount.load(memory_order_relaxed), memory_order_relaxed);
+                    node->recursion.store(recursion, memory_order_release);
+                }
+            }
+        }
+        return node;
+    }
+
+    void exitFolded(ContextNode *node, long long duration) {
+        bump(node->callCount, 1LL);
+        if (--node->active == 0) {
+            bump(node->totalTime, duration);
+            LiveRecursion *recursion = node->recursion.load(memory_order_relaxed);
+            if (recursion) {
+                bump(recursion->depthCounts[LiveRecursion::bucket(node->deepest)], 1LL);
+            }
+        }
+    }
+
+    // Call before any instrumented code runs; bounded mode takes precedence
+    static void setRecursionFolding(bool enabled) { foldRecursion = enabled; }
+    static bool recursionFolding() { return foldRecursion; }
+
+    // Bounded mode (setPathLimit): instead of growing the context tree,
+    // calls are folded into a fixed-size sketch of the heaviest paths.
+    // enterPath returns the caller's path hash for exitPath to restore.
+    uint64_t enterPath(uint32_t functionId) {
+        uint64_t callerHash = pathHash;
+        lock_guard<SpinLock> guard(pathLock);
+        if (!pathsInitialized) {
+            pathsInitialized = true;
+            paths.init(arena, pathLimit());
+        }
+        if (!pathIds.empty() && droppedFrames == 0) {
+            pathEdges.add(pathIds.begin()[pathIds.size() - 1], functionId);
+        }
+        if (droppedFrames > 0 || !pathIds.push_back(functionId)) {
+            droppedFrames++;  // Memory limit reached; the path is marked truncated
+        }
+        uint64_t h = (pathHash ^ functionId) * 0xFF51AFD7ED558CCDULL;
+        pathHash = h ^ (h >> 33) ^ 0x9E3779B97F4A7C15ULL;
+        return callerHash;
+    }
+
+    void exitPath(uint64_t callerHash, long long duration) {
+        lock_guard<SpinLock> guard(pathLock);
+        paths.add(pathHash, duration, pathIds.begin(), pathIds.size(), droppedFrames > 0);
+        if (droppedFrames > 0) {
+            droppedFrames--;
+        } else {
+            pathIds.pop_back();
+        }
+        pathHash = callerHash;
+    }
+
+    // Hands the sketch and edge table to `read` while holding them still
+    template <typename Read>
+    void readPaths(Read read) const {
+        lock_guard<SpinLock> guard(pathLock);
+        read(paths, pathEdges);
+    }
+
+    // For crash dumps only: the lock is never released on success
+    const PathSketch *tryLockPaths() const {
+        return pathLock.try_lock() ? &paths : nullptr;
+    }
+
+    // 0 (the default) keeps the exact context tree; call before any
+    // instrumented code runs
+    static void setPathLimit(size_t paths) { boundedPaths = paths; }
+    static size_t pathLimit() { return boundedPaths; }
+
+    // Exemplar mode (setExemplars): every completed call is appended to a
+    // ring of recent calls, and a call slower than its context's threshold
+    // copies the ring entries recorded since it started. enterExemplar
+    // returns that starting position for exitExemplar.
+    uint64_t enterExemplar() {
+        ++callDepth;
+        return recentCount;
+    }
+
+    void exitExemplar(ContextNode *node, uint64_t mark, uint64_t start, long long duration) {
+        LiveExemplars *exemplars = node->exemplars.load(memory_order_relaxed);
+        if (!exemplars) {
+            exemplars = createExemplars();
+            node->exemplars.store(exemplars, memory_order_release);
+        }
+        if (duration > exemplars->threshold.load(memory_order_relaxed)) {
+            capture(*exemplars, mark, start, duration);
+        }
+        if (recentCapacity > 0) {
+            recent[recentCount % recentCapacity] = {node->functionId, callDepth, start, duration};
+            recentCount++;
+        }
+        --callDepth;
+    }
+
+    // This thread's counterpart of `node`, which may belong to another
+    // thread's tree: the same chain of functions from the root, created
+    // here as needed. Used to carry a calling context across threads.
+    ContextNode *adopt(const ContextNode *node) {
+        const ContextNode *top = node;
+        while (top->parent) {
+            top = top->parent;
+        }
+        if (top == &root) {
+            return const_cast<ContextNode *>(node);
+        }
+        adoptPath.clear();
+        for (const ContextNode *n = node; n->parent; n = n->parent) {
+            if (!adoptPath.push_back(n->functionId)) {
+                return capped();
+            }
+        }
+        ContextNode *adopted = &root;
+        for (size_t i = adoptPath.size(); i > 0; --i) {
+            adopted = child(adopted, adoptPath.begin()[i - 1]);
+        }
+        return adopted;
+    }
+
+    // Placement tracking: `location` was sampled while `running` was the
+    // innermost call (its caller, for a sample taken on entry). A change of
+    // CPU since this thread's previous sample is a migration of that call.
+    void notePlacement(ContextNode *running, CpuPlacement::Location location) {
+        if (havePlacement && location.cpu != lastPlacement.cpu && running->parent) {
+            LivePlacement *placement = placementOf(running);
+            if (placement) {
+                bump(placement->migrations, 1LL);
+                if (location.node != lastPlacement.node) {
+                    bump(placement->nodeMigrations, 1LL);
+                }
+            }
+        }
+        lastPlacement = location;
+        havePlacement = true;
+    }
+
+    void addPlacementTime(ContextNode *node, uint32_t enterNode, uint32_t exitNode, long long duration) {
+        LivePlacement *placement = placementOf(node);
+        if (!placement) {
+            return;
+        }
+        if (enterNode == exitNode) {
+            bump(placement->nodeTime[enterNode], duration);
+        } else {
+            bump(placement->nodeTime[enterNode], duration / 2);
+            bump(placement->nodeTime[exitNode], duration - duration / 2);
+        }
+    }
+
+    // Call before any instrumented code runs
+    static void setPlacementTracking(bool enabled) { trackPlacement = enabled; }
+    static bool placementTracking() { return trackPlacement; }
+
+    // Calls kept per context, and calls kept beneath each of them; 0 (the
+    // default) disables exemplars. Call before any instrumented code runs.
+    static void setExemplarLimit(size_t calls, size_t subCalls) {
+        exemplarCalls = calls;
+        exemplarSubCalls = subCalls;
+    }
+    static size_t exemplarLimit() { return exemplarCalls; }
+
+    // Sets up what the first calls would otherwise: `contextBytes` of tree
+    // memory, mapped and faulted in, and the structures of the enabled
+    // modes. Call on the owning thread.
+    void prepare(size_t contextBytes) {
+        arena.reserve(contextBytes);
+        if (exemplarLimit() > 0) {
+            allocateRecent();
+        }
+        if (pathLimit() > 0) {
+            lock_guard<SpinLock> guard(pathLock);
+            if (!pathsInitialized) {
+                pathsInitialized = true;
+                paths.init(arena, pathLimit());
+            }
+        }
+    }
+
+    atomic<uint64_t> owner{kRetired};
+    uint32_t thread;
+    ContextNode root{FunctionRegistry::kUnknown, ContextNode::Function, nullptr};
+    ContextNode *current = &root;
+    HeldLock heldLocks[kMaxHeldLocks];
+    int heldLockCount = 0;
+    long long childTime = 0;  // µs spent in callees by the innermost active call
+
+private:
+    static const size_t kCacheSize = 1024;
+
+    // Folded lookups resolve to an ancestor rather than a child, so they
+    // are marked and never answer child() (as used by adopt)
+    struct CacheEntry {
+        ContextNode *parent;
+        uint32_t functionId;
+        ContextNode::Kind kind;
+        bool folded;
+        ContextNode *node;
+    };
+
+    // Recent calls are looked back on by exemplars; calls beneath an
+    // exemplar older than this many completions are lost
+    static const size_t kRecentCalls = 4096;
+
+    // Owner of profiles whose graph is gone (and of the fallback profile)
+    static const uint64_t kRetired = 0;
+
+    // `next` is passed in because a profile being reused is still linked, and
+    // other threads may be walking past it
+    ThreadProfile(uint32_t thread, ThreadProfile *next) : thread(thread), next(next) {}
+
+    // Contexts that can't get exemplar slots under the memory limit share
+    // one that nothing beats
+    LiveExemplars *createExemplars() {
+        static LiveExemplars unavailable(LLONG_MAX);
+
+        allocateRecent();
+        LiveExemplars *exemplars = arena.create<LiveExemplars>(ProfilerMemory::Exemplars);
+        void *slots = exemplars ? arena.allocate(exemplarCalls * sizeof(LiveExemplars::Exemplar),
+                                                 alignof(LiveExemplars::Exemplar), ProfilerMemory::Exemplars)
+                                : nullptr;
+        void *calls = slots ? arena.allocate(exemplarCalls * exemplarSubCalls * sizeof(TraceRecord),
+                                             alignof(TraceRecord), ProfilerMemory::Exemplars)
+                            : nullptr;
+        if (!calls) {
+            return &unavailable;
+        }
+        exemplars->slots = static_cast<LiveExemplars::Exemplar *>(slots);
+        for (size_t i = 0; i < exemplarCalls; ++i) {
+            exemplars->slots[i].calls = static_cast<TraceRecord *>(calls) + i * exemplarSubCalls;
+        }
+        return exemplars;
+    }
+
+    void capture(LiveExemplars &exemplars, uint64_t mark, uint64_t start, long long duration) {
+        lock_guard<SpinLock> guard(exemplars.lock);
+        bool replacing = exemplars.used == exemplarCalls;
+        LiveExemplars::Exemplar &slot = exemplars.slots[replacing ? 0 : exemplars.used++];
+        slot.duration = duration;
+        slot.start = start;
+
+        // Of the calls beneath this one that are still in the ring, keep the
+        // longest exemplarSubCalls, with depths relative to this call
+        uint64_t first = max(mark, recentCount > recentCapacity ? recentCount - recentCapacity : 0);
+        auto longer = [](const TraceRecord &a, const TraceRecord &b) { return a.duration > b.duration; };
+        uint32_t kept = 0;
+        for (uint64_t i = first; i < recentCount; ++i) {
+            TraceRecord record = recent[i % recentCapacity];
+            record.depth -= callDepth;
+            if (kept < exemplarSubCalls) {
+                slot.calls[kept++] = record;
+                push_heap(slot.calls, slot.calls + kept, longer);
+            } else if (record.duration > slot.calls[0].duration) {
+                pop_heap(slot.calls, slot.calls + kept, longer);
+                slot.calls[kept - 1] = record;
+                push_heap(slot.calls, slot.calls + kept, longer);
+            }
+        }
+        sort(slot.calls, slot.calls + kept, [](const TraceRecord &a, const TraceRecord &b) {
+            return a.start != b.start ? a.start < b.start : a.depth < b.depth;
+        });
+        slot.callCount = kept;
+        slot.truncated = first > mark || recentCount - first > kept;
+
+        // Restore the heap: the new slot only moves up, a replaced root down
+        size_t pos = replacing ? 0 : exemplars.used - 1;
+        while (!replacing && pos > 0 && exemplars.slots[(pos - 1) / 2].duration > exemplars.slots[pos].duration) {
+            swap(exemplars.slots[(pos - 1) / 2], exemplars.slots[pos]);
+            pos = (pos - 1) / 2;
+        }
+        while (replacing) {
+            size_t smallest = pos;
+            for (size_t c = 2 * pos + 1; c <= 2 * pos + 2 && c < exemplars.used; ++c) {
+                if (exemplars.slots[c].duration < exemplars.slots[smallest].duration) {
+                    smallest = c;
+                }
+            }
+            if (smallest == pos) {
+                break;
+            }
+            swap(exemplars.slots[smallest], exemplars.slots[pos]);
+            pos = smallest;
+        }
+        if (exemplars.used == exemplarCalls) {
+            exemplars.threshold.store(exemplars.slots[0].duration, memory_order_relaxed);
+        }
+    }
+
+    void allocateRecent() {
+        if (!recent && recentCapacity == 0) {
+            recent = static_cast<TraceRecord *>(
+                arena.allocate(kRecentCalls * sizeof(TraceRecord), alignof(TraceRecord), ProfilerMemory::Exemplars));
+            recentCapacity = recent ? kRecentCalls : 0;
+        }
+    }
+
+    CacheEntry &cacheSlot(const ContextNode *parent, uint32_t functionId) {
+        return cache[(reinterpret_cast<uintptr_t>(parent) / alignof(ContextNode) ^ functionId * 0x9E3779B1u) % kCacheSize];
+    }
+
+    // This thread's profiles by owner; when the thread exits, those whose
+    // graph is gone go on the free list (the rest when their graph goes)
+    struct Attached {
+        unordered_map<uint64_t, ThreadProfile *> byOwner;
+
+        ~Attached() {
+            lock_guard<mutex> guard(freeMutex);
+            for (const auto &entry : byOwner) {
+                ThreadProfile *profile = entry.second;
+                if (profile == &fallback()) {
+                    continue;
+                }
+                profile->exited = true;
+                if (profile->owner.load(memory_order_relaxed) == kRetired) {
+                    profile->release();
+                }
+            }
+            local = nullptr;
+        }
+    };
+
+    static ThreadProfile &attach(uint64_t owner) {
+        unordered_map<uint64_t, ThreadProfile *> &mine = attached.byOwner;
+        auto found = mine.find(owner);
+        if (found != mine.end()) {
+            local = found->second;
+            return *local;
+        }
+
+        // Reuse one of this thread's retired profiles, then one given up by
+        // an exited thread, before mapping a new one
+        static atomic<uint32_t> threadCounter{0};
+        ThreadProfile *profile = nullptr;
+        for (auto entry = mine.begin(); entry != mine.end(); ++entry) {
+            if (entry->second->owner.load(memory_order_relaxed) == kRetired && entry->second != &fallback()) {
+                profile = entry->second;
+                mine.erase(entry);
+                break;
+            }
+        }
+        if (!profile) {
+            lock_guard<mutex> guard(freeMutex);
+            if ((profile = freeProfiles)) {
+                freeProfiles = profile->nextFree;
+            }
+        }
+        if (profile) {
+            ThreadProfile *next = profile->next;
+            profile->~ThreadProfile();
+            new (profile) ThreadProfile(threadCounter++, next);
+        } else {
+            // Per-thread bookkeeping is always granted, outside the memory
+            // limit; the limit applies to what the thread records afterwards
+            size_t bytes = ProfilerMemory::pageRound(sizeof(ThreadProfile));
+            void *pages = ProfilerMemory::mapPages(bytes, false);
+            if (!pages) {
+                static atomic<bool> reported{false};
+                if (!reported.exchange(true)) {
+                    cerr << "Error: Could not map a thread profile; calls on such threads are not recorded." << endl;
+                }
+                mine[owner] = &fallback();
+                local = &fallback();
+                return fallback();
+            }
+            ProfilerMemory::account(ProfilerMemory::ThreadState, sizeof(ThreadProfile));
+            profile = new (pages) ThreadProfile(threadCounter++, all.load(memory_order_relaxed));
+            while (!all.compare_exchange_weak(profile->next, profile, memory_order_release)) {
+            }
+        }
+        profile->owner.store(owner, memory_order_release);
+        mine[owner] = profile;
+        local = profile;
+        return *profile;
+    }
+
+    // Taken when no pages can be mapped for a profile: shared by all such
+    // threads, never linked, so never reported. Its tree can't grow (the
+    // arena is out of pages too), so sharing it only mixes up its counters.
+    static ThreadProfile &fallback() {
+        static ThreadProfile profile(UINT32_MAX, nullptr);
+        return profile;
+    }
+
+    // Puts a retired profile whose thread has exited on the free list;
+    // freeMutex must be held
+    void release() {
+        nextFree = freeProfiles;
+        freeProfiles = this;
+    }
+
+    // Once the memory limit is hit, new contexts collapse into one node
+    ContextNode *capped() {
+        if (!overflowLinked) {
+            ContextNode *last = root.firstChild.load(memory_order_relaxed);
+            while (last && last->nextSibling.load(memory_order_relaxed)) {
+                last = last->nextSibling.load(memory_order_relaxed);
+            }
+            (last ? last->nextSibling : root.firstChild).store(&overflow, memory_order_release);
+            overflowLinked = true;
+        }
+        return &overflow;
+    }
+
+    ThreadProfile *next;
+    ThreadProfile *nextFree = nullptr;
+    bool exited = false;  // Under freeMutex
+    ProfilerArena arena;
+    NodePool<ContextNode> nodes{arena, ProfilerMemory::ContextNodes};
+    ContextNode overflow{FunctionRegistry::intern("[profiler memory cap]"), ContextNode::Function, &root};
+    bool overflowLinked = false;
+    CacheEntry cache[kCacheSize] = {};
+
+    // Bounded mode; the path stack is only touched by the owning thread
+    mutable SpinLock pathLock;
+    PathSketch paths;
+    EdgeTable pathEdges;
+    bool pathsInitialized = false;
+    PagedBuffer<uint32_t> pathIds{ProfilerMemory::PathSketches};
+    size_t droppedFrames = 0;
+    uint64_t pathHash = 0;
+
+    PagedBuffer<uint32_t> adoptPath{ProfilerMemory::ThreadState};
+
+    LivePlacement *placementOf(ContextNode *node) {
+        LivePlacement *placement = node->placement.load(memory_order_relaxed);
+        if (!placement && (placement = arena.create<LivePlacement>(ProfilerMemory::ContextNodes))) {
+            node->placement.store(placement, memory_order_release);
+        }
+        return placement;
+    }
+
+    // Placement tracking; owner thread only
+    CpuPlacement::Location lastPlacement = {0, 0};
+    bool havePlacement = false;
+
+    // Exemplar mode; owner thread only
+    TraceRecord *recent = nullptr;
+    size_t recentCapacity = 0;
+    uint64_t recentCount = 0;
+    uint32_t callDepth = 0;
+
+    static atomic<ThreadProfile *> all;
+    static thread_local ThreadProfile *local;
+    static thread_local Attached attached;
+    static mutex freeMutex;
+    static ThreadProfile *freeProfiles;
+    static size_t boundedPaths;
+    static bool foldRecursion;
+    static size_t exemplarCalls;
+    static size_t exemplarSubCalls;
+    static bool trackPlacement;
+};
+
+inline atomic<ThreadProfile *> ThreadProfile::all{nullptr};
+inline thread_local ThreadProfile *ThreadProfile::local = nullptr;
+inline thread_local ThreadProfile::Attached ThreadProfile::attached;
+inline mutex ThreadProfile::freeMutex;
+inline ThreadProfile *ThreadProfile::freeProfiles = nullptr;
+inline size_t ThreadProfile::boundedPaths = 0;
+inline bool ThreadProfile::foldRecursion = false;
+inline size_t ThreadProfile::exemplarCalls = 0;
+inline size_t ThreadProfile::exemplarSubCalls = 0;
+inline bool ThreadProfile::trackPlacement = false;
+
+// Plain-map view of a profile, as consumed by the reports
+struct ProfileTables {
+    map<string, vector<string>> callGraph;      // Each callee once, in first-call order
+    map<pair<string, string>, int> callCounts;
+    map<string, PathInfo> pathProfiles;
+    map<string, LockInfo> lockProfiles;
+    map<pair<string, string>, LockInfo> lockEdges;
+    map<string, array<long long, LiveRecursion::kBuckets>> recursionDepths;  // Folding mode
+    map<string, CounterInfo> counterProfiles;
+    map<string, PlacementInfo> placements;  // Placement tracking
+
+    // Bounded mode: estimates for the heaviest paths, heaviest first
+    struct HotPath {
+        string path;
+        long long time;       // µs, never below the true total
+        long long timeError;  // time - timeError never exceeds the true total
+        long long minCalls;
+        long long maxCalls;
+    };
+    vector<HotPath> hotPaths;
+    size_t hotPathLimit = 0;    // k; 0 when the exact context trees are used
+    long long sketchedTime = 0; // Total time fed to the sketches (µs)
+
+    // Exemplar mode: the slowest calls of each path, slowest first
+    struct ExemplarCall {
+        string function;
+        int depth;           // 1 for a direct callee
+        long long offset;    // µs after the exemplar started
+        long long duration;  // µs
+    };
+    struct Exemplar {
+        long long duration;  // µs
+        uint32_t thread;
+        bool truncated;
+        vector<ExemplarCall> calls;
+    };
+    map<string, vector<Exemplar>> exemplars;
+
+    // Imported profiles only have inclusive times: their self time is what
+    // the path's direct extensions don't account for. In path order every
+    // path's extensions directly follow it, so a stack of the current
+    // path's prefixes finds each parent in one pass.
+    void deriveSelfTimes() {
+        vector<long long> childTime(pathProfiles.size(), 0);
+        vector<pair<string_view, size_t>> prefixes;
+        size_t index = 0;
+        for (const auto &entry : pathProfiles) {
+            string_view path = entry.first;
+            size_t split = path.rfind(" -> ");
+            string_view parent = split == string_view::npos ? string_view() : path.substr(0, split);
+            // "a -> bb" starts with "a -> b" but doesn't extend it
+            while (!prefixes.empty() && !extends(path, prefixes.back().first)) {
+                prefixes.pop_back();
+            }
+            if (!prefixes.empty() && prefixes.back().first == parent) {
+                childTime[prefixes.back().second] += entry.second.totalTime;
+            }
+            prefixes.push_back({path, index++});
+        }
+        index = 0;
+        for (auto &entry : pathProfiles) {
+            if (entry.second.selfTime < 0) {
+                entry.second.selfTime = max(0LL, entry.second.totalTime - childTime[index]);
+            }
+            index++;
+        }
+    }
+
+    // Whether `path` is `prefix` followed by more frames
+    static bool extends(string_view path, string_view prefix) {
+        return path.size() > prefix.size() + 4 && path.compare(0, prefix.size(), prefix) == 0 &&
+               path.compare(prefix.size(), 4, " -> ") == 0;
+    }
+
+    // Whether `function` is a frame of `path` ("a -> b -> c")
+    static bool pathContains(string_view path, string_view function) {
+        for (size_t start = 0; start < path.size();) {
+            size_t end = path.find(" -> ", start);
+            if (path.substr(start, end == string_view::npos ? string_view::npos : end - start) == function) {
+                return true;
+            }
+            if (end == string_view::npos) {
+                break;
+            }
+            start = end + 4;
+        }
+        return false;
+    }
+
+    void addCall(const string &caller, const string &callee, int count) {
+        int &edgeCount = callCounts[{caller, callee}];
+        if (edgeCount == 0) {
+            callGraph[caller].push_back(callee);
+        }
+        edgeCount += count;
+    }
+};
+
+// Call graph flattened to integer node IDs with CSR adjacency, so
+// traversals neither recurse on the C++ stack nor compare strings. Memory
+// is a few ints per node and edge, and every traversal is O(V + E).
+class GraphTraversal {
+public:
+    explicit GraphTraversal(const map<string, vector<string>> &graph) {
+        // Callers get IDs first, in map order, so roots come out sorted
+        unordered_map<string, uint32_t> ids;
+        for (const auto &entry : graph) {
+            idOf(entry.first, ids);
+        }
+        vector<uint32_t> lastCaller;
+        for (const auto &entry : graph) {
+            uint32_t caller = static_cast<uint32_t>(offsets.size());
+            offsets.push_back(static_cast<uint32_t>(targets.size()));
+            // Each callee once, in first-call order
+            for (const string &calleeName : entry.second) {
+                uint32_t callee = idOf(calleeName, ids);
+                lastCaller.resize(names.size(), UINT32_MAX);
+                if (lastCaller[callee] != caller) {
+                    lastCaller[callee] = caller;
+                    targets.push_back(callee);
+                }
+            }
+        }
+        // Callee-only nodes have no edges
+        offsets.resize(names.size() + 1, static_cast<uint32_t>(targets.size()));
+    }
+
+    // Indented tree from the roots. A function's callees are expanded at
+    // its first occurrence only; later occurrences are marked, so shared
+    // subtrees and recursion show up without repeating output.
+    void writeTree(ostream &out) const {
+        vector<uint64_t> expanded(words()), onPath(words());
+        vector<Frame> stack;
+        for (uint32_t start : startOrder()) {
+            if (testBit(expanded, start)) {
+                continue;
+            }
+            out << names[start] << '\n';
+            setBit(expanded, start);
+            setBit(onPath, start);
+            stack.push_back({start, offsets[start]});
+            while (!stack.empty()) {
+                Frame &top = stack.back();
+                if (top.nextEdge == offsets[top.node + 1]) {
+                    clearBit(onPath, top.node);
+                    stack.pop_back();
+                    continue;
+                }
+                uint32_t callee = targets[top.nextEdge++];
+                out << string(stack.size() * 2, ' ') << names[callee];
+                if (testBit(onPath, callee)) {
+                    out << " (recursive)\n";
+                } else if (testBit(expanded, callee)) {
+                    out << " (see above)\n";
+                } else {
+                    out << '\n';
+                    setBit(expanded, callee);
+                    setBit(onPath, callee);
+                    stack.push_back({callee, offsets[callee]});
+                }
+            }
+        }
+    }
+
+    // Depth-first preorder, one "depth name" line per function
+    void writeDepthFirst(ostream &out) const {
+        vector<uint64_t> visited(words());
+        vector<Frame> stack;
+        for (uint32_t start : startOrder()) {
+            if (testBit(visited, start)) {
+                continue;
+            }
+            out << 0 << ' ' << names[start] << '\n';
+            setBit(visited, start);
+            stack.push_back({start, offsets[start]});
+            while (!stack.empty()) {
+                Frame &top = stack.back();
+                if (top.nextEdge == offsets[top.node + 1]) {
+                    stack.pop_back();
+                    continue;
+                }
+                uint32_t callee = targets[top.nextEdge++];
+                if (!testBit(visited, callee)) {
+                    out << stack.size() << ' ' << names[callee] << '\n';
+                    setBit(visited, callee);
+                    stack.push_back({callee, offsets[callee]});
+                }
+            }
+        }
+    }
+
+    // Breadth-first order, one "depth name" line per function
+    void writeBreadthFirst(ostream &out) const {
+        vector<uint64_t> visited(words());
+        vector<pair<uint32_t, uint32_t>> queue;  // (node, depth)
+        queue.reserve(names.size());
+        for (uint32_t start : startOrder()) {
+            if (testBit(visited, start)) {
+                continue;
+            }
+            size_t head = queue.size();
+            queue.push_back({start, 0});
+            setBit(visited, start);
+            for (; head < queue.size(); ++head) {
+                uint32_t node = queue[head].first;
+                uint32_t depth = queue[head].second;
+                out << depth << ' ' << names[node] << '\n';
+                for (uint32_t edge = offsets[node]; edge < offsets[node + 1]; ++edge) {
+                    if (!testBit(visited, targets[edge])) {
+                        setBit(visited, targets[edge]);
+                        queue.push_back({targets[edge], depth + 1});
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    struct Frame {
+        uint32_t node;
+        uint32_t nextEdge;
+    };
+
+    uint32_t idOf(const string &name, unordered_map<string, uint32_t> &ids) {
+        auto inserted = ids.emplace(name, static_cast<uint32_t>(names.size()));
+        if (inserted.second) {
+            names.push_back(name);
+        }
+        return inserted.first->second;
+    }
+
+    // Roots (in-degree 0) first, then every node a root doesn't reach,
+    // which only happens inside cycles
+    vector<uint32_t> startOrder() const {
+        vector<uint32_t> inDegree(names.size(), 0);
+        for (uint32_t callee : targets) {
+            inDegree[callee]++;
+        }
+        vector<uint32_t> order;
+        order.reserve(names.size());
+        for (uint32_t node = 0; node < names.size(); ++node) {
+            if (inDegree[node] == 0) {
+                order.push_back(node);
+            }
+        }
+        for (uint32_t node = 0; node < names.size(); ++node) {
+            if (inDegree[node] != 0) {
+                order.push_back(node);
+            }
+        }
+        return order;
+    }
+
+    size_t words() const { return (names.size() + 63) / 64; }
+    static bool testBit(const vector<uint64_t> &bits, uint32_t node) { return bits[node / 64] >> (node % 64) & 1; }
+    static void setBit(vector<uint64_t> &bits, uint32_t node) { bits[node / 64] |= 1ULL << (node % 64); }
+    static void clearBit(vector<uint64_t> &bits, uint32_t node) { bits[node / 64] &= ~(1ULL << (node % 64)); }
+
+    vector<string> names;
+    vector<uint32_t> offsets;  // Edges of node n are targets[offsets[n] .. offsets[n + 1])
+    vector<uint32_t> targets;
+};
+
+// Sorts a vector on all cores: chunks are sorted in parallel, then merged
+// pairwise in parallel rounds. `less` must be a strict weak ordering.
+template <typename T, typename Compare>
+void parallelSort(vector<T> &items, Compare less) {
+    const size_t kMinChunk = 16384;
+    size_t workers = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), items.size() / kMinChunk));
+    if (workers == 1) {
+        sort(items.begin(), items.end(), less);
+        return;
+    }
+
+    vector<size_t> bounds;
+    for (size_t w = 0; w <= workers; ++w) {
+        bounds.push_back(items.size() * w / workers);
+    }
+    vector<thread> threads;
+    for (size_t w = 0; w < workers; ++w) {
+        threads.emplace_back([&, w] { sort(items.begin() + bounds[w], items.begin() + bounds[w + 1], less); });
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+
+    while (bounds.size() > 2) {
+        vector<size_t> merged;
+        threads.clear();
+        for (size_t i = 0; i + 2 < bounds.size(); i += 2) {
+            size_t first = bounds[i], middle = bounds[i + 1], last = bounds[i + 2];
+            threads.emplace_back([&items, &less, first, middle, last] {
+                inplace_merge(items.begin() + first, items.begin() + middle, items.begin() + last, less);
+            });
+            merged.push_back(first);
+        }
+        if (bounds.size() % 2 == 0) {
+            merged.push_back(bounds[bounds.size() - 2]);  // Odd chunk out waits for the next round
+        }
+        merged.push_back(bounds.back());
+        for (thread &t : threads) {
+            t.join();
+        }
+        bounds.swap(merged);
+    }
+}
+
+// Text report builder that formats with to_chars into one growing buffer
+// and writes the whole file with a single write(2) loop
+class ReportBuffer {
+public:
+    void reserve(size_t bytes) { text.reserve(bytes); }
+    string_view view() const { return text; }
+
+    ReportBuffer &operator<<(string_view value) {
+        text.append(value);
+        return *this;
+    }
+
+    ReportBuffer &operator<<(char value) {
+        text.push_back(value);
+        return *this;
+    }
+
+    ReportBuffer &operator<<(long long value) {
+        char digits[24];
+        text.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+        return *this;
+    }
+
+    ReportBuffer &operator<<(double value) {
+        char digits[32];
+        text.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+        return *this;
+    }
+
+    // Left-aligned in a column of `width` characters, with at least one
+    // space after it when it overflows
+    void cell(string_view value, size_t width) {
+        text.append(value);
+        size_t shown = 0;
+        for (char c : value) {
+            shown += (static_cast<unsigned char>(c) & 0xC0) != 0x80;  // UTF-8 lead bytes only
+        }
+        text.append(shown < width ? width - shown : 1, ' ');
+    }
+
+    void cell(long long value, size_t width) {
+        char digits[24];
+        cell(string_view(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits), width);
+    }
+
+    void percentCell(double value, size_t width) {
+        char digits[32];
+        char *end = to_chars(digits, digits + sizeof(digits) - 1, value, chars_format::fixed, 2).ptr;
+        *end++ = '%';
+        cell(string_view(digits, end - digits), width);
+    }
+
+    bool writeTo(const string &filename) const {
+        int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            cerr << "Error: Could not open the file " << filename << " for writing." << endl;
+            return false;
+        }
+        size_t done = 0;
+        while (done < text.size()) {
+            ssize_t written = ::write(fd, text.data() + done, text.size() - done);
+            if (written <= 0) {
+                cerr << "Error: Could not write the file " << filename << "." << endl;
+                ::close(fd);
+                return false;
+            }
+            done += static_cast<size_t>(written);
+        }
+        ::close(fd);
+        return true;
+    }
+
+private:
+    string text;
+};
+
+// Row order of the path profile report
+enum class PathOrder {
+    TotalTime,  // Heaviest inclusive time first
+    SelfTime,   // Heaviest self time first
+    Path        // Lexicographic by path
+};
+
+class CallGraph {
+public:
+    // Keys this graph's per-thread profiles. Unlike the graph's address, it
+    // is never reused, so a graph can't inherit the profiles of a destroyed
+    // one. Those stay mapped, and are reused for later graphs once this one
+    // is destroyed.
+    uint64_t id() const { return graphId; }
+
+    ~CallGraph() { ThreadProfile::retire(graphId); }
+
+    // Where objects constructed without a graph (ProfiledMutex() and
+    // ProfiledSharedMutex()) record
+    static CallGraph &defaultGraph() {
+        static CallGraph graph;
+        return graph;
+    }
+
+    // Live calls are recorded by Logger in per-thread context trees; these
+    // entry points import data from elsewhere (decoded traces, parsed logs)
+    void addCall(const string &caller, const string &callee, int count = 1) {
+        lock_guard<mutex> guard(graphMutex);
+        imported.addCall(caller, callee, count);
+    }
+
+    // Original printGraph function to output the call graph in text format
+    void printGraph() const {
+        ProfileTables tables = snapshot();
+        ofstream graphFile("call_graph.txt");
+
+        graphFile << "Call Graph Tree:\n";
+        GraphTraversal(tables.callGraph).writeTree(graphFile);
+
+        graphFile.close();
+    }
+
+    // Depth-first and breadth-first orderings of the call graph
+    void printGraphOrders(const string &filename = "call_graph_order.txt") const {
+        ProfileTables tables = snapshot();
+        ofstream orderFile(filename);
+        if (!orderFile) {
+            cerr << "Error: Could not open the file " << filename << " for writing." << endl;
+            return;
+        }
+
+        GraphTraversal traversal(tables.callGraph);
+        orderFile << "Depth-first order (depth function):\n";
+        traversal.writeDepthFirst(orderFile);
+        orderFile << "\nBreadth-first order (depth function):\n";
+        traversal.writeBreadthFirst(orderFile);
+
+        orderFile.close();
+    }
+
+    // New method to generate a DOT file for Graphviz visualization
+
+
+    // Nodes are colored (blue to red) and sized by self time, edges are as
+    // thick as the time spent through them (their call count when they
+    // carry no time). Functions with less than `minPercent` of the total
+    // time are dropped; the pruned callees of each remaining function are
+    // merged into one "other" node, so large programs stay small enough
+    // for Graphviz to lay out quickly.
+    void generateDotFile(bool isDynamicCallTree, const string &dotFilename, const string &pngFilename,
+                         double minPercent = 0.0) const {
+        ProfileTables tables = snapshot();
+        tables.deriveSelfTimes();
+
+        // Self and inclusive time per function and time per edge, from the
+        // paths that end in each function and in each call
+        struct FunctionTime {
+            long long selfTime = 0;
+            long long totalTime = 0;  // Recursive re-entries counted once
+            bool timed = false;
+        };
+        unordered_map<string_view, FunctionTime> functions;
+        map<pair<string_view, string_view>, long long> edgeTimes;
+        long long programTime = 0;
+        for (const auto &entry : tables.pathProfiles) {
+            string_view path = entry.first;
+            size_t split = path.rfind(" -> ");
+            string_view prefix = split == string_view::npos ? string_view() : path.substr(0, split);
+            string_view name = split == string_view::npos ? path : path.substr(split + 4);
+            FunctionTime &function = functions[name];
+            function.selfTime += entry.second.selfTime;
+            function.timed = true;
+            if (!ProfileTables::pathContains(prefix, name)) {
+                function.totalTime += entry.second.totalTime;
+            }
+            programTime += entry.second.selfTime;
+            if (!prefix.empty()) {
+                size_t callerSplit = prefix.rfind(" -> ");
+                edgeTimes[{callerSplit == string_view::npos ? prefix : prefix.substr(callerSplit + 4), name}] += entry.second.totalTime;
+            }
+        }
+        // Functions still running (main) or without time of their own
+        // (counters) are as heavy as what they called
+        for (const auto &entry : edgeTimes) {
+            FunctionTime &caller = functions[entry.first.first];
+            if (!caller.timed) {
+                caller.totalTime += entry.second;
+            }
+        }
+        long long maxSelfTime = 1, maxEdgeTime = 1, maxEdgeCalls = 1;
+        for (const auto &entry : functions) {
+            maxSelfTime = max(maxSelfTime, entry.second.selfTime);
+        }
+        for (const auto &entry : edgeTimes) {
+            maxEdgeTime = max(maxEdgeTime, entry.second);
+        }
+        for (const auto &entry : tables.callCounts) {
+            maxEdgeCalls = max(maxEdgeCalls, static_cast<long long>(entry.second));
+        }
+        auto kept = [&](string_view name) {
+            auto it = functions.find(name);
+            long long time = it == functions.end() ? 0 : it->second.totalTime;
+            return minPercent <= 0.0 || (programTime > 0 && time * 100.0 / programTime >= minPercent);
+        };
+        auto edgeTime = [&](string_view caller, string_view callee) {
+            auto it = edgeTimes.find({caller, callee});
+            return it == edgeTimes.end() ? 0LL : it->second;
+        };
+
+        ReportBuffer dotFile;
+        dotFile << "digraph CallGraph {\n";
+        dotFile << "    bgcolor=\"white\";\n";
+        dotFile << "    node [style=filled, shape=box, fontname=\"Arial\"];\n";
+        dotFile << "    edge [fontname=\"Arial\", fontsize=10];\n";
+
+        auto writeNode = [&](string_view id, string_view name) {
+            auto it = functions.find(name);
+            FunctionTime time = it == functions.end() ? FunctionTime() : it->second;
+            double heat = static_cast<double>(time.selfTime) / maxSelfTime;
+            char color[32];
+            snprintf(color, sizeof(color), "%.3f 0.600 1.000", 0.6 * (1.0 - heat));
+            dotFile << "    \"" << id << "\" [label=\"" << name;
+            if (time.timed) {
+                dotFile << "\\nself " << time.selfTime << " µs\\ntotal " << time.totalTime << " µs";
+            }
+            dotFile << "\", fillcolor=\"" << string_view(color) << "\", fontsize=" << static_cast<long long>(10 + 14 * heat)
+                    << "];\n";
+        };
+        auto writeEdge = [&](string_view caller, string_view callee, long long calls, long long time) {
+            double weight = time > 0 ? static_cast<double>(time) / maxEdgeTime : static_cast<double>(calls) / maxEdgeCalls;
+            char penwidth[16];
+            snprintf(penwidth, sizeof(penwidth), "%.1f", 1.0 + 5.0 * weight);
+            dotFile << "    \"" << caller << "\" -> \"" << callee << "\" [penwidth=" << string_view(penwidth) << ", label=\""
+                    << calls << (time > 0 ? " calls\\n" + to_string(time) + " µs" : string(" calls")) << "\"];\n";
+        };
+        auto writeOther = [&](string_view caller, long long functionCount, long long calls, long long time) {
+            string other = string(caller) + " (other)";
+            dotFile << "    \"" << other << "\" [label=\"" << functionCount << " other function" << (functionCount > 1 ? "s" : "")
+                    << "\\n" << time << " µs\", fillcolor=\"lightgray\", shape=ellipse, style=\"filled,dashed\"];\n";
+            writeEdge(caller, other, calls, time);
+        };
+
+        if (isDynamicCallTree) {
+            set<string_view> declared;
+            for (const auto &entry : tables.callGraph) {
+                const string &caller = entry.first;
+                if (!kept(caller)) {
+                    continue;
+                }
+                if (declared.insert(caller).second) {
+                    writeNode(caller, caller);
+                }
+                long long otherFunctions = 0, otherCalls = 0, otherTime = 0;
+                for (const string &callee : entry.second) {
+                    int calls = tables.callCounts.at({caller, callee});
+                    if (!kept(callee)) {
+                        otherFunctions++;
+                        otherCalls += calls;
+                        otherTime += edgeTime(caller, callee);
+                        continue;
+                    }
+                    for (int call = calls; call > 0; --call) {
+                        // Create multiple nodes with the same name for each call
+                        static int instanceCounter = 1;  // Counter to differentiate nodes internally
+                        string calleeNodeName = callee + to_string(instanceCounter++);
+                        writeNode(calleeNodeName, callee);
+                        dotFile << "    \"" << caller << "\" -> \"" << calleeNodeName << "\";\n";
+                    }
+                }
+                if (otherFunctions > 0) {
+                    writeOther(caller, otherFunctions, otherCalls, otherTime);
+                }
+            }
+        } else {
+            set<string_view> declared;
+            for (const auto &entry : tables.callGraph) {
+                const string &caller = entry.first;
+                if (!kept(caller)) {
+                    continue;
+                }
+                long long otherFunctions = 0, otherCalls = 0, otherTime = 0;
+                for (const string &callee : entry.second) {
+                    int calls = tables.callCounts.at({caller, callee});
+                    if (!kept(callee)) {
+                        otherFunctions++;
+                        otherCalls += calls;
+                        otherTime += edgeTime(caller, callee);
+                        continue;
+                    }
+                    for (string_view name : {string_view(caller), string_view(callee)}) {
+                        if (declared.insert(name).second) {
+                            writeNode(name, name);
+                        }
+                    }
+                    writeEdge(caller, callee, calls, edgeTime(caller, callee));
+                }
+                if (otherFunctions > 0) {
+                    if (declared.insert(caller).second) {
+                        writeNode(caller, caller);
+                    }
+                    writeOther(caller, otherFunctions, otherCalls, otherTime);
+                }
+            }
+        }
+
+        // Locks are drawn as boxes hanging off the functions that acquired them
+        for (const auto &entry : tables.lockEdges) {
+            const LockInfo &info = entry.second;
+            if (!kept(entry.first.first)) {
+                continue;
+            }
+            dotFile << "    \"" << entry.first.second << "\" [shape=box, fillcolor=orange];\n";
+            dotFile << "    \"" << entry.first.first << "\" -> \"" << entry.first.second << "\" [style=dashed, color=red, label=\""
+                    << "wait " << info.waitTime / 1000 << " µs\\n"
+                    << "hold " << info.holdTime / 1000 << " µs\\n"
+                    << "contended " << static_cast<long long>(info.contentionCount) << "/"
+                    << static_cast<long long>(info.acquireCount);
+            if (info.condWaitCount > 0) {
+                dotFile << "\\ncond wait " << info.condWaitTime / 1000 << " µs";
+            }
+            dotFile << "\"];\n";
+        }
+
+        dotFile << "}\n";
+        if (!dotFile.writeTo(dotFilename)) {
+            return;
+        }
+
+        cout << "DOT file created successfully: " << dotFilename << endl;
+
+        // Run Graphviz to create the PNG file
+        string command = "dot -Tpng \"" + dotFilename + "\" -o \"" + pngFilename + "\"";
+        int result = system(command.c_str());
+
+        if (result == 0) {
+            cout << "PNG file created successfully: " << pngFilename << endl;
+        } else {
+            cerr << "Error: Failed to generate PNG file. Please check if Graphviz is installed and accessible." << endl;
+        }
+    }
+
+
+
+
+
+
+    // Function to log paths and their time and call counts, heaviest first.
+    // Paths below `minPercent` of the total time (by the sort column) are
+    // left out and summarized in one line.
+    void logPaths(PathOrder order = PathOrder::TotalTime, double minPercent = 0.0) const {
+        ProfileTables tables = snapshot();
+        tables.deriveSelfTimes();
+        ReportBuffer pathFile;
+
+        if (tables.hotPathLimit == 0 || !tables.pathProfiles.empty()) {
+            writePathRows(tables.pathProfiles, order, minPercent, pathFile);
+        }
+
+        if (tables.hotPathLimit > 0) {
+            if (!tables.pathProfiles.empty()) {
+                pathFile << '\n';
+            }
+            pathFile << "Top " << static_cast<long long>(tables.hotPathLimit) << " paths by time (bounded mode)\n";
+            pathFile.cell("Path", 60);
+            pathFile.cell("Total Time (µs)", 20);
+            pathFile.cell("Max Overcount (µs)", 20);
+            pathFile.cell("Min Calls", 15);
+            pathFile.cell("Max Calls", 15);
+            pathFile << '\n' << string(130, '-') << '\n';
+
+            for (const auto &hot : tables.hotPaths) {
+                pathFile.cell(hot.path, 60);
+                pathFile.cell(hot.time, 20);
+                pathFile.cell(hot.timeError, 20);
+                pathFile.cell(hot.minCalls, 15);
+                pathFile.cell(hot.maxCalls, 15);
+                pathFile << '\n';
+            }
+            pathFile << "Every path with more than " << tables.sketchedTime / static_cast<long long>(tables.hotPathLimit)
+                     << " µs (total " << tables.sketchedTime << " µs / k) is listed; no time is overstated by more than that.\n";
+        }
+
+        if (!tables.recursionDepths.empty()) {
+            // Folded paths: Total Time above counts each outermost activation once
+            pathFile << '\n';
+            pathFile.cell("Recursive Path", 60);
+            pathFile.cell("Outer Calls", 15);
+            pathFile << "Recursion Depth Histogram (depth:count)\n" << string(115, '-') << '\n';
+
+            for (const auto &entry : tables.recursionDepths) {
+                long long outerCalls = 0;
+                string histogram;
+                for (int b = 0; b < LiveRecursion::kBuckets; ++b) {
+                    long long count = entry.second[b];
+                    if (count == 0) {
+                        continue;
+                    }
+                    outerCalls += count;
+                    long long low = 1LL << b;
+                    string range = b == 0 ? "1" : to_string(low) + (b == LiveRecursion::kBuckets - 1 ? "+" : "-" + to_string(low * 2 - 1));
+                    histogram += (histogram.empty() ? "" : "  ") + range + ":" + to_string(count);
+                }
+                pathFile.cell(entry.first, 60);
+                pathFile.cell(outerCalls, 15);
+                pathFile << histogram << '\n';
+            }
+        }
+
+        if (!tables.counterProfiles.empty()) {
+            pathFile << '\n';
+            pathFile.cell("Counter Path", 60);
+            pathFile.cell("Total", 20);
+            pathFile.cell("Updates", 15);
+            pathFile.cell("Mean", 15);
+            pathFile << '\n' << string(110, '-') << '\n';
+
+            for (const auto &entry : tables.counterProfiles) {
+                pathFile.cell(entry.first, 60);
+                pathFile.cell(entry.second.total, 20);
+                pathFile.cell(entry.second.updates, 15);
+                pathFile.cell(entry.second.updates > 0 ? entry.second.total / entry.second.updates : 0, 15);
+                pathFile << '\n';
+            }
+        }
+
+        if (!tables.lockProfiles.empty()) {
+            pathFile << '\n';
+            pathFile.cell("Lock Path", 60);
+            pathFile.cell("Acquires", 12);
+            pathFile.cell("Contended", 12);
+            pathFile.cell("Wait (µs)", 15);
+            pathFile.cell("Hold (µs)", 15);
+            pathFile.cell("Cond Wait (µs)", 15);
+            pathFile << '\n' << string(129, '-') << '\n';
+
+            for (const auto &entry : tables.lockProfiles) {
+                const LockInfo &info = entry.second;
+                pathFile.cell(entry.first, 60);
+                pathFile.cell(info.acquireCount, 12);
+                pathFile.cell(info.contentionCount, 12);
+                pathFile.cell(info.waitTime / 1000, 15);
+                pathFile.cell(info.holdTime / 1000, 15);
+                pathFile.cell(info.condWaitTime / 1000, 15);
+                pathFile << '\n';
+            }
+        }
+
+        if (!tables.placements.empty()) {
+            pathFile << '\n';
+            pathFile.cell("Placement Path", 60);
+            pathFile.cell("Migrations", 12);
+            pathFile.cell("Cross-Node", 12);
+            pathFile << "Time by NUMA Node (node:µs)\n" << string(115, '-') << '\n';
+
+            for (const auto &entry : tables.placements) {
+                const PlacementInfo &info = entry.second;
+                pathFile.cell(entry.first, 60);
+                pathFile.cell(info.migrations, 12);
+                pathFile.cell(info.nodeMigrations, 12);
+                bool first = true;
+                for (size_t n = 0; n < info.nodeTime.size(); ++n) {
+                    if (info.nodeTime[n] > 0) {
+                        pathFile << (first ? "" : "  ") << static_cast<long long>(n) << ':' << info.nodeTime[n];
+                        first = false;
+                    }
+                }
+                pathFile << '\n';
+            }
+        }
+
+        if (!tables.exemplars.empty()) {
+            writeExemplars(tables, minPercent, pathFile);
+        }
+        pathFile.writeTo("path_profiles.txt");
+    }
+
+    // Write a hot-to-cold function order for the linker (lld/gold
+    // --symbol-ordering-file, or a section-ordering script), one name per
+    // line. Functions are clustered with C3 call-chain clustering: from the
+    // hottest function down (by self time), each function's cluster is
+    // appended to the cluster of its heaviest caller, so callers and their
+    // hot callees end up adjacent; clusters are then laid out by density.
+    // Function sizes aren't known here, so every function counts as one
+    // unit and clusters are capped at `maxClusterFunctions`.
+    void writeFunctionOrder(const string &filename = "function_order.txt", size_t maxClusterFunctions = 32) const {
+        ProfileTables tables = snapshot();
+        tables.deriveSelfTimes();
+
+        // Scopes count toward their function; lock and counter pseudo-frames
+        // aren't code
+        unordered_map<string, uint32_t> ids;
+        vector<string> names;
+        vector<long long> selfTime;
+        auto idOf = [&](string_view name) -> int64_t {
+            if (name.empty() || name[0] == '[' || name[0] == '(') {
+                return -1;
+            }
+            string function(name.substr(0, name.find(':')));
+            auto inserted = ids.emplace(function, static_cast<uint32_t>(names.size()));
+            if (inserted.second) {
+                names.push_back(function);
+                selfTime.push_back(0);
+            }
+            return inserted.first->second;
+        };
+        for (const auto &entry : tables.pathProfiles) {
+            size_t split = entry.first.rfind(" -> ");
+            int64_t function = idOf(split == string::npos ? string_view(entry.first) : string_view(entry.first).substr(split + 4));
+            if (function >= 0) {
+                selfTime[function] += entry.second.selfTime;
+            }
+        }
+
+        // Heaviest caller of each function
+        map<pair<uint32_t, uint32_t>, long long> edgeWeights;
+        for (const auto &entry : tables.callCounts) {
+            int64_t caller = idOf(entry.first.first);
+            int64_t callee = idOf(entry.first.second);
+            if (caller >= 0 && callee >= 0 && caller != callee) {
+                edgeWeights[{static_cast<uint32_t>(caller), static_cast<uint32_t>(callee)}] += entry.second;
+            }
+        }
+        vector<int64_t> heaviestCaller(names.size(), -1);
+        vector<long long> heaviestWeight(names.size(), 0);
+        for (const auto &edge : edgeWeights) {
+            uint32_t callee = edge.first.second;
+            if (edge.second > heaviestWeight[callee]) {
+                heaviestWeight[callee] = edge.second;
+                heaviestCaller[callee] = edge.first.first;
+            }
+        }
+
+        vector<uint32_t> hottest(names.size());
+        for (uint32_t f = 0; f < names.size(); ++f) {
+            hottest[f] = f;
+        }
+        sort(hottest.begin(), hottest.end(), [&](uint32_t a, uint32_t b) {
+            return selfTime[a] != selfTime[b] ? selfTime[a] > selfTime[b] : names[a] < names[b];
+        });
+
+        // Don't let a dense cluster be diluted by a much sparser caller
+        // cluster; C3 uses the same guard
+        const long long kMaxDensityRatio = 8;
+        vector<uint32_t> clusterOf(names.size());
+        vector<vector<uint32_t>> clusters(names.size());
+        vector<long long> clusterTime(selfTime);
+        for (uint32_t f = 0; f < names.size(); ++f) {
+            clusterOf[f] = f;
+            clusters[f] = {f};
+        }
+        for (uint32_t f : hottest) {
+            if (heaviestCaller[f] < 0) {
+                continue;
+            }
+            uint32_t into = clusterOf[heaviestCaller[f]];
+            uint32_t from = clusterOf[f];
+            if (into == from || clusters[into].size() + clusters[from].size() > maxClusterFunctions) {
+                continue;
+            }
+            // density(from) > 8 * density(into), cross-multiplied by the sizes
+            if (clusterTime[from] * static_cast<long long>(clusters[into].size()) >
+                kMaxDensityRatio * clusterTime[into] * static_cast<long long>(clusters[from].size())) {
+                continue;
+            }
+            for (uint32_t member : clusters[from]) {
+                clusterOf[member] = into;
+            }
+            clusters[into].insert(clusters[into].end(), clusters[from].begin(), clusters[from].end());
+            clusterTime[into] += clusterTime[from];
+            clusters[from].clear();
+            clusterTime[from] = 0;
+        }
+
+        vector<uint32_t> layout;
+        for (uint32_t c = 0; c < names.size(); ++c) {
+            if (!clusters[c].empty()) {
+                layout.push_back(c);
+            }
+        }
+        stable_sort(layout.begin(), layout.end(), [&](uint32_t a, uint32_t b) {
+            return clusterTime[a] * static_cast<long long>(clusters[b].size()) >
+                   clusterTime[b] * static_cast<long long>(clusters[a].size());
+        });
+
+        ReportBuffer orderFile;
+        for (uint32_t c : layout) {
+            for (uint32_t f : clusters[c]) {
+                orderFile << names[f] << '\n';
+            }
+        }
+        if (orderFile.writeTo(filename)) {
+            cout << "Function order file created successfully: " << filename << " (" << names.size() << " functions, "
+                 << layout.size() << " clusters)" << endl;
+        }
+    }
+
+    // gprof-style butterfly report: for each function, heaviest first, the
+    // callers it was called from above it and the callees it called below
+    // it, each line with the time and calls of that one edge. An edge's
+    // time is that of the paths ending in that call, so one pass over the
+    // path profiles builds the whole edge table. As in gprof, a recursive
+    // edge's time includes its nested re-entries.
+    void writeButterfly(const string &filename = "butterfly.txt") const {
+        ProfileTables tables = snapshot();
+        tables.deriveSelfTimes();
+
+        struct Function {
+            string_view name;
+            long long calls = 0;
+            long long selfTime = 0;
+            long long totalTime = 0;  // Recursive re-entries counted once
+            long long index = 0;      // Position in the report, from 1
+        };
+        struct Edge {
+            uint32_t caller;
+            uint32_t callee;
+            long long calls;
+            long long selfTime;
+            long long totalTime;
+        };
+        const uint32_t kSpontaneous = UINT32_MAX;  // Called from outside any profiled function
+
+        vector<Function> functions;
+        unordered_map<string_view, uint32_t> ids;
+        auto idOf = [&](string_view name) {
+            auto inserted = ids.emplace(name, static_cast<uint32_t>(functions.size()));
+            if (inserted.second) {
+                functions.push_back({});
+                functions.back().name = name;
+            }
+            return inserted.first->second;
+        };
+        vector<Edge> edges;
+        unordered_map<uint64_t, uint32_t> edgeIds;
+        long long programTime = 0;
+        for (const auto &entry : tables.pathProfiles) {
+            string_view path = entry.first;
+            size_t split = path.rfind(" -> ");
+            string_view prefix = split == string_view::npos ? string_view() : path.substr(0, split);
+            string_view name = split == string_view::npos ? path : path.substr(split + 4);
+            size_t callerSplit = prefix.rfind(" -> ");
+            uint32_t caller = prefix.empty() ? kSpontaneous
+                                             : idOf(callerSplit == string_view::npos ? prefix : prefix.substr(callerSplit + 4));
+            uint32_t callee = idOf(name);
+
+            const PathInfo &info = entry.second;
+            Function &function = functions[callee];
+            function.calls += info.callCount;
+            function.selfTime += info.selfTime;
+            if (!ProfileTables::pathContains(prefix, name)) {
+                function.totalTime += info.totalTime;
+            }
+            programTime += info.selfTime;
+
+            auto inserted = edgeIds.emplace(static_cast<uint64_t>(caller) << 32 | callee, static_cast<uint32_t>(edges.size()));
+            if (inserted.second) {
+                edges.push_back({caller, callee, 0, 0, 0});
+            }
+            Edge &edge = edges[inserted.first->second];
+            edge.calls += info.callCount;
+            edge.selfTime += info.selfTime;
+            edge.totalTime += info.totalTime;
+        }
+
+        // Heaviest edges first within each function's caller and callee lists
+        sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) { return a.totalTime > b.totalTime; });
+        vector<uint32_t> callerOffsets(functions.size() + 1, 0), calleeOffsets(functions.size() + 1, 0);
+        for (const Edge &edge : edges) {
+            callerOffsets[edge.callee + 1]++;
+            if (edge.caller != kSpontaneous) {
+                calleeOffsets[edge.caller + 1]++;
+            }
+        }
+        for (size_t f = 0; f < functions.size(); ++f) {
+            callerOffsets[f + 1] += callerOffsets[f];
+            calleeOffsets[f + 1] += calleeOffsets[f];
+        }
+        vector<uint32_t> callerEdges(callerOffsets.back()), calleeEdges(calleeOffsets.back());
+        vector<uint32_t> callerNext(callerOffsets.begin(), callerOffsets.end() - 1);
+        vector<uint32_t> calleeNext(calleeOffsets.begin(), calleeOffsets.end() - 1);
+        for (uint32_t e = 0; e < edges.size(); ++e) {
+            callerEdges[callerNext[edges[e].callee]++] = e;
+            if (edges[e].caller != kSpontaneous) {
+                calleeEdges[calleeNext[edges[e].caller]++] = e;
+            }
+        }
+
+        vector<uint32_t> order(functions.size());
+        for (uint32_t f = 0; f < functions.size(); ++f) {
+            order[f] = f;
+        }
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return functions[a].totalTime != functions[b].totalTime ? functions[a].totalTime > functions[b].totalTime
+                                                                    : functions[a].name < functions[b].name;
+        });
+        for (size_t i = 0; i < order.size(); ++i) {
+            functions[order[i]].index = static_cast<long long>(i + 1);
+        }
+
+        ReportBuffer report;
+        report.cell("Index", 8);
+        report.cell("% Time", 10);
+        report.cell("Total (µs)", 14);
+        report.cell("Self (µs)", 14);
+        report.cell("Calls", 20);
+        report << "Name\n";
+        auto writeEdge = [&](const Edge &edge, uint32_t other, long long otherCalls) {
+            report.cell("", 18);
+            report.cell(edge.totalTime, 14);
+            report.cell(edge.selfTime, 14);
+            string calls = to_string(edge.calls) + "/" + to_string(otherCalls);
+            report.cell(calls, 20);
+            if (other == kSpontaneous) {
+                report << "    <spontaneous>\n";
+            } else {
+                report << "    " << functions[other].name << " [" << functions[other].index << "]\n";
+            }
+        };
+        for (uint32_t f : order) {
+            const Function &function = functions[f];
+            report << string(80, '-') << '\n';
+            for (uint32_t e = callerOffsets[f]; e < callerOffsets[f + 1]; ++e) {
+                const Edge &edge = edges[callerEdges[e]];
+                writeEdge(edge, edge.caller, function.calls);
+            }
+            string index = "[" + to_string(function.index) + "]";
+            report.cell(index, 8);
+            report.percentCell(programTime > 0 ? function.totalTime * 100.0 / programTime : 0.0, 10);
+            report.cell(function.totalTime, 14);
+            report.cell(function.selfTime, 14);
+            report.cell(function.calls, 20);
+            report << function.name << ' ' << index << '\n';
+            for (uint32_t e = calleeOffsets[f]; e < calleeOffsets[f + 1]; ++e) {
+                const Edge &edge = edges[calleeEdges[e]];
+                writeEdge(edge, edge.callee, functions[edge.callee].calls);
+            }
+        }
+        if (report.writeTo(filename)) {
+            cout << "Butterfly report created successfully: " << filename << endl;
+        }
+    }
+
+    void updatePathProfile(const string &path, long long duration) {
+        lock_guard<mutex> guard(graphMutex);
+        imported.pathProfiles[path].totalTime += duration;
+        imported.pathProfiles[path].callCount += 1;
+    }
+
+    // Bulk variant used when rebuilding profiles from a recorded trace
+    void updatePathProfile(const string &path, const PathInfo &info) {
+        lock_guard<mutex> guard(graphMutex);
+        imported.pathProfiles[path].totalTime += info.totalTime;
+        imported.pathProfiles[path].callCount += info.callCount;
+    }
+
+    // Merge the imported tables with every thread's context tree. Runs
+    // concurrently with recording; counters of calls in flight may be a
+    // call behind, which is fine for a report.
+    ProfileTables snapshot() const {
+        ProfileTables tables;
+        {
+            lock_guard<mutex> guard(graphMutex);
+            tables = imported;
+        }
+
+        struct Pending {
+            const ContextNode *node;
+            string parentPath;
+        };
+        vector<Pending> pending;
+        vector<const ContextNode *> children;
+        for (const ThreadProfile *profile = ThreadProfile::first(); profile; profile = profile->nextProfile()) {
+            if (profile->owner != graphId) {
+                continue;
+            }
+            pending.push_back({&profile->root, ""});
+            while (!pending.empty()) {
+                Pending item = move(pending.back());
+                pending.pop_back();
+                const ContextNode *node = item.node;
+                const ContextNode *parent = node->parent;
+                string path;
+                if (parent) {
+                    string name = FunctionRegistry::nameOf(node->functionId);
+                    string parentName = parent->parent ? FunctionRegistry::nameOf(parent->functionId) : "";
+                    if (node->kind == ContextNode::Lock) {
+                        // Lock pseudo-frames
+                        if (parentName.empty()) {
+                            parentName = "(no context)";
+                            item.parentPath = parentName;
+                        }
+                        path = item.parentPath + " -> " + name;
+                        addLockInfo(tables.lockProfiles[path], *node->lock);
+                        addLockInfo(tables.lockEdges[{parentName, name}], *node->lock);
+                        continue;
+                    }
+                    if (node->kind == ContextNode::Counter) {
+                        // Counters show up as leaves of the call graph
+                        long long updates = node->callCount.load(memory_order_relaxed);
+                        CounterInfo &info = tables.counterProfiles[(item.parentPath.empty() ? "(no context)" : item.parentPath) + " -> " + name];
+                        info.total += node->totalTime.load(memory_order_relaxed);
+                        info.updates += updates;
+                        if (!parentName.empty()) {
+                            tables.addCall(parentName, name, static_cast<int>(updates));
+                        }
+                        continue;
+                    }
+                    if (node->kind == ContextNode::Recursion) {
+                        // Folded back edge: only feeds the call graph
+                        tables.addCall(parentName, name, static_cast<int>(node->entries.load(memory_order_relaxed)));
+                        continue;
+                    }
+                    path = item.parentPath.empty() ? name : item.parentPath + " -> " + name;
+                    long long entries = node->entries.load(memory_order_relaxed);
+                    if (!parentName.empty() && entries > 0) {
+                        tables.addCall(parentName, name, static_cast<int>(entries));
+                    }
+                    long long calls = node->callCount.load(memory_order_relaxed);
+                    if (calls > 0) {
+                        PathInfo &info = tables.pathProfiles[path];
+                        info.totalTime += node->totalTime.load(memory_order_relaxed);
+                        info.callCount += static_cast<int>(calls);
+                        info.selfTime = max(info.selfTime, 0LL) + node->selfTime.load(memory_order_relaxed);
+                    }
+                    const LiveRecursion *recursion = node->recursion.load(memory_order_acquire);
+                    if (recursion) {
+                        auto &depths = tables.recursionDepths[path];
+                        for (int b = 0; b < LiveRecursion::kBuckets; ++b) {
+                            depths[b] += recursion->depthCounts[b].load(memory_order_relaxed);
+                        }
+                    }
+                    const LivePlacement *placement = node->placement.load(memory_order_acquire);
+                    if (placement) {
+                        PlacementInfo &info = tables.placements[path];
+                        for (uint32_t n = 0; n < CpuPlacement::kMaxNodes; ++n) {
+                            info.nodeTime[n] += placement->nodeTime[n].load(memory_order_relaxed);
+                        }
+                        info.migrations += placement->migrations.load(memory_order_relaxed);
+                        info.nodeMigrations += placement->nodeMigrations.load(memory_order_relaxed);
+                    }
+                    const LiveExemplars *exemplars = node->exemplars.load(memory_order_acquire);
+                    if (exemplars) {
+                        addExemplars(tables.exemplars[path], *exemplars, profile->thread);
+                    }
+                }
+
+                // Push children in reverse so they are visited in creation order
+                children.clear();
+                for (const ContextNode *c = node->firstChild.load(memory_order_acquire); c;
+                     c = c->nextSibling.load(memory_order_acquire)) {
+                    children.push_back(c);
+                }
+                for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                    pending.push_back({*it, path});
+                }
+            }
+        }
+        if (ThreadProfile::pathLimit() > 0) {
+            mergePathSketches(tables);
+        }
+        // Threads sharing a path each kept their own slowest calls
+        for (auto &entry : tables.exemplars) {
+            auto &kept = entry.second;
+            sort(kept.begin(), kept.end(), [](const ProfileTables::Exemplar &a, const ProfileTables::Exemplar &b) {
+                return a.duration > b.duration;
+            });
+            kept.resize(min(kept.size(), ThreadProfile::exemplarLimit()));
+        }
+        return tables;
+    }
+
+    // Dump the path profiles from a signal handler. The context trees are
+    // append-only and can be walked without locks; the imported tables are
+    // only read if try_lock succeeds, so a crash while the graph mutex is
+    // held (possibly by the crashing thread itself) skips them instead of
+    // deadlocking. The lock is deliberately never released because the
+    // process is going down.
+    void writeProfilesSignalSafe(SignalSafeWriter &out) const {
+        const int kMaxWalkDepth = 512;
+        const ContextNode *stack[kMaxWalkDepth];
+        const ContextNode *chain[kMaxWalkDepth];
+        for (const ThreadProfile *profile = ThreadProfile::first(); profile; profile = profile->nextProfile()) {
+            if (profile->owner != graphId) {
+                continue;
+            }
+            out << "Thread " << static_cast<long long>(profile->thread) << ":\n";
+            int top = 0;
+            const ContextNode *first = profile->root.firstChild.load(memory_order_acquire);
+            if (first) {
+                stack[top++] = first;
+            }
+            while (top > 0) {
+                const ContextNode *node = stack[--top];
+                const ContextNode *sibling = node->nextSibling.load(memory_order_acquire);
+                const ContextNode *child = node->firstChild.load(memory_order_acquire);
+                if (sibling && top < kMaxWalkDepth) {
+                    stack[top++] = sibling;
+                }
+                if (child && top < kMaxWalkDepth) {
+                    stack[top++] = child;
+                }
+
+                long long calls = node->kind == ContextNode::Lock ? node->lock->acquireCount.load(memory_order_relaxed)
+                                                                  : node->callCount.load(memory_order_relaxed);
+                if (calls == 0) {
+                    continue;
+                }
+                int depth = 0;
+                for (const ContextNode *n = node; n->parent && depth < kMaxWalkDepth; n = n->parent) {
+                    chain[depth++] = n;
+                }
+                out << "  ";
+                for (int d = depth - 1; d >= 0; --d) {
+                    out << FunctionRegistry::signalSafeName(chain[d]->functionId) << (d > 0 ? " -> " : "");
+                }
+                if (node->kind == ContextNode::Lock) {
+                    out << "  wait=" << node->lock->waitTime.load(memory_order_relaxed) / 1000
+                        << " µs  hold=" << node->lock->holdTime.load(memory_order_relaxed) / 1000
+                        << " µs  contended=" << node->lock->contentionCount.load(memory_order_relaxed) << "\n";
+                } else if (node->kind == ContextNode::Counter) {
+                    out << "  total=" << node->totalTime.load(memory_order_relaxed) << "  updates=" << calls << "\n";
+                } else {
+                    out << "  time=" << node->totalTime.load(memory_order_relaxed) << " µs  calls=" << calls << "\n";
+                }
+            }
+        }
+
+        for (const ThreadProfile *profile = ThreadProfile::first(); profile; profile = profile->nextProfile()) {
+            if (profile->owner != graphId || ThreadProfile::pathLimit() == 0) {
+                continue;
+            }
+            const PathSketch *paths = profile->tryLockPaths();
+            if (!paths) {
+                out << "Thread " << static_cast<long long>(profile->thread) << ": (path sketch was being updated; skipped)\n";
+                continue;
+            }
+            out << "Thread " << static_cast<long long>(profile->thread) << " top paths (upper bounds):\n";
+            for (size_t i = 0; i < paths->size(); ++i) {
+                const PathSketch::Counter &counter = paths->counter(i);
+                out << "  " << (counter.truncated ? "... -> " : "");
+                for (int d = 0; d < counter.depth; ++d) {
+                    out << FunctionRegistry::signalSafeName(counter.frames[d]) << (d + 1 < counter.depth ? " -> " : "");
+                }
+                out << "  time=" << counter.time << " µs  calls>=" << counter.callsSince << "\n";
+            }
+        }
+
+        if (!graphMutex.try_lock()) {
+            out << "(imported path profiles were being updated at the time of the crash; skipped)\n";
+            return;
+        }
+        for (const auto &entry : imported.pathProfiles) {
+            out << entry.first.c_str() << "  time=" << entry.second.totalTime
+                << " µs  calls=" << static_cast<long long>(entry.second.callCount) << "\n";
+        }
+    }
+
+private:
+    static void writePathRows(const map<string, PathInfo> &pathProfiles, PathOrder order, double minPercent,
+                              ReportBuffer &out) {
+        struct Row {
+            string_view path;
+            long long totalTime;
+            long long selfTime;
+            int callCount;
+        };
+        vector<Row> rows;
+        rows.reserve(pathProfiles.size());
+        for (const auto &entry : pathProfiles) {
+            rows.push_back({entry.first, entry.second.totalTime, max(entry.second.selfTime, 0LL), entry.second.callCount});
+        }
+
+        // Self times partition the run, so their sum is the 100% mark
+        long long grandTotal = 0;
+        for (const Row &row : rows) {
+            grandTotal += row.selfTime;
+        }
+        auto key = [order](const Row &row) { return order == PathOrder::SelfTime ? row.selfTime : row.totalTime; };
+
+        size_t pruned = 0;
+        long long prunedSelfTime = 0;
+        if (minPercent > 0 && grandTotal > 0) {
+            double threshold = grandTotal * minPercent / 100.0;
+            auto kept = remove_if(rows.begin(), rows.end(), [&](const Row &row) {
+                if (key(row) >= threshold) {
+                    return false;
+                }
+                pruned++;
+                prunedSelfTime += row.selfTime;
+                return true;
+            });
+            rows.erase(kept, rows.end());
+        }
+
+        if (order != PathOrder::Path) {
+            // Ties keep path order so the report is deterministic
+            parallelSort(rows, [&key](const Row &a, const Row &b) {
+                long long ka = key(a), kb = key(b);
+                return ka != kb ? ka > kb : a.path < b.path;
+            });
+        }
+
+        out.reserve(rows.size() * 140 + 4096);
+        out.cell("Path", 60);
+        out.cell("Total Time (µs)", 20);
+        out.cell("% Total", 10);
+        out.cell("Self Time (µs)", 20);
+        out.cell("% Self", 10);
+        out.cell("Call Count", 15);
+        out << '\n' << string(135, '-') << '\n';
+
+        // Rows are formatted in parallel chunks, then appended in order
+        double percent = grandTotal > 0 ? 100.0 / grandTotal : 0.0;
+        auto formatRows = [&rows, percent](size_t begin, size_t end, ReportBuffer &buffer) {
+            for (size_t i = begin; i < end; ++i) {
+                // After sorting, path strings are scattered across the heap
+                if (i + 8 < end) {
+                    __builtin_prefetch(rows[i + 8].path.data());
+                }
+                const Row &row = rows[i];
+                buffer.cell(row.path, 60);
+                buffer.cell(row.totalTime, 20);
+                buffer.percentCell(row.totalTime * percent, 10);
+                buffer.cell(row.selfTime, 20);
+                buffer.percentCell(row.selfTime * percent, 10);
+                buffer.cell(row.callCount, 15);
+                buffer << '\n';
+            }
+        };
+        size_t workers = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), rows.size() / 16384));
+        if (workers == 1) {
+            formatRows(0, rows.size(), out);
+        } else {
+            vector<ReportBuffer> chunks(workers);
+            vector<thread> threads;
+            for (size_t w = 0; w < workers; ++w) {
+                threads.emplace_back([&, w] {
+                    size_t begin = rows.size() * w / workers, end = rows.size() * (w + 1) / workers;
+                    chunks[w].reserve((end - begin) * 140);
+                    formatRows(begin, end, chunks[w]);
+                });
+            }
+            for (size_t w = 0; w < workers; ++w) {
+                threads[w].join();
+                out << chunks[w].view();
+            }
+        }
+        if (pruned > 0) {
+            out << static_cast<long long>(pruned) << " path(s) below " << minPercent << "% of the total omitted (" << prunedSelfTime << " µs self time)\n";
+        }
+    }
+
+    // Paths with the slowest single call first; each exemplar lists the
+    // calls made beneath it, indented by depth, with their start offsets
+    static void writeExemplars(const ProfileTables &tables, double minPercent, ReportBuffer &out) {
+        long long totalTime = 0;
+        for (const auto &entry : tables.pathProfiles) {
+            if (entry.first.find(" -> ") == string::npos) {
+                totalTime += entry.second.totalTime;
+            }
+        }
+        vector<pair<const string *, const PathInfo *>> paths;
+        for (const auto &entry : tables.exemplars) {
+            auto info = tables.pathProfiles.find(entry.first);
+            if (entry.second.empty() || info == tables.pathProfiles.end() ||
+                (totalTime > 0 && info->second.totalTime * 100.0 / totalTime < minPercent)) {
+                continue;
+            }
+            paths.push_back({&entry.first, &info->second});
+        }
+        sort(paths.begin(), paths.end(), [&](const auto &a, const auto &b) {
+            return tables.exemplars.at(*a.first)[0].duration > tables.exemplars.at(*b.first)[0].duration;
+        });
+
+        out << "\nSlowest calls per path (exemplars)\n" << string(115, '-') << '\n';
+        for (const auto &path : paths) {
+            long long mean = path.second->callCount > 0 ? path.second->totalTime / path.second->callCount : 0;
+            out << *path.first << "  (" << static_cast<long long>(path.second->callCount) << " calls, mean " << mean
+                << " µs)\n";
+            for (const auto &exemplar : tables.exemplars.at(*path.first)) {
+                out << "  " << exemplar.duration << " µs";
+                if (mean > 0) {
+                    long long tenths = exemplar.duration * 10 / mean;
+                    out << " (" << tenths / 10 << '.' << tenths % 10 << "x mean)";
+                }
+                out << " on thread " << static_cast<long long>(exemplar.thread)
+                    << (exemplar.truncated ? ", only the longest calls beneath it kept" : "") << '\n';
+                for (const auto &call : exemplar.calls) {
+                    out << string(2 + 2 * call.depth, ' ') << '+' << call.offset << " µs  " << call.function << "  "
+                        << call.duration << " µs\n";
+                }
+            }
+        }
+    }
+
+    // Merge the per-thread sketches the way mergeable Space-Saving
+    // summaries combine: a path missing from a full sketch may have had up
+    // to that sketch's minimum there, so the minimum is added to both its
+    // time and its error. Count-Min cells of equal width simply add up.
+    void mergePathSketches(ProfileTables &tables) const {
+        struct Copy {
+            vector<PathSketch::Counter> counters;
+            long long floor;
+        };
+        vector<Copy> copies;
+        vector<long long> countCells;
+        size_t width = 0;
+        for (const ThreadProfile *profile = ThreadProfile::first(); profile; profile = profile->nextProfile()) {
+            if (profile->owner != graphId) {
+                continue;
+            }
+            profile->readPaths([&](const PathSketch &paths, const EdgeTable &edges) {
+                for (const EdgeTable::Edge &edge : edges) {
+                    tables.addCall(FunctionRegistry::nameOf(edge.caller), FunctionRegistry::nameOf(edge.callee),
+                                   static_cast<int>(edge.count));
+                }
+                if (paths.size() == 0) {
+                    return;
+                }
+                copies.push_back({vector<PathSketch::Counter>(&paths.counter(0), &paths.counter(0) + paths.size()),
+                                  paths.minTime()});
+                tables.hotPathLimit = max(tables.hotPathLimit, paths.limit());
+                tables.sketchedTime += paths.total();
+                if (width == 0 || width == paths.width()) {
+                    width = paths.width();
+                    paths.addCountsTo(countCells);
+                }
+            });
+        }
+
+        struct Merged {
+            long long time = 0;
+            long long timeError = 0;
+            long long calls = 0;
+            const PathSketch::Counter *first = nullptr;
+        };
+        long long floors = 0;
+        unordered_map<uint64_t, Merged> merged;
+        for (const Copy &copy : copies) {
+            floors += copy.floor;
+            for (const PathSketch::Counter &counter : copy.counters) {
+                Merged &entry = merged[counter.key];
+                entry.time += counter.time - copy.floor;
+                entry.timeError += counter.timeError - copy.floor;
+                entry.calls += counter.callsSince;
+                if (!entry.first) {
+                    entry.first = &counter;
+                }
+            }
+        }
+
+        vector<pair<uint64_t, Merged>> ranked(merged.begin(), merged.end());
+        size_t keep = min(ranked.size(), tables.hotPathLimit);
+        partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(),
+                     [](const pair<uint64_t, Merged> &a, const pair<uint64_t, Merged> &b) {
+                         return a.second.time > b.second.time;
+                     });
+        for (size_t i = 0; i < keep; ++i) {
+            const Merged &entry = ranked[i].second;
+            const PathSketch::Counter &counter = *entry.first;
+            string path = counter.truncated ? "..." : "";
+            for (int d = 0; d < counter.depth; ++d) {
+                path += (path.empty() ? "" : " -> ") + FunctionRegistry::name(counter.frames[d]);
+            }
+            long long maxCalls = LLONG_MAX;
+            for (int row = 0; width > 0 && row < PathSketch::kCountMinDepth; ++row) {
+                maxCalls = min(maxCalls, countCells[row * width + PathSketch::countMinColumn(ranked[i].first, row, width)]);
+            }
+            tables.hotPaths.push_back({path, entry.time + floors, entry.timeError + floors, entry.calls,
+                                       max(maxCalls, entry.calls)});
+        }
+    }
+
+    static void addExemplars(vector<ProfileTables::Exemplar> &out, const LiveExemplars &live, uint32_t thread) {
+        lock_guard<SpinLock> guard(live.lock);
+        for (uint32_t i = 0; i < live.used; ++i) {
+            const LiveExemplars::Exemplar &slot = live.slots[i];
+            ProfileTables::Exemplar exemplar{slot.duration, thread, slot.truncated, {}};
+            for (uint32_t c = 0; c < slot.callCount; ++c) {
+                const TraceRecord &call = slot.calls[c];
+                exemplar.calls.push_back({FunctionRegistry::name(call.functionId), static_cast<int>(call.depth),
+                                          static_cast<long long>(call.start - slot.start) / 1000, call.duration});
+            }
+            out.push_back(move(exemplar));
+        }
+    }
+
+    static void addLockInfo(LockInfo &info, const LiveLockInfo &live) {
+        info.waitTime += live.waitTime.load(memory_order_relaxed);
+        info.holdTime += live.holdTime.load(memory_order_relaxed);
+        info.condWaitTime += live.condWaitTime.load(memory_order_relaxed);
+        info.acquireCount += static_cast<int>(live.acquireCount.load(memory_order_relaxed));
+        info.contentionCount += static_cast<int>(live.contentionCount.load(memory_order_relaxed));
+        info.condWaitCount += static_cast<int>(live.condWaitCount.load(memory_order_relaxed));
+    }
+
+    ProfileTables imported;
+    mutable mutex graphMutex;
+    const uint64_t graphId = ++graphCounter;
+    static atomic<uint64_t> graphCounter;
+};
+
+inline atomic<uint64_t> CallGraph::graphCounter{0};
+
+// Indexed, in-process queries over a call graph: forward and reverse CSR
+// adjacency over the index's own dense function IDs plus per-function
+// aggregates, so callers, callees, closures and hotspot searches cost time
+// proportional to what they return instead of a scan of the string-keyed
+// tables.
+//
+// update() is incremental: every path and edge remembers what it last
+// contributed, so a new snapshot moves the aggregates by the difference
+// and only paths the index hasn't seen are parsed. Changed edge weights
+// are patched in place; the CSR arrays (O(V + E)) are only rebuilt when
+// edges appear in or drop out of the snapshot.
+class CallGraphIndex {
+public:
+    static const uint32_t kUnknown = UINT32_MAX;
+
+    struct Edge {
+        uint32_t function;  // Callee in callees(), caller in callers()
+        long long calls;
+    };
+
+    struct Range {
+        const Edge *first;
+        const Edge *last;
+        const Edge *begin() const { return first; }
+        const Edge *end() const { return last; }
+        size_t size() const { return static_cast<size_t>(last - first); }
+    };
+
+    struct FunctionStats {
+        long long calls = 0;
+        long long selfTime = 0;   // µs
+        long long totalTime = 0;  // µs, recursive re-entries counted once
+    };
+
+    void update(const CallGraph &graph) {
+        ProfileTables tables = graph.snapshot();
+        tables.deriveSelfTimes();
+        update(tables);
+    }
+
+    // `tables` must have its self times derived
+    void update(const ProfileTables &tables) {
+        ++updates;
+        bool reshaped = calleeOffsets.size() != names.size() + 1;
+        for (const auto &entry : tables.callCounts) {
+            uint32_t caller = idOf(entry.first.first);
+            uint32_t callee = idOf(entry.first.second);
+            auto inserted = edgeSlots.emplace(edgeKey(caller, callee), static_cast<uint32_t>(edges.size()));
+            if (inserted.second) {
+                edges.push_back({caller, callee, 0});
+                reshaped = true;
+            }
+            EdgeRecord &edge = edges[inserted.first->second];
+            edge.seen = updates;
+            if (edge.calls != entry.second) {
+                edge.calls = entry.second;
+                if (!inserted.second) {
+                    calleeEdges[edge.calleeSlot].calls = edge.calls;
+                    callerEdges[edge.callerSlot].calls = edge.calls;
+                }
+            }
+        }
+        if (edges.size() > tables.callCounts.size()) {
+            dropStaleEdges();
+            reshaped = true;
+        }
+
+        for (const auto &entry : tables.pathProfiles) {
+            auto it = paths.find(entry.first);
+            if (it == paths.end()) {
+                string_view path = entry.first;
+                size_t split = path.rfind(" -> ");
+                string_view function = split == string_view::npos ? path : path.substr(split + 4);
+                bool recursive = split != string_view::npos && ProfileTables::pathContains(path.substr(0, split), function);
+                it = paths.emplace(entry.first, PathState{idOf(function), !recursive, 0}).first;
+            }
+            it->second.seen = updates;
+            apply(it->second, entry.second);
+        }
+        if (paths.size() > tables.pathProfiles.size()) {
+            for (auto it = paths.begin(); it != paths.end();) {
+                if (it->second.seen != updates) {
+                    apply(it->second, PathInfo{0, 0, 0});
+                    it = paths.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        if (reshaped) {
+            rebuild();
+        }
+    }
+
+    // kUnknown if the name has never been profiled
+    uint32_t find(string_view name) const {
+        auto it = ids.find(string(name));
+        return it == ids.end() ? kUnknown : it->second;
+    }
+
+    const string &name(uint32_t function) const {
+        static const string unknown = "(unknown)";
+        return function < names.size() ? *names[function] : unknown;
+    }
+
+    Range callees(uint32_t function) const { return slice(calleeEdges, calleeOffsets, function); }
+    Range callers(uint32_t function) const { return slice(callerEdges, callerOffsets, function); }
+
+    const FunctionStats &statsOf(uint32_t function) const {
+        static const FunctionStats none;
+        return function < stats.size() ? stats[function] : none;
+    }
+
+    // Everything `function` reaches through calls (or, with `transitiveCallers`,
+    // everything that reaches it), excluding itself unless it recurses
+    vector<uint32_t> closure(uint32_t function, bool transitiveCallers = false) const {
+        vector<uint32_t> reached;
+        search(function, transitiveCallers, [&](uint32_t node) {
+            reached.push_back(node);
+            return false;
+        });
+        return reached;
+    }
+
+    // The `count` descendants of `function` with the most self time, hottest first
+    vector<uint32_t> hottestDescendants(uint32_t function, size_t count) const {
+        vector<uint32_t> descendants = closure(function);
+        count = min(count, descendants.size());
+        partial_sort(descendants.begin(), descendants.begin() + count, descendants.end(), [&](uint32_t a, uint32_t b) {
+            return stats[a].selfTime > stats[b].selfTime;
+        });
+        descendants.resize(count);
+        return descendants;
+    }
+
+    // Fewest-calls chain from `function` to the nearest hotspot: a function
+    // with at least `minSelfPercent` of all self time. Empty if none is
+    // reachable; just `function` if it is a hotspot itself.
+    vector<uint32_t> pathToHotspot(uint32_t function, double minSelfPercent) const {
+        auto isHotspot = [&](uint32_t node) {
+            return totalSelfTime > 0 && stats[node].selfTime * 100.0 / totalSelfTime >= minSelfPercent;
+        };
+        if (function >= names.size()) {
+            return {};
+        }
+        if (isHotspot(function)) {
+            return {function};
+        }
+        uint32_t found = kUnknown;
+        search(function, false, [&](uint32_t node) {
+            if (isHotspot(node)) {
+                found = node;
+                return true;
+            }
+            return false;
+        });
+        vector<uint32_t> path;
+        for (uint32_t node = found; node != kUnknown; node = parentOf[node]) {
+            path.push_back(node);
+            if (node == function) {
+                break;
+            }
+        }
+        reverse(path.begin(), path.end());
+        return path;
+    }
+
+private:
+    struct EdgeRecord {
+        uint32_t caller;
+        uint32_t callee;
+        long long calls;
+        uint32_t calleeSlot = 0;
+        uint32_t callerSlot = 0;
+        uint64_t seen = 0;  // Last update whose snapshot had the edge
+    };
+
+    // What a path added to its function's aggregates at the last update
+    struct PathState {
+        uint32_t function;
+        bool addsTotal;  // False for a recursive re-entry
+        uint64_t seen;
+        PathInfo last{0, 0, 0};
+    };
+
+    static uint64_t edgeKey(uint32_t caller, uint32_t callee) { return static_cast<uint64_t>(caller) << 32 | callee; }
+
+    uint32_t idOf(string_view name) {
+        auto inserted = ids.emplace(string(name), static_cast<uint32_t>(names.size()));
+        if (inserted.second) {
+            names.push_back(&inserted.first->first);
+            stats.emplace_back();
+        }
+        return inserted.first->second;
+    }
+
+    void apply(PathState &state, const PathInfo &info) {
+        const PathInfo &last = state.last;
+        if (info.callCount == last.callCount && info.totalTime == last.totalTime && info.selfTime == last.selfTime) {
+            return;
+        }
+        FunctionStats &functionStats = stats[state.function];
+        long long selfDelta = max(info.selfTime, 0LL) - max(last.selfTime, 0LL);
+        functionStats.calls += info.callCount - last.callCount;
+        functionStats.selfTime += selfDelta;
+        totalSelfTime += selfDelta;
+        if (state.addsTotal) {
+            functionStats.totalTime += info.totalTime - last.totalTime;
+        }
+        state.last = info;
+    }
+
+    // Edges missing from the latest snapshot (its graph was rebuilt) go
+    void dropStaleEdges() {
+        size_t kept = 0;
+        edgeSlots.clear();
+        for (const EdgeRecord &edge : edges) {
+            if (edge.seen == updates) {
+                edgeSlots.emplace(edgeKey(edge.caller, edge.callee), static_cast<uint32_t>(kept));
+                edges[kept++] = edge;
+            }
+        }
+        edges.resize(kept);
+    }
+
+    // Counting sort of the edge list into both adjacency arrays
+    void rebuild() {
+        size_t nodeCount = names.size();
+        calleeOffsets.assign(nodeCount + 1, 0);
+        callerOffsets.assign(nodeCount + 1, 0);
+        for (const EdgeRecord &edge : edges) {
+            calleeOffsets[edge.caller + 1]++;
+            callerOffsets[edge.callee + 1]++;
+        }
+        for (size_t n = 0; n < nodeCount; ++n) {
+            calleeOffsets[n + 1] += calleeOffsets[n];
+            callerOffsets[n + 1] += callerOffsets[n];
+        }
+        calleeEdges.resize(edges.size());
+        callerEdges.resize(edges.size());
+        vector<uint32_t> calleeNext(calleeOffsets.begin(), calleeOffsets.end() - 1);
+        vector<uint32_t> callerNext(callerOffsets.begin(), callerOffsets.end() - 1);
+        for (EdgeRecord &edge : edges) {
+            edge.calleeSlot = calleeNext[edge.caller]++;
+            edge.callerSlot = callerNext[edge.callee]++;
+            calleeEdges[edge.calleeSlot] = {edge.callee, edge.calls};
+            callerEdges[edge.callerSlot] = {edge.caller, edge.calls};
+        }
+        visited.assign(nodeCount, 0);
+        parentOf.assign(nodeCount, static_cast<uint32_t>(kUnknown));
+        generation = 0;
+    }
+
+    static Range slice(const vector<Edge> &adjacency, const vector<uint32_t> &offsets, uint32_t function) {
+        if (static_cast<size_t>(function) + 1 >= offsets.size()) {
+            return {nullptr, nullptr};
+        }
+        return {adjacency.data() + offsets[function], adjacency.data() + offsets[function + 1]};
+    }
+
+    // Breadth-first from `start`; `visit(node)` returns true to stop.
+    // Visited marks are generation-stamped so a search never clears arrays
+    // the size of the whole graph, and parentOf is left for path recovery.
+    template <typename Visit>
+    void search(uint32_t start, bool backwards, Visit visit) const {
+        if (start >= visited.size()) {
+            return;
+        }
+        if (++generation == 0) {
+            fill(visited.begin(), visited.end(), 0);
+            generation = 1;
+        }
+        const vector<Edge> &adjacency = backwards ? callerEdges : calleeEdges;
+        const vector<uint32_t> &offsets = backwards ? callerOffsets : calleeOffsets;
+        queue.clear();
+        queue.push_back(start);
+        parentOf[start] = kUnknown;
+        for (size_t head = 0; head < queue.size(); ++head) {
+            uint32_t node = queue[head];
+            for (uint32_t edge = offsets[node]; edge < offsets[node + 1]; ++edge) {
+                uint32_t next = adjacency[edge].function;
+                if (visited[next] == generation) {
+                    continue;
+                }
+                visited[next] = generation;
+                parentOf[next] = node;
+                if (visit(next)) {
+                    return;
+                }
+                queue.push_back(next);
+            }
+        }
+    }
+
+    unordered_map<string, uint32_t> ids;      // Names seen in snapshots, by dense ID
+    vector<const string *> names;             // Keys of `ids`, which never move
+    unordered_map<string, PathState> paths;
+    unordered_map<uint64_t, uint32_t> edgeSlots;
+    vector<EdgeRecord> edges;                 // In discovery order
+    uint64_t updates = 0;                     // update() calls so far
+    vector<FunctionStats> stats;
+    long long totalSelfTime = 0;
+    vector<uint32_t> calleeOffsets;           // Callees of n are calleeEdges[calleeOffsets[n] .. calleeOffsets[n + 1])
+    vector<Edge> calleeEdges;
+    vector<uint32_t> callerOffsets;
+    vector<Edge> callerEdges;
+
+    // Search scratch, reused across queries
+    mutable vector<uint32_t> visited;
+    mutable vector<uint32_t> parentOf;
+    mutable vector<uint32_t> queue;
+    mutable uint32_t generation = 0;
+};
+
+// Compressed binary event trace.
+//
+// The file is a sequence of blocks, each with a fixed 32-byte header:
+//   u32 magic, u8 kind, u8[3] reserved, u32 thread, u32 event count,
+//   u64 base timestamp (ns), u32 payload size, u32 CRC-32 of the payload
+// all little-endian. Name blocks carry (varint id, varint length, bytes)
+// records. Event blocks start with a snapshot of the thread's stack
+// (varint depth, then varint function id and zigzag enter time relative to
+// the base for each frame) followed by events encoded as
+// varint(functionId << 1 | isExit) and a zigzag varint delta in ns against
+// the previous event. With the stack snapshot every event block can be
+// decoded on its own, so a damaged block only loses its own events.
+namespace trace {
+
+const uint32_t kBlockMagic = 0x42525450; // "PTRB"
+const uint8_t kNameBlock = 1;
+const uint8_t kEventBlock = 2;
+const size_t kHeaderSize = 32;
+const size_t kBlockPayloadLimit = 64 * 1024;
+
+inline uint32_t crc32(const uint8_t *data, size_t size) {
+    static const auto table = [] {
+        array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+inline uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+template <typename Buffer>
+inline void putVarint(Buffer &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+// Returns false on a truncated or overlong varint
+inline bool getVarint(const uint8_t *&pos, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void putLE(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+inline uint64_t getLE(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+struct BlockHeader {
+    uint8_t kind = 0;
+    uint32_t thread = 0;
+    uint32_t eventCount = 0;
+    uint64_t baseTimestamp = 0;
+    uint32_t payloadSize = 0;
+    uint32_t checksum = 0;
+
+    void write(uint8_t *out) const {
+        putLE(out, kBlockMagic, 4);
+        putLE(out + 4, kind, 4);
+        putLE(out + 8, thread, 4);
+        putLE(out + 12, eventCount, 4);
+        putLE(out + 16, baseTimestamp, 8);
+        putLE(out + 24, payloadSize, 4);
+        putLE(out + 28, checksum, 4);
+    }
+
+    bool read(const uint8_t *in) {
+        if (getLE(in, 4) != kBlockMagic) {
+            return false;
+        }
+        kind = static_cast<uint8_t>(getLE(in + 4, 1));
+        thread = static_cast<uint32_t>(getLE(in + 8, 4));
+        eventCount = static_cast<uint32_t>(getLE(in + 12, 4));
+        baseTimestamp = getLE(in + 16, 8);
+        payloadSize = static_cast<uint32_t>(getLE(in + 24, 4));
+        checksum = static_cast<uint32_t>(getLE(in + 28, 4));
+        return true;
+    }
+};
+
+// Output file; blocks from all threads are appended whole. instance() is
+// the live trace, other sinks are used for one-off dumps.
+class TraceSink {
+public:
+    static TraceSink &instance() {
+        static TraceSink sink;
+        return sink;
+    }
+
+    TraceSink() = default;
+    TraceSink(const TraceSink &) = delete;
+    TraceSink &operator=(const TraceSink &) = delete;
+
+    bool isOpen() const { return file != nullptr; }
+
+    void open(const string &filename) {
+        lock_guard<mutex> guard(sinkMutex);
+        if (file) {
+            fclose(file);
+        }
+        file = fopen(filename.c_str(), "wb");
+        namesWritten = 0;
+        if (!file) {
+            cerr << "Error: Could not open the file " << filename << " for writing." << endl;
+        }
+    }
+
+    void close() {
+        lock_guard<mutex> guard(sinkMutex);
+        if (file) {
+            fclose(file);
+            file = nullptr;
+        }
+    }
+
+    // `block` holds kHeaderSize reserved bytes followed by the payload
+    void writeBlock(uint8_t *block, size_t size, BlockHeader header) {
+        lock_guard<mutex> guard(sinkMutex);
+        if (!file) {
+            return;
+        }
+        // Any function referenced by this block has been interned already,
+        // so emitting pending names first keeps the file self-describing
+        writePendingNames();
+        header.payloadSize = static_cast<uint32_t>(size - kHeaderSize);
+        header.checksum = crc32(block + kHeaderSize, header.payloadSize);
+        header.write(block);
+        fwrite(block, 1, size, file);
+    }
+
+    ~TraceSink() {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+private:
+    void writePendingNames() {
+        vector<string> pending = FunctionRegistry::namesSince(namesWritten);
+        if (pending.empty()) {
+            return;
+        }
+        vector<uint8_t> block(kHeaderSize);
+        for (const string &name : pending) {
+            putVarint(block, namesWritten++);
+            putVarint(block, name.size());
+            block.insert(block.end(), name.begin(), name.end());
+        }
+        BlockHeader header;
+        header.kind = kNameBlock;
+        header.eventCount = static_cast<uint32_t>(pending.size());
+        header.payloadSize = static_cast<uint32_t>(block.size() - kHeaderSize);
+        header.checksum = crc32(block.data() + kHeaderSize, header.payloadSize);
+        header.write(block.data());
+        fwrite(block.data(), 1, block.size(), file);
+    }
+
+    FILE *file = nullptr;
+    uint32_t namesWritten = 0;
+    mutex sinkMutex;
+};
+
+inline uint32_t nextThreadNumber() {
+    static atomic<uint32_t> nextThread{0};
+    return nextThread++;
+}
+
+// Per-thread encoder, buffers one block at a time. Buffers come from
+// ProfilerMemory; if the memory limit stops them from growing, events are
+// dropped rather than allocated elsewhere.
+class TraceEncoder {
+public:
+    TraceEncoder() : TraceEncoder(TraceSink::instance(), nextThreadNumber()) {}
+
+    TraceEncoder(TraceSink &output, uint32_t threadNumber) : sink(output), thread(threadNumber) {}
+
+    ~TraceEncoder() { flush(); }
+
+    // Declare a frame that was entered before the first recorded event
+    void openFrame(uint32_t functionId, uint64_t enterTime) {
+        pushFrame({functionId, enterTime});
+    }
+
+    void enter(uint32_t functionId, uint64_t timestamp) {
+        append(functionId, false, timestamp);
+        pushFrame({functionId, timestamp});
+    }
+
+    void exit(uint32_t functionId, uint64_t timestamp) {
+        append(functionId, true, timestamp);
+        if (untrackedFrames > 0) {
+            untrackedFrames--;
+        } else if (!stack.empty()) {
+            stack.pop_back();
+        }
+    }
+
+    // Reserves the first block's buffer before the first event
+    void prepare() {
+        block.reserve(kHeaderSize + kBlockPayloadLimit + 64, true);
+    }
+
+    void flush() {
+        if (eventCount == 0) {
+            return;
+        }
+        BlockHeader header;
+        header.kind = kEventBlock;
+        header.thread = thread;
+        header.eventCount = eventCount;
+        header.baseTimestamp = baseTimestamp;
+        sink.writeBlock(block.data(), block.size(), header);
+        block.clear();
+        eventCount = 0;
+    }
+
+private:
+    struct Frame {
+        uint32_t functionId;
+        uint64_t enterTime;
+    };
+
+    void pushFrame(const Frame &frame) {
+        if (untrackedFrames > 0 || !stack.push_back(frame)) {
+            untrackedFrames++;
+        }
+    }
+
+    void append(uint32_t functionId, bool isExit, uint64_t timestamp) {
+        if (eventCount == 0) {
+            // New block: reserve room for the whole block up front, then the
+            // header and a snapshot of the open frames
+            const size_t maxVarint = 10;
+            if (!block.reserve(kHeaderSize + stack.size() * 2 * maxVarint + kBlockPayloadLimit + 4 * maxVarint)) {
+                return;
+            }
+            block.resize(kHeaderSize);
+            baseTimestamp = timestamp;
+            lastTimestamp = timestamp;
+            putVarint(block, stack.size());
+            for (const Frame &frame : stack) {
+                putVarint(block, frame.functionId);
+                putVarint(block, zigzag(static_cast<int64_t>(frame.enterTime - baseTimestamp)));
+            }
+        }
+        putVarint(block, (static_cast<uint64_t>(functionId) << 1) | (isExit ? 1 : 0));
+        putVarint(block, zigzag(static_cast<int64_t>(timestamp - lastTimestamp)));
+        lastTimestamp = timestamp;
+        eventCount++;
+        if (block.size() - kHeaderSize >= kBlockPayloadLimit) {
+            flush();
+        }
+    }
+
+    TraceSink &sink;
+    PagedBuffer<uint8_t> block{ProfilerMemory::EventBuffers};
+    PagedBuffer<Frame> stack{ProfilerMemory::EventBuffers};
+    size_t untrackedFrames = 0;  // Frames the stack buffer couldn't hold
+    uint32_t thread = 0;
+    uint32_t eventCount = 0;
+    uint64_t baseTimestamp = 0;
+    uint64_t lastTimestamp = 0;
+};
+
+} // namespace trace
+
+// Flight-recorder mode: every thread overwrites its own fixed-size ring of
+// recent enter/exit events and nothing is written until a dump is
+// requested through dump(), a signal or the latency trigger. Each thread
+// is the only writer of its ring, so recording is a few relaxed stores
+// and a release store of the head; a dump copies the rings concurrently
+// and discards any slots that were overwritten while it was copying.
+class FlightRecorder {
+public:
+    // Ring size in events (rounded up to a power of two); only affects
+    // threads that record their first event after the call
+    static void setCapacity(size_t events) {
+        size_t capacity = 1;
+        while (capacity < events) {
+            capacity <<= 1;
+        }
+        ringCapacity = capacity;
+    }
+
+    // Maps and faults in the calling thread's ring now instead of on its
+    // first event
+    static void prepareThread() {
+        if (!localRing) {
+            createRing(true);
+        }
+    }
+
+    static void record(uint32_t functionId, bool isExit, uint64_t timestamp, uint64_t enterTime) {
+        Ring *ring = localRing ? localRing : createRing();
+        uint64_t head = ring->head.load(memory_order_relaxed);
+        Entry &entry = ring->entries[head & ring->mask];
+        entry.timestamp.store(timestamp, memory_order_relaxed);
+        entry.enterTime.store(enterTime, memory_order_relaxed);
+        entry.functionId.store(isExit ? (functionId | kExitFlag) : functionId, memory_order_relaxed);
+        ring->head.store(head + 1, memory_order_release);
+    }
+
+    // Write the current contents of every ring in the compressed trace
+    // format, readable with `main7 decode`
+    static bool dump(const string &filename) {
+        trace::TraceSink sink;
+        sink.open(filename);
+        if (!sink.isOpen()) {
+            return false;
+        }
+        for (const Ring *ring = rings.load(memory_order_acquire); ring; ring = ring->next) {
+            dumpRing(*ring, sink);
+        }
+        sink.close();
+        return true;
+    }
+
+    // Dump as soon as `signum` arrives, even if the process is idle or
+    // stuck outside instrumented code. Encoding is not async-signal-safe,
+    // so the handler only writes a byte to a pipe that a dumper thread
+    // waits on.
+    static void installSignalTrigger(int signum = SIGUSR1) {
+        if (signalPipe < 0) {
+            int fds[2];
+            if (pipe(fds) != 0) {
+                cerr << "Error: Could not create the flight recorder's signal pipe." << endl;
+                return;
+            }
+            fcntl(fds[1], F_SETFL, O_NONBLOCK);  // A burst of signals just drops bytes
+            signalPipe = fds[1];
+            thread([reader = fds[0]] {
+                char byte;
+                for (;;) {
+                    ssize_t got = read(reader, &byte, 1);
+                    if (got == 1) {
+                        dumpNext();
+                    } else if (got < 0 && errno != EINTR) {
+                        return;
+                    }
+                }
+            }).detach();
+        }
+        signal(signum, [](int) {
+            int saved = errno;
+            char byte = 1;
+            ssize_t written = write(signalPipe, &byte, 1);
+            (void)written;
+            errno = saved;
+        });
+    }
+
+    // Dump whenever a single call takes at least `thresholdMicros`; at most
+    // one dump per `cooldown` so a slow phase doesn't produce a dump storm
+    static void setLatencyTrigger(long long thresholdMicros, seconds cooldown = seconds(1)) {
+        latencyThreshold = thresholdMicros;
+        latencyCooldown = duration_cast<nanoseconds>(cooldown).count();
+    }
+
+    // Called on every instrumented function exit
+    static void checkTriggers(long long durationMicros, uint64_t now) {
+        if (latencyThreshold <= 0 || durationMicros < latencyThreshold) {
+            return;
+        }
+        uint64_t last = lastTriggeredDump.load(memory_order_relaxed);
+        if (last != 0 && now - last < static_cast<uint64_t>(latencyCooldown)) {
+            return;
+        }
+        if (!lastTriggeredDump.compare_exchange_strong(last, now)) {
+            return;  // Another thread is dumping for the same spike
+        }
+        dumpNext();
+    }
+
+private:
+    static const uint32_t kExitFlag = 0x80000000u;
+
+    static void dumpNext() {
+        string filename = "flight_recorder_" + to_string(dumpCounter++) + ".bin";
+        if (dump(filename)) {
+            cerr << "Flight recorder dumped to " << filename << endl;
+        }
+    }
+
+    struct Entry {
+        atomic<uint64_t> timestamp{0};
+        atomic<uint64_t> enterTime{0};  // Only meaningful for exits
+        atomic<uint32_t> functionId{0};
+    };
+
+    struct Ring {
+        Entry *entries = nullptr;
+        uint64_t mask = 0;
+        atomic<uint32_t> thread{0};
+        atomic<uint64_t> head{0};
+        atomic<uint64_t> start{0};  // Head when the current thread took the ring over
+        Ring *next = nullptr;
+        Ring *nextFree = nullptr;
+    };
+
+    // Hands the thread's ring to the free list when the thread exits
+    struct RingOwner {
+        Ring *ring = nullptr;
+
+        ~RingOwner() {
+            if (ring) {
+                lock_guard<mutex> guard(freeMutex);
+                ring->nextFree = freeRings;
+                freeRings = ring;
+                localRing = nullptr;
+            }
+        }
+    };
+
+    struct Event {
+        uint64_t timestamp;
+        uint64_t enterTime;
+        uint32_t functionId;
+        bool isExit;
+    };
+
+    // Rings live in ProfilerMemory pages and outlive their threads, so a
+    // dump still shows threads that exited, until a new thread takes the
+    // ring over; so the memory held is bounded by the most threads alive
+    // at once rather than by every thread ever started. If the memory
+    // limit refuses a ring the thread records into a one-slot scratch
+    // ring that is never dumped.
+    static Ring *createRing(bool prefault = false) {
+        {
+            lock_guard<mutex> guard(freeMutex);
+            for (Ring **link = &freeRings; *link; link = &(*link)->nextFree) {
+                Ring *ring = *link;
+                if (ring->mask + 1 == ringCapacity) {
+                    *link = ring->nextFree;
+                    // The previous thread's events stay readable until overwritten,
+                    // but a dump only shows the ones recorded from here on
+                    ring->thread.store(trace::nextThreadNumber(), memory_order_relaxed);
+                    ring->start.store(ring->head.load(memory_order_relaxed), memory_order_release);
+                    ringOwner.ring = ring;
+                    localRing = ring;
+                    return localRing;
+                }
+            }
+        }
+        size_t bytes = ProfilerMemory::pageRound(sizeof(Ring) + ringCapacity * sizeof(Entry));
+        void *pages = ProfilerMemory::mapPages(bytes, true, prefault);
+        if (!pages) {
+            static thread_local Entry scratchEntry;
+            static thread_local Ring scratch;
+            scratch.entries = &scratchEntry;
+            localRing = &scratch;
+            return localRing;
+        }
+        ProfilerMemory::account(ProfilerMemory::EventBuffers, bytes);
+        Ring *ring = new (pages) Ring;
+        ring->entries = new (static_cast<char *>(pages) + sizeof(Ring)) Entry[ringCapacity];
+        ring->mask = ringCapacity - 1;
+        ring->thread.store(trace::nextThreadNumber(), memory_order_relaxed);
+        ring->next = rings.load(memory_order_relaxed);
+        while (!rings.compare_exchange_weak(ring->next, ring, memory_order_release)) {
+        }
+        ringOwner.ring = ring;
+        localRing = ring;
+        return localRing;
+    }
+
+    static void dumpRing(const Ring &ring, trace::TraceSink &sink) {
+        uint64_t capacity = ring.mask + 1;
+        uint64_t start = ring.start.load(memory_order_acquire);
+        uint64_t end = ring.head.load(memory_order_acquire);
+        uint64_t begin = max(start, end > capacity ? end - capacity : 0);
+        vector<Event> events;
+        events.reserve(end - begin);
+        for (uint64_t i = begin; i < end; ++i) {
+            const Entry &entry = ring.entries[i & ring.mask];
+            uint32_t id = entry.functionId.load(memory_order_relaxed);
+            events.push_back({entry.timestamp.load(memory_order_relaxed),
+                              entry.enterTime.load(memory_order_relaxed),
+                              id & ~kExitFlag, (id & kExitFlag) != 0});
+        }
+        // Slots the writer lapped while we were copying are unreliable
+        uint64_t lapped = ring.head.load(memory_order_acquire);
+        size_t skip = lapped > begin + capacity ? min<size_t>(events.size(), lapped - begin - capacity) : 0;
+
+        // Exits whose enter fell out of the window are frames that were
+        // already open when the window starts; their enter time travels
+        // with the exit event, so the trace can still attribute them
+        vector<const Event *> openFrames;
+        int depth = 0;
+        for (size_t i = skip; i < events.size(); ++i) {
+            if (!events[i].isExit) {
+                depth++;
+            } else if (depth > 0) {
+                depth--;
+            } else {
+                openFrames.push_back(&events[i]);
+            }
+        }
+
+        trace::TraceEncoder encoder(sink, ring.thread.load(memory_order_relaxed));
+        for (auto it = openFrames.rbegin(); it != openFrames.rend(); ++it) {
+            encoder.openFrame((*it)->functionId, (*it)->enterTime);
+        }
+        for (size_t i = skip; i < events.size(); ++i) {
+            if (events[i].isExit) {
+                encoder.exit(events[i].functionId, events[i].timestamp);
+            } else {
+                encoder.enter(events[i].functionId, events[i].timestamp);
+            }
+        }
+    }
+
+    static size_t ringCapacity;
+    static atomic<Ring *> rings;
+    static thread_local Ring *localRing;
+    static thread_local RingOwner ringOwner;
+    static mutex freeMutex;
+    static Ring *freeRings;
+    static int signalPipe;  // Write end, for the signal handler
+    static atomic<uint64_t> lastTriggeredDump;
+    static atomic<int> dumpCounter;
+    static long long latencyThreshold;
+    static long long latencyCooldown;
+};
+
+inline size_t FlightRecorder::ringCapacity = 16384;
+inline atomic<FlightRecorder::Ring *> FlightRecorder::rings{nullptr};
+inline thread_local FlightRecorder::Ring *FlightRecorder::localRing = nullptr;
+inline thread_local FlightRecorder::RingOwner FlightRecorder::ringOwner;
+inline mutex FlightRecorder::freeMutex;
+inline FlightRecorder::Ring *FlightRecorder::freeRings = nullptr;
+inline int FlightRecorder::signalPipe = -1;
+inline atomic<uint64_t> FlightRecorder::lastTriggeredDump{0};
+inline atomic<int> FlightRecorder::dumpCounter{0};
+inline long long FlightRecorder::latencyThreshold = 0;
+inline long long FlightRecorder::latencyCooldown = 0;
+
+// Profile store in POSIX shared memory, so pre-forked worker processes
+// can aggregate into one host-wide profile that another process reads
+// without any files being written. The segment holds two fixed-capacity
+// open-addressing tables:
+//   functions: slot index = shared function ID, name stored inline
+//   nodes:     calling-context nodes keyed by (parent node, function)
+// Entries are claimed with a CAS on their key and never removed, and
+// counters are updated with atomic adds, so any number of processes can
+// record and read concurrently without locks. When a table is full, new
+// contexts are dropped and counted.
+class SharedProfileStore {
+public:
+    static const uint32_t kMagic = 0x50535250; // "PRSP"
+    static const size_t kMaxNameLength = 119;  // Longer names are truncated
+
+    // Attaches to the store called `name`, creating it with the given
+    // capacities (rounded up to powers of two) if it doesn't exist yet
+    static unique_ptr<SharedProfileStore> open(const string &name, size_t functions = 4096, size_t nodes = 65536) {
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            size_t functionCapacity = roundUp(functions);
+            size_t nodeCapacity = roundUp(nodes);
+            size_t bytes = segmentSize(functionCapacity, nodeCapacity);
+            if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+                cerr << "Error: Could not size the shared profile store " << name << "." << endl;
+                ::close(fd);
+                shm_unlink(name.c_str());
+                return nullptr;
+            }
+            unique_ptr<SharedProfileStore> store = map(fd, bytes, name);
+            if (store) {
+                // Fresh pages are zero, which is an empty table; publish the
+                // header last so attaching processes wait for it
+                Header *header = store->header;
+                header->functionCapacity = functionCapacity;
+                header->nodeCapacity = nodeCapacity;
+                header->magic.store(kMagic, memory_order_release);
+                store->locate();
+            }
+            return store;
+        }
+        return attach(name);
+    }
+
+    // Attaches to an existing store, waiting briefly for its creator to
+    // finish setting it up
+    static unique_ptr<SharedProfileStore> attach(const string &name) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            cerr << "Error: Could not open the shared profile store " << name << "." << endl;
+            return nullptr;
+        }
+        struct stat info;
+        for (int attempt = 0; fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header); ++attempt) {
+            if (attempt == 1000) {
+                cerr << "Error: The shared profile store " << name << " was never initialized." << endl;
+                ::close(fd);
+                return nullptr;
+            }
+            this_thread::sleep_for(milliseconds(1));
+        }
+        unique_ptr<SharedProfileStore> store = map(fd, static_cast<size_t>(info.st_size), name);
+        if (!store) {
+            return nullptr;
+        }
+        for (int attempt = 0; store->header->magic.load(memory_order_acquire) != kMagic; ++attempt) {
+            if (attempt == 1000) {
+                cerr << "Error: The shared profile store " << name << " was never initialized." << endl;
+                return nullptr;
+            }
+            this_thread::sleep_for(milliseconds(1));
+        }
+        if (segmentSize(store->header->functionCapacity, store->header->nodeCapacity) > store->bytes) {
+            cerr << "Error: The shared profile store " << name << " is damaged." << endl;
+            return nullptr;
+        }
+        store->locate();
+        return store;
+    }
+
+    // Removes the name; processes that are attached keep their mapping
+    static void unlink(const string &name) {
+        shm_unlink(name.c_str());
+    }
+
+    ~SharedProfileStore() {
+        munmap(header, bytes);
+    }
+
+    // Shared node for a context-tree node, resolved once per thread-local
+    // node and cached in it. The caller's node must already be resolved,
+    // which holds when this is called on entry.
+    void resolve(ContextNode *node) {
+        if (node->sharedNode != 0 || !node->parent) {
+            return;
+        }
+        if (node->parent->parent && node->parent->sharedNode == 0) {
+            resolve(node->parent);  // Store attached while calls were in flight
+        }
+        uint32_t parentRef = node->parent->parent ? node->parent->sharedNode : 0;
+        uint32_t function = parentRef == kDropped ? kDropped : functionSlot(FunctionRegistry::nameOf(node->functionId));
+        node->sharedNode = function == kDropped ? kDropped : nodeSlot(parentRef, function);
+    }
+
+    void add(const ContextNode *node, long long time) {
+        if (node->sharedNode == 0 || node->sharedNode == kDropped) {
+            return;
+        }
+        SharedNode &shared = nodes[node->sharedNode - 1];
+        shared.callCount.fetch_add(1, memory_order_relaxed);
+        shared.totalTime.fetch_add(time, memory_order_relaxed);
+    }
+
+    // Copy the current contents into `graph` as imported data. Counters of
+    // calls being recorded meanwhile may be a call behind.
+    void importInto(CallGraph &graph) const {
+        vector<string> paths(header->nodeCapacity);
+        vector<uint8_t> built(header->nodeCapacity, 0);
+        vector<uint32_t> chain;
+        for (uint32_t slot = 0; slot < header->nodeCapacity; ++slot) {
+            if (nodes[slot].key.load(memory_order_acquire) == 0 || built[slot]) {
+                continue;
+            }
+            // Build the paths of the unbuilt ancestors outermost first
+            chain.clear();
+            for (uint32_t ref = slot + 1; ref != 0 && !built[ref - 1];
+                 ref = static_cast<uint32_t>(nodes[ref - 1].key.load(memory_order_acquire) >> 32)) {
+                chain.push_back(ref - 1);
+            }
+            for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+                uint64_t key = nodes[*it].key.load(memory_order_relaxed);
+                uint32_t parentRef = static_cast<uint32_t>(key >> 32);
+                string name = functionName(static_cast<uint32_t>(key) - 1);
+                paths[*it] = parentRef == 0 ? name : paths[parentRef - 1] + " -> " + name;
+                built[*it] = 1;
+
+                long long calls = nodes[*it].callCount.load(memory_order_relaxed);
+                if (calls == 0) {
+                    continue;
+                }
+                if (parentRef != 0) {
+                    uint64_t parentKey = nodes[parentRef - 1].key.load(memory_order_relaxed);
+                    graph.addCall(functionName(static_cast<uint32_t>(parentKey) - 1), name, static_cast<int>(calls));
+                }
+                PathInfo info;
+                info.totalTime = nodes[*it].totalTime.load(memory_order_relaxed);
+                info.callCount = static_cast<int>(calls);
+                graph.updatePathProfile(paths[*it], info);
+            }
+        }
+    }
+
+    void writeReport(ostream &out) const {
+        out << "Shared profile store " << storeName << ": "
+            << header->functionCount.load(memory_order_relaxed) << "/" << header->functionCapacity << " functions, "
+            << header->nodeCount.load(memory_order_relaxed) << "/" << header->nodeCapacity << " contexts";
+        long long dropped = header->dropped.load(memory_order_relaxed);
+        if (dropped > 0) {
+            out << ", " << dropped << " context(s) dropped because a table was full";
+        }
+        out << endl;
+    }
+
+private:
+    static const uint32_t kDropped = UINT32_MAX;
+
+    struct Header {
+        atomic<uint32_t> magic;
+        uint32_t reserved;
+        uint64_t functionCapacity;
+        uint64_t nodeCapacity;
+        atomic<uint32_t> functionCount;
+        atomic<uint32_t> nodeCount;
+        atomic<long long> dropped;
+    };
+
+    struct SharedFunction {
+        atomic<uint32_t> state;  // 0 empty, 1 being written, 2 ready
+        uint32_t length;
+        char name[kMaxNameLength + 1];
+    };
+
+    // key = (parent slot + 1, or 0 for a top-level context) << 32 | (function + 1)
+    struct SharedNode {
+        atomic<uint64_t> key;
+        atomic<long long> callCount;
+        atomic<long long> totalTime;  // µs
+    };
+
+    static_assert(atomic<uint64_t>::is_always_lock_free && atomic<long long>::is_always_lock_free,
+                  "shared-memory counters must be lock-free to be usable across processes");
+
+    SharedProfileStore(int fd, void *pages, size_t bytes, const string &name)
+        : header(static_cast<Header *>(pages)), bytes(bytes), storeName(name) {
+        ::close(fd);
+    }
+
+    static unique_ptr<SharedProfileStore> map(int fd, size_t bytes, const string &name) {
+        void *pages = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (pages == MAP_FAILED) {
+            cerr << "Error: Could not map the shared profile store " << name << "." << endl;
+            ::close(fd);
+            return nullptr;
+        }
+        return unique_ptr<SharedProfileStore>(new SharedProfileStore(fd, pages, bytes, name));
+    }
+
+    static size_t roundUp(size_t count) {
+        size_t capacity = 64;
+        while (capacity < count) {
+            capacity <<= 1;
+        }
+        return capacity;
+    }
+
+    static size_t segmentSize(size_t functionCapacity, size_t nodeCapacity) {
+        return sizeof(Header) + functionCapacity * sizeof(SharedFunction) + nodeCapacity * sizeof(SharedNode);
+    }
+
+    void locate() {
+        functions = reinterpret_cast<SharedFunction *>(header + 1);
+        nodes = reinterpret_cast<SharedNode *>(functions + header->functionCapacity);
+    }
+
+    static uint64_t hashName(const char *name, size_t length) {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(name[i])) * 0x100000001B3ULL;
+        }
+        return hash;
+    }
+
+    uint32_t functionSlot(const char *name) {
+        size_t length = strlen(name);
+        if (length > kMaxNameLength) {
+            length = kMaxNameLength;
+        }
+        size_t mask = header->functionCapacity - 1;
+        size_t slot = hashName(name, length) & mask;
+        for (size_t probe = 0; probe <= mask; ++probe, slot = (slot + 1) & mask) {
+            SharedFunction &entry = functions[slot];
+            uint32_t state = entry.state.load(memory_order_acquire);
+            if (state == 0 && entry.state.compare_exchange_strong(state, 1, memory_order_acquire)) {
+                memcpy(entry.name, name, length);
+                entry.name[length] = '\0';
+                entry.length = static_cast<uint32_t>(length);
+                entry.state.store(2, memory_order_release);
+                header->functionCount.fetch_add(1, memory_order_relaxed);
+                return static_cast<uint32_t>(slot);
+            }
+            // Another process is writing this entry's name; it won't be long
+            while (state == 1) {
+                this_thread::yield();
+                state = entry.state.load(memory_order_acquire);
+            }
+            if (entry.length == length && memcmp(entry.name, name, length) == 0) {
+                return static_cast<uint32_t>(slot);
+            }
+        }
+        header->dropped.fetch_add(1, memory_order_relaxed);
+        return kDropped;
+    }
+
+    uint32_t nodeSlot(uint32_t parentRef, uint32_t function) {
+        uint64_t key = static_cast<uint64_t>(parentRef) << 32 | (function + 1);
+        size_t mask = header->nodeCapacity - 1;
+        size_t slot = static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+        for (size_t probe = 0; probe <= mask; ++probe, slot = (slot + 1) & mask) {
+            uint64_t existing = nodes[slot].key.load(memory_order_acquire);
+            if (existing == 0 && nodes[slot].key.compare_exchange_strong(existing, key, memory_order_acq_rel)) {
+                header->nodeCount.fetch_add(1, memory_order_relaxed);
+                return static_cast<uint32_t>(slot + 1);
+            }
+            if (existing == key) {
+                return static_cast<uint32_t>(slot + 1);
+            }
+        }
+        header->dropped.fetch_add(1, memory_order_relaxed);
+        return kDropped;
+    }
+
+    string functionName(uint32_t function) const {
+        const SharedFunction &entry = functions[function];
+        if (entry.state.load(memory_order_acquire) != 2) {
+            return "(unknown)";
+        }
+        return string(entry.name, entry.length);
+    }
+
+    Header *header;
+    SharedFunction *functions = nullptr;
+    SharedNode *nodes = nullptr;
+    size_t bytes;
+    string storeName;
+};
+
+// Time series of a graph's path profiles for spotting phases and stalls.
+// Every interval the context trees are sampled and the per-path deltas
+// (self time and completed calls since the previous sample) are kept as a
+// compact window in a ring; once the ring is full the oldest window is
+// overwritten. Calls are attributed to the window in which they complete.
+class ProfileSeries {
+public:
+    ProfileSeries(const CallGraph &graph, size_t windows = 300)
+        : graph(graph), ring(max<size_t>(1, windows)), origin(high_resolution_clock::now()), lastSample(origin) {}
+
+    ~ProfileSeries() { stop(); }
+
+    // Sample every `interval` on a background thread until stop()
+    void start(microseconds interval) {
+        stop();
+        running = true;
+        sampler = thread([this, interval] {
+            unique_lock<mutex> guard(stopMutex);
+            auto next = high_resolution_clock::now() + interval;
+            while (!stopRequested.wait_until(guard, next, [this] { return !running; })) {
+                sample();
+                next += interval;
+            }
+        });
+    }
+
+    // Stops the background thread and closes the current window
+    void stop() {
+        if (!sampler.joinable()) {
+            return;
+        }
+        {
+            lock_guard<mutex> guard(stopMutex);
+            running = false;
+        }
+        stopRequested.notify_all();
+        sampler.join();
+        sample();
+    }
+
+    // Close the current window now
+    void sample() {
+        lock_guard<mutex> guard(seriesMutex);
+        auto now = high_resolution_clock::now();
+        if (windowCount == ring.size()) {
+            firstWindow = (firstWindow + 1) % ring.size();
+            windowCount--;
+        }
+        Window &window = ring[(firstWindow + windowCount++) % ring.size()];
+        window.start = duration_cast<microseconds>(lastSample - origin).count();
+        window.end = duration_cast<microseconds>(now - origin).count();
+        window.entries.clear();
+        lastSample = now;
+
+        vector<const ContextNode *> pending;
+        for (const ThreadProfile *profile = ThreadProfile::first(); profile; profile = profile->nextProfile()) {
+            if (profile->owner != graph.id()) {
+                continue;
+            }
+            pending.push_back(&profile->root);
+            while (!pending.empty()) {
+                const ContextNode *node = pending.back();
+                pending.pop_back();
+                for (const ContextNode *c = node->firstChild.load(memory_order_acquire); c;
+                     c = c->nextSibling.load(memory_order_acquire)) {
+                    if (c->kind == ContextNode::Function) {
+                        pending.push_back(c);
+                    }
+                }
+                if (!node->parent) {
+                    continue;
+                }
+
+                auto inserted = previous.emplace(node, Totals{0, 0, 0});
+                if (inserted.second) {
+                    // Threads running the same path share one series
+                    auto path = pathIndex.emplace(pathOf(node), static_cast<uint32_t>(paths.size()));
+                    if (path.second) {
+                        paths.push_back(path.first->first);
+                        windowSlot.push_back(-1);
+                    }
+                    inserted.first->second.path = path.first->second;
+                }
+                Totals &last = inserted.first->second;
+                long long selfTime = node->selfTime.load(memory_order_relaxed);
+                long long calls = node->callCount.load(memory_order_relaxed);
+                if (selfTime == last.selfTime && calls == last.calls) {
+                    continue;
+                }
+                int32_t &slot = windowSlot[last.path];
+                if (slot < 0) {
+                    slot = static_cast<int32_t>(window.entries.size());
+                    window.entries.push_back({last.path, 0, 0});
+                }
+                window.entries[slot].calls += static_cast<uint32_t>(calls - last.calls);
+                window.entries[slot].selfTime += selfTime - last.selfTime;
+                last.selfTime = selfTime;
+                last.calls = calls;
+            }
+        }
+        for (const Entry &entry : window.entries) {
+            windowSlot[entry.path] = -1;
+        }
+    }
+
+    // One row per path per window in which it completed calls:
+    // window, start and end (ms since the series began), path, self time (µs), calls
+    void writeCsv(const string &filename) const {
+        ofstream seriesFile(filename);
+        if (!seriesFile) {
+            cerr << "Error: Could not open the file " << filename << " for writing." << endl;
+            return;
+        }
+
+        lock_guard<mutex> guard(seriesMutex);
+        seriesFile << "window,start_ms,end_ms,path,self_time_us,calls\n";
+        for (size_t i = 0; i < windowCount; ++i) {
+            const Window &window = ring[(firstWindow + i) % ring.size()];
+            for (const Entry &entry : window.entries) {
+                seriesFile << i << ',' << fixed << setprecision(3) << window.start / 1000.0 << ','
+                           << window.end / 1000.0 << ",\"" << paths[entry.path] << "\"," << entry.selfTime << ','
+                           << entry.calls << '\n';
+            }
+        }
+        seriesFile.close();
+    }
+
+private:
+    struct Entry {
+        uint32_t path;
+        uint32_t calls;
+        long long selfTime;
+    };
+
+    struct Window {
+        long long start = 0;  // µs since the series began
+        long long end = 0;
+        vector<Entry> entries;  // Paths with activity in this window only
+    };
+
+    struct Totals {
+        long long selfTime;
+        long long calls;
+        uint32_t path;
+    };
+
+    static string pathOf(const ContextNode *node) {
+        string path = FunctionRegistry::name(node->functionId);
+        for (node = node->parent; node->parent; node = node->parent) {
+            path = FunctionRegistry::name(node->functionId) + " -> " + path;
+        }
+        return path;
+    }
+
+    const CallGraph &graph;
+    vector<Window> ring;
+    size_t firstWindow = 0;
+    size_t windowCount = 0;
+    unordered_map<const ContextNode *, Totals> previous;
+    unordered_map<string, uint32_t> pathIndex;
+    vector<string> paths;          // Path index -> path
+    vector<int32_t> windowSlot;    // Path index -> entry in the window being built
+    high_resolution_clock::time_point origin;
+    high_resolution_clock::time_point lastSample;
+    mutable mutex seriesMutex;
+
+    thread sampler;
+    mutex stopMutex;
+    condition_variable stopRequested;
+    bool running = false;
+};
+
+// Record-time filter: which LOG_CALL/LOG_SCOPE calls are recorded at all.
+// Configured once at startup, from the PROFILER_FILTER environment
+// variable or a file (one setting per line, '#' starts a comment):
+//
+//   include=net*,parse?       only functions matching one of these globs
+//   exclude=*Loop             never these (wins over include)
+//   max-depth=8               nothing nested deeper than this on its thread
+//   inside=handleRequest      only these functions and their callees
+//
+// In the variable, settings are separated by ';'. Patterns are matched
+// against each function's name once, the first time it is called, and the
+// result kept in a per-ID byte, so the hot-path decision is one load and a
+// bit test plus the depth counters. A call that isn't recorded costs no
+// event, node or timing; recorded callees hang off the nearest recorded
+// caller.
+class CallFilter {
+public:
+    static bool loadFromEnvironment() {
+        const char *file = getenv("PROFILER_FILTER_FILE");
+        if (file && !loadFile(file)) {
+            return false;
+        }
+        const char *settings = getenv("PROFILER_FILTER");
+        return !settings || configure(settings, ';');
+    }
+
+    static bool loadFile(const string &filename) {
+        ifstream config(filename);
+        if (!config) {
+            cerr << "Error: Could not open the filter file " << filename << "." << endl;
+            return false;
+        }
+        string text, line;
+        while (getline(config, line)) {
+            text += line.substr(0, line.find('#')) + "\n";
+        }
+        return configure(text, '\n');
+    }
+
+    // Call before any instrumented code runs
+    static bool configure(string_view settings, char separator) {
+        for (size_t start = 0; start < settings.size();) {
+            size_t end = settings.find(separator, start);
+            string setting = trim(settings.substr(start, end == string_view::npos ? string_view::npos : end - start));
+            start = end == string_view::npos ? settings.size() : end + 1;
+            if (setting.empty()) {
+                continue;
+            }
+            size_t equals = setting.find('=');
+            string key = equals == string::npos ? setting : trim(setting.substr(0, equals));
+            string value = equals == string::npos ? "" : trim(setting.substr(equals + 1));
+            if (key == "include") {
+                addPatterns(value, includes);
+            } else if (key == "exclude") {
+                addPatterns(value, excludes);
+            } else if (key == "inside") {
+                addPatterns(value, triggers);
+            } else if (key == "max-depth") {
+                maxDepth = atoi(value.c_str());
+            } else {
+                cerr << "Error: Unknown filter setting \"" << setting << "\"." << endl;
+                return false;
+            }
+        }
+        enabled = !includes.empty() || !excludes.empty() || !triggers.empty() || maxDepth > 0;
+        for (auto &mask : masks) {
+            mask.store(0, memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Drop every setting, so the next configure starts afresh. Call while
+    // no instrumented call is in flight.
+    static void reset() {
+        includes.clear();
+        excludes.clear();
+        triggers.clear();
+        maxDepth = 0;
+        configure("", ';');
+    }
+
+    static bool active() { return enabled; }
+
+    // Called on every enter and exit of an instrumented call while the
+    // filter is active; enter returns whether the call is recorded
+    static bool enter(uint32_t functionId) {
+        uint8_t mask = maskOf(functionId);
+        depth++;
+        if (mask & kTrigger) {
+            triggerDepth++;
+        }
+        return (mask & kIncluded) && (maxDepth == 0 || depth <= maxDepth) && (triggers.empty() || triggerDepth > 0);
+    }
+
+    static void exit(uint32_t functionId) {
+        depth--;
+        if (maskOf(functionId) & kTrigger) {
+            triggerDepth--;
+        }
+    }
+
+    // Counters only go through the include/exclude lists
+    static bool allows(uint32_t counterId) { return !enabled || (maskOf(counterId) & kIncluded); }
+
+    // '*' matches any run of characters, '?' any one character
+    static bool globMatch(string_view pattern, string_view text) {
+        size_t p = 0, t = 0, starP = string_view::npos, starT = 0;
+        while (t < text.size()) {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+                p++;
+                t++;
+            } else if (p < pattern.size() && pattern[p] == '*') {
+                starP = p++;
+                starT = t;
+            } else if (starP != string_view::npos) {
+                p = starP + 1;
+                t = ++starT;
+            } else {
+                return false;
+            }
+        }
+        while (p < pattern.size() && pattern[p] == '*') {
+            p++;
+        }
+        return p == pattern.size();
+    }
+
+private:
+    static const uint8_t kClassified = 1;
+    static const uint8_t kIncluded = 2;
+    static const uint8_t kTrigger = 4;
+    static const uint32_t kMaxMasks = 65536;  // Functions past this are matched on every call
+
+    static uint8_t maskOf(uint32_t functionId) {
+        uint8_t mask = functionId < kMaxMasks ? masks[functionId].load(memory_order_relaxed) : 0;
+        if (!mask) {
+            mask = classify(FunctionRegistry::nameOf(functionId));
+            if (functionId < kMaxMasks) {
+                masks[functionId].store(mask, memory_order_relaxed);
+            }
+        }
+        return mask;
+    }
+
+    static uint8_t classify(string_view name) {
+        // A scope ("function:block") is filtered as its function
+        string_view function = name.empty() || name[0] == '[' ? name : name.substr(0, name.find(':'));
+        auto matchesAny = [&](const vector<string> &patterns) {
+            for (const string &pattern : patterns) {
+                if (globMatch(pattern, name) || globMatch(pattern, function)) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        uint8_t mask = kClassified;
+        if ((includes.empty() || matchesAny(includes)) && !matchesAny(excludes)) {
+            mask |= kIncluded;
+        }
+        if (matchesAny(triggers)) {
+            mask |= kTrigger;
+        }
+        return mask;
+    }
+
+    static void addPatterns(const string &list, vector<string> &patterns) {
+        for (size_t start = 0; start <= list.size();) {
+            size_t end = list.find(',', start);
+            string pattern = trim(string_view(list).substr(start, end == string::npos ? string::npos : end - start));
+            if (!pattern.empty()) {
+                patterns.push_back(pattern);
+            }
+            start = end == string::npos ? list.size() + 1 : end + 1;
+        }
+    }
+
+    static string trim(string_view text) {
+        size_t first = text.find_first_not_of(" \t\r");
+        size_t last = text.find_last_not_of(" \t\r");
+        return first == string_view::npos ? string() : string(text.substr(first, last - first + 1));
+    }
+
+    static bool enabled;
+    static int maxDepth;
+    static vector<string> includes;
+    static vector<string> excludes;
+    static vector<string> triggers;
+    static atomic<uint8_t> masks[kMaxMasks];
+    static thread_local int depth;
+    static thread_local int triggerDepth;
+};
+
+inline bool CallFilter::enabled = false;
+inline int CallFilter::maxDepth = 0;
+inline vector<string> CallFilter::includes;
+inline vector<string> CallFilter::excludes;
+inline vector<string> CallFilter::triggers;
+inline atomic<uint8_t> CallFilter::masks[CallFilter::kMaxMasks];
+inline thread_local int CallFilter::depth = 0;
+inline thread_local int CallFilter::triggerDepth = 0;
+
+// Building blocks of a logger. Logger picks among them at run time;
+// BasicLogger takes one of each kind as a template argument, so a feature
+// it doesn't use costs nothing. Every policy is a struct of static
+// functions plus a State kept in each logger (empty when not needed).
+
+// Clocks: now(), the µs between two readings, and nanosecond timestamps
+// for the event stream
+struct SteadyClock {
+    using TimePoint = high_resolution_clock::time_point;
+
+    static TimePoint now() { return high_resolution_clock::now(); }
+
+    static long long micros(TimePoint start, TimePoint end) {
+        return duration_cast<microseconds>(end - start).count();
+    }
+
+    static uint64_t timestampNs(TimePoint time) {
+        return static_cast<uint64_t>(duration_cast<nanoseconds>(time.time_since_epoch()).count());
+    }
+};
+
+#if defined(__x86_64__)
+// The time-stamp counter: a few cycles per reading instead of a
+// clock_gettime call. Assumes an invariant TSC, synchronized across
+// cores. The tick rate is measured against SteadyClock on first use
+// (about 10 ms), and timestamps are on SteadyClock's scale, so both
+// clocks can feed one event stream.
+struct TscClock {
+    using TimePoint = uint64_t;
+
+    static TimePoint now() { return __rdtsc(); }
+
+    static long long micros(TimePoint start, TimePoint end) {
+        return end > start ? static_cast<long long>((end - start) / calibration().ticksPerNs / 1000.0) : 0;
+    }
+
+    static uint64_t timestampNs(TimePoint time) {
+        const Calibration &base = calibration();
+        double offset = (static_cast<double>(time) - static_cast<double>(base.ticks)) / base.ticksPerNs;
+        return base.ns + static_cast<int64_t>(offset);
+    }
+
+    // Measures the tick rate now rather than on first use
+    static void calibrate() { calibration(); }
+
+private:
+    struct Calibration {
+        uint64_t ticks;
+        uint64_t ns;
+        double ticksPerNs;
+    };
+
+    static const Calibration &calibration() {
+        static const Calibration measured = [] {
+            SteadyClock::TimePoint start = SteadyClock::now();
+            uint64_t startTicks = __rdtsc();
+            this_thread::sleep_for(milliseconds(10));
+            SteadyClock::TimePoint end = SteadyClock::now();
+            uint64_t endTicks = __rdtsc();
+            double elapsedNs = static_cast<double>(duration_cast<nanoseconds>(end - start).count());
+            return Calibration{startTicks, SteadyClock::timestampNs(start), (endTicks - startTicks) / elapsedNs};
+        }();
+        return measured;
+    }
+};
+#else
+struct TscClock : SteadyClock {
+    static void calibrate() {}
+};
+#endif
+
+// Sinks: where the enter/exit event stream goes. Timestamps are passed as
+// clock readings, so a sink that doesn't use them never converts them.
+struct NullSink {
+    struct State {};
+
+    template <typename Clock>
+    static void enter(State &, uint32_t, typename Clock::TimePoint) {}
+
+    template <typename Clock>
+    static void exit(State &, uint32_t, typename Clock::TimePoint, typename Clock::TimePoint, long long) {}
+};
+
+// "Entering X" / "Exiting X" lines in event_log.txt
+struct TextLogSink {
+    struct State {
+        ofstream logFile;
+    };
+
+    template <typename Clock>
+    static void enter(State &state, uint32_t functionId, typename Clock::TimePoint) {
+        state.logFile.open("event_log.txt", ios_base::app);
+        // Flush now: each Logger has its own stream, and an unflushed
+        // "Entering" line would land after all of its callees' lines
+        state.logFile << "Entering " << FunctionRegistry::nameOf(functionId) << "\n" << flush;
+    }
+
+    template <typename Clock>
+    static void exit(State &state, uint32_t functionId, typename Clock::TimePoint, typename Clock::TimePoint,
+                     long long duration) {
+        state.logFile << "Exiting " << FunctionRegistry::nameOf(functionId) << " (Execution Time: " << duration << " µs)\n";
+        state.logFile.close();
+    }
+};
+
+// Per-thread delta/varint encoded blocks (see trace::); open the file with
+// trace::TraceSink::instance().open() before any instrumented code runs
+struct CompressedTraceSink {
+    using State = NullSink::State;
+
+    template <typename Clock>
+    static void enter(State &, uint32_t functionId, typename Clock::TimePoint start) {
+        encoder.enter(functionId, Clock::timestampNs(start));
+    }
+
+    template <typename Clock>
+    static void exit(State &, uint32_t functionId, typename Clock::TimePoint, typename Clock::TimePoint end, long long) {
+        encoder.exit(functionId, Clock::timestampNs(end));
+    }
+
+    // Write out this thread's partially filled block. Other threads flush
+    // automatically when they exit.
+    static void flush() { encoder.flush(); }
+
+    static void prepareThread() { encoder.prepare(); }
+
+private:
+    static thread_local trace::TraceEncoder encoder;
+};
+
+inline thread_local trace::TraceEncoder CompressedTraceSink::encoder;
+
+// In-memory rings only, dumped on demand (see FlightRecorder)
+struct FlightRecorderSink {
+    using State = NullSink::State;
+
+    template <typename Clock>
+    static void enter(State &, uint32_t functionId, typename Clock::TimePoint start) {
+        FlightRecorder::record(functionId, false, Clock::timestampNs(start), 0);
+    }
+
+    template <typename Clock>
+    static void exit(State &, uint32_t functionId, typename Clock::TimePoint start, typename Clock::TimePoint end,
+                     long long duration) {
+        uint64_t endNs = Clock::timestampNs(end);
+        FlightRecorder::record(functionId, true, endNs, Clock::timestampNs(start));
+        FlightRecorder::checkTriggers(duration, endNs);
+    }
+};
+
+// Aggregations: what each call adds to its thread's profile. enter makes
+// the call's context current; exit restores the caller's. They cover the
+// tree or sketch only: exemplars, placement and the shared store are added
+// on top by Logger, and a BasicLogger doesn't record them. available() is
+// false when the aggregation can't record under the current settings.
+struct NoAggregation {
+    static const bool kUsesProfile = false;
+    struct State {};
+
+    static bool available() { return true; }
+
+    static void enter(ThreadProfile &, uint32_t, State &) {}
+    static void exit(ThreadProfile &, State &, long long) {}
+};
+
+// Where a call sits in its thread's context tree
+struct ContextState {
+    ContextNode *caller = nullptr;
+    ContextNode *node = nullptr;
+    long long callerChildTime = 0;
+    uint64_t callerHash = 0;  // Bounded paths only
+};
+
+// Shared by the aggregations that keep calling contexts: the caller's
+// child time is set aside while the call runs, to derive self times
+struct ContextAggregation {
+    static const bool kUsesProfile = true;
+    using State = ContextState;
+
+    static bool available() { return true; }
+
+protected:
+    static void begin(ThreadProfile &profile, State &state) {
+        state.caller = profile.current;
+        state.callerChildTime = profile.childTime;
+        profile.childTime = 0;
+    }
+
+    // Returns the self time of the call
+    static long long end(ThreadProfile &profile, State &state, long long duration) {
+        long long selfTime = duration - profile.childTime;
+        profile.childTime = state.callerChildTime + duration;
+        profile.current = state.caller;
+        return selfTime;
+    }
+};
+
+// Every calling context in full: one tree node per path (the default)
+struct ContextTreeAggregation : ContextAggregation {
+    static void enter(ThreadProfile &profile, uint32_t functionId, State &state) {
+        begin(profile, state);
+        state.node = profile.child(state.caller, functionId);
+        bump(state.node->entries, 1LL);
+        profile.current = state.node;
+    }
+
+    static void exit(ThreadProfile &profile, State &state, long long duration) {
+        bump(state.node->selfTime, end(profile, state, duration));
+        bump(state.node->totalTime, duration);
+        bump(state.node->callCount, 1LL);
+    }
+};
+
+// Recursion collapsed into one context per function (see enterFolded)
+struct FoldedRecursionAggregation : ContextAggregation {
+    static void enter(ThreadProfile &profile, uint32_t functionId, State &state) {
+        begin(profile, state);
+        state.node = profile.enterFolded(state.caller, functionId);
+        profile.current = state.node;
+    }
+
+    static void exit(ThreadProfile &profile, State &state, long long duration) {
+        bump(state.node->selfTime, end(profile, state, duration));
+        profile.exitFolded(state.node, duration);
+    }
+};
+
+// The heaviest paths only, in the fixed-size sketch (see enterPath). The
+// tree keeps one node per function, under the root, for locks to hang
+// off. Reports read the sketch only while Logger::setBoundedPaths is set.
+struct BoundedPathAggregation : ContextAggregation {
+    // Without a path limit there is no sketch capacity and no report would
+    // show the paths, so calls aren't recorded; reported once
+    static bool available() {
+        if (ThreadProfile::pathLimit() > 0) {
+            return true;
+        }
+        static atomic<bool> reported{false};
+        if (!reported.exchange(true)) {
+            cerr << "Error: BoundedPathAggregation needs Logger::setBoundedPaths first; its calls are not recorded." << endl;
+        }
+        return false;
+    }
+
+    static void enter(ThreadProfile &profile, uint32_t functionId, State &state) {
+        begin(profile, state);
+        state.node = profile.child(&profile.root, functionId);
+        state.callerHash = profile.enterPath(functionId);
+        profile.current = state.node;
+    }
+
+    static void exit(ThreadProfile &profile, State &state, long long duration) {
+        end(profile, state, duration);
+        profile.exitPath(state.callerHash, duration);
+    }
+};
+
+// Threading: how a logger finds its thread's profile, and whether it keeps
+// the per-thread stack of open calls that crash dumps print
+struct MultiThreaded {
+    static ThreadProfile &profile(const CallGraph &graph) { return ThreadProfile::forOwner(graph.id()); }
+    static void push(uint32_t functionId) { ShadowStack::push(functionId); }
+    static void pop() { ShadowStack::pop(); }
+};
+
+// For programs that record from one thread only: the profile is looked up
+// once per graph, and no crash-dump stack is kept
+struct SingleThreaded {
+    static ThreadProfile &profile(const CallGraph &graph) {
+        static uint64_t owner = 0;
+        static ThreadProfile *cached = nullptr;
+        if (owner != graph.id()) {
+            cached = &ThreadProfile::forOwner(graph.id());
+            owner = graph.id();
+        }
+        return *cached;
+    }
+
+    static void push(uint32_t) {}
+    static void pop() {}
+};
+
+// How Logger records the enter/exit event stream
+enum class EventFormat {
+    Text,          // "Entering X" / "Exiting X" lines in event_log.txt
+    Compressed,    // Per-thread delta/varint encoded blocks (see trace::)
+    FlightRecorder // In-memory rings only, dumped on demand (see FlightRecorder)
+};
+
+// Logger class to log function entry, exit, and timing
+class Logger {
+public:
+    Logger(const string &functionName, CallGraph &graph)
+            : Logger(FunctionRegistry::intern(functionName), graph) {}
+
+    // Hot path: no strings and no allocation once the calling context has
+    // been seen before
+    Logger(uint32_t id, CallGraph &graph)
+            : functionId(id), profile(ThreadProfile::forOwner(graph.id())) {
+        if (CallFilter::active() && !CallFilter::enter(functionId)) {
+            recorded = false;
+            return;
+        }
+
+        startTime = SteadyClock::now();
+        MultiThreaded::push(functionId);
+        if (eventFormat == EventFormat::Compressed) {
+            CompressedTraceSink::enter<SteadyClock>(noSinkState, functionId, startTime);
+        } else if (eventFormat == EventFormat::FlightRecorder) {
+            FlightRecorderSink::enter<SteadyClock>(noSinkState, functionId, startTime);
+        } else {
+            TextLogSink::enter<SteadyClock>(textLog, functionId, startTime);
+        }
+
+        if (ThreadProfile::placementTracking()) {
+            CpuPlacement::Location location = CpuPlacement::current();
+            profile.notePlacement(profile.current, location);
+            enterNode = location.node;
+        }
+        if (ThreadProfile::pathLimit() > 0) {
+            BoundedPathAggregation::enter(profile, functionId, context);
+        } else if (ThreadProfile::recursionFolding()) {
+            FoldedRecursionAggregation::enter(profile, functionId, context);
+        } else {
+            ContextTreeAggregation::enter(profile, functionId, context);
+        }
+        if (sharedStore && ThreadProfile::pathLimit() == 0) {
+            sharedStore->resolve(context.node);
+        }
+        if (ThreadProfile::exemplarLimit() > 0 && ThreadProfile::pathLimit() == 0) {
+            exemplarMark = profile.enterExemplar();
+        }
+    }
+
+    ~Logger() {
+        if (CallFilter::active()) {
+            CallFilter::exit(functionId);
+            if (!recorded) {
+                return;
+            }
+        }
+        auto endTime = SteadyClock::now();
+        long long duration = SteadyClock::micros(startTime, endTime);
+
+        if (eventFormat == EventFormat::Compressed) {
+            CompressedTraceSink::exit<SteadyClock>(noSinkState, functionId, startTime, endTime, duration);
+        } else if (eventFormat == EventFormat::FlightRecorder) {
+            FlightRecorderSink::exit<SteadyClock>(noSinkState, functionId, startTime, endTime, duration);
+        } else {
+            TextLogSink::exit<SteadyClock>(textLog, functionId, startTime, endTime, duration);
+        }
+        MultiThreaded::pop();
+
+        // Update the path profile of this calling context; this makes the
+        // caller's context current again
+        ContextNode *node = context.node;
+        if (ThreadProfile::pathLimit() > 0) {
+            BoundedPathAggregation::exit(profile, context, duration);
+        } else if (ThreadProfile::recursionFolding()) {
+            FoldedRecursionAggregation::exit(profile, context, duration);
+        } else {
+            ContextTreeAggregation::exit(profile, context, duration);
+        }
+        if (sharedStore && ThreadProfile::pathLimit() == 0) {
+            // A folded context still in flight has its time added by the outermost call
+            sharedStore->add(node, node->active == 0 ? duration : 0);
+        }
+        if (ThreadProfile::placementTracking()) {
+            CpuPlacement::Location location = CpuPlacement::current();
+            profile.notePlacement(node, location);
+            if (ThreadProfile::pathLimit() == 0) {
+                profile.addPlacementTime(node, enterNode, location.node, duration);
+            }
+        }
+        if (ThreadProfile::exemplarLimit() > 0 && ThreadProfile::pathLimit() == 0) {
+            profile.exitExemplar(node, exemplarMark, SteadyClock::timestampNs(startTime), duration);
+        }
+    }
+
+    struct InitOptions {
+        size_t functions = 4096;            // Distinct functions expected
+        size_t contextBytes = 1024 * 1024;  // Tree memory per thread
+        bool tscClock = false;              // Calibrate TscClock (about 10 ms)
+        bool background = false;            // Process-wide part on its own thread
+        vector<string> names;               // Function names to intern up front
+    };
+
+    // µs spent by init and prepareThread
+    struct StartupCost {
+        long long process = -1;  // -1 until init's process-wide part is done
+        long long threads = 0;   // Summed over the threads prepared
+    };
+
+    // Does the profiler's one-time work up front, so that the first
+    // instrumented call costs what the millionth does: reserves the
+    // function registry, interns `names`, calibrates the TSC if asked, and
+    // prepares the calling thread (see prepareThread). A call site whose
+    // name was interned here only looks it up on its first call. This
+    // covers the compressed and flight-recorder formats; the text format
+    // opens event_log.txt on every call, so its calls stay slow.
+    // With `background`, the process-wide part runs on its own thread and
+    // init only waits for the calling thread's part; a later init waits
+    // for an earlier background one first. Call after the other settings,
+    // which decide the buffers to allocate, and before any instrumented
+    // code runs.
+    static void init(CallGraph &graph) { init(graph, InitOptions()); }
+
+    static void init(CallGraph &graph, const InitOptions &options) {
+        auto processWide = [options] {
+            auto start = SteadyClock::now();
+            FunctionRegistry::reserve(max(options.functions, options.names.size()));
+            for (const string &name : options.names) {
+                FunctionRegistry::intern(name);
+            }
+            if (options.tscClock) {
+                TscClock::calibrate();
+            }
+            processStartup.store(SteadyClock::micros(start, SteadyClock::now()), memory_order_release);
+        };
+        lock_guard<mutex> guard(initThread.lock);
+        if (initThread.worker.joinable()) {
+            initThread.worker.join();
+        }
+        if (options.background) {
+            initThread.worker = thread(processWide);
+        } else {
+            processWide();
+        }
+        prepareThread(graph, options.contextBytes);
+    }
+
+    // The per-thread part of init, for threads started later: attaches the
+    // thread's profile and maps and faults in `contextBytes` of tree
+    // memory, its crash-dump stack slot and the event buffers of the
+    // current format. Returns the µs it took.
+    static long long prepareThread(CallGraph &graph, size_t contextBytes = 1024 * 1024) {
+        auto start = SteadyClock::now();
+        ThreadProfile::forOwner(graph.id()).prepare(contextBytes);
+        ShadowStack::prepareThread();
+        if (eventFormat == EventFormat::Compressed) {
+            CompressedTraceSink::prepareThread();
+        } else if (eventFormat == EventFormat::FlightRecorder) {
+            FlightRecorder::prepareThread();
+        }
+        long long cost = SteadyClock::micros(start, SteadyClock::now());
+        threadStartup.fetch_add(cost, memory_order_relaxed);
+        return cost;
+    }
+
+    static StartupCost startupCost() {
+        return {processStartup.load(memory_order_acquire), threadStartup.load(memory_order_relaxed)};
+    }
+
+    // Select the event stream format; call before any instrumented code runs
+    static void setEventFormat(EventFormat format, const string &traceFilename = "event_trace.bin") {
+        eventFormat = format;
+        if (format == EventFormat::Compressed) {
+            trace::TraceSink::instance().open(traceFilename);
+        }
+    }
+
+    // Track only the `paths` heaviest calling-context paths, in fixed
+    // memory, instead of every path; 0 records them all (the default).
+    // Call before any instrumented code runs.
+    static void setBoundedPaths(size_t paths) {
+        ThreadProfile::setPathLimit(paths);
+    }
+
+    // LOG_COUNT: adds to a counter node under the current calling context
+    static void count(uint32_t counterId, CallGraph &graph, long long amount) {
+        if (!CallFilter::allows(counterId)) {
+            return;
+        }
+        ThreadProfile &profile = ThreadProfile::forOwner(graph.id());
+        ContextNode *node = profile.child(profile.current, counterId, ContextNode::Counter);
+        if (node->kind == ContextNode::Counter) {  // Otherwise the memory limit was reached
+            bump(node->totalTime, amount);
+            bump(node->callCount, 1LL);
+        }
+    }
+
+    // Also aggregate the context tree into the shared-memory store `name`,
+    // creating it if needed, so several processes build one profile. Not
+    // used in bounded mode. Call before any instrumented code runs.
+    static bool setSharedStore(const string &name) {
+        unique_ptr<SharedProfileStore> store = SharedProfileStore::open(name);
+        if (!store) {
+            return false;
+        }
+        // Deliberately never unmapped: threads may still record during exit
+        sharedStore = store.release();
+        return true;
+    }
+
+    // Keep the `calls` slowest calls of every calling context, each with up
+    // to `subCalls` of the calls made beneath it, and list them in the path
+    // report. Costs (calls * subCalls * 24) bytes per context. Not used in
+    // bounded mode. Call before any instrumented code runs.
+    static void setExemplars(size_t calls, size_t subCalls = 32) {
+        ThreadProfile::setExemplarLimit(calls, subCalls);
+    }
+
+    // Sample the CPU on every enter and exit, and report per path the time
+    // spent on each NUMA node and how often the thread migrated while the
+    // path was running. Call before any instrumented code runs.
+    static void setPlacementTracking(bool enabled) {
+        if (enabled) {
+            CpuPlacement::init();
+        }
+        ThreadProfile::setPlacementTracking(enabled);
+    }
+
+    // Collapse direct and mutual recursion into one context per function,
+    // with a recursion-depth histogram instead of one path per depth.
+    // Call before any instrumented code runs.
+    static void setRecursionFolding(bool enabled) {
+        ThreadProfile::setRecursionFolding(enabled);
+    }
+
+    // Write out this thread's partially filled trace block. Other threads
+    // flush automatically when they exit.
+    static void flushTrace() {
+        CompressedTraceSink::flush();
+    }
+
+private:
+    uint32_t functionId;
+    ThreadProfile &profile;
+    ContextState context;
+    uint64_t exemplarMark = 0;
+    uint32_t enterNode = 0;
+    bool recorded = true;
+    TextLogSink::State textLog;
+    NullSink::State noSinkState;  // For the sinks that keep no state
+    static EventFormat eventFormat;
+    static SharedProfileStore *sharedStore;
+    SteadyClock::TimePoint startTime;
+
+    // Joined at exit, so a background init never outlives what it touches
+    struct InitThread {
+        mutex lock;  // Held while init replaces the worker
+        thread worker;
+
+        ~InitThread() {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    };
+    static InitThread initThread;
+    static atomic<long long> processStartup;
+    static atomic<long long> threadStartup;
+};
+
+inline EventFormat Logger::eventFormat = EventFormat::Text;
+inline SharedProfileStore *Logger::sharedStore = nullptr;
+inline Logger::InitThread Logger::initThread;
+inline atomic<long long> Logger::processStartup{-1};
+inline atomic<long long> Logger::threadStartup{0};
+
+// Logger with its features fixed at compile time, one policy of each kind
+// (see SteadyClock, NullSink, ContextTreeAggregation, MultiThreaded and
+// their alternatives). A policy that does nothing compiles to nothing:
+//
+//   using FastLogger = BasicLogger<TscClock, NullSink, ContextTreeAggregation, SingleThreaded>;
+//   LOG_CALL_AS(FastLogger, graph);
+//
+// costs two TSC reads, the tree update and a check of the CallFilter,
+// which it honours like Logger does. Logger's event format, exemplars,
+// placement and shared store don't apply to it. Its profile is the same
+// one Logger records into, so the two can be mixed, as long as the
+// aggregation agrees with Logger's bounded-path and recursion-folding
+// settings; BoundedPathAggregation records nothing without them.
+template <typename Clock = SteadyClock, typename Sink = NullSink, typename Aggregation = ContextTreeAggregation,
+          typename Threading = MultiThreaded>
+class BasicLogger {
+public:
+    BasicLogger(const string &functionName, CallGraph &graph)
+            : BasicLogger(FunctionRegistry::intern(functionName), graph) {}
+
+    BasicLogger(uint32_t id, CallGraph &graph) : functionId(id) {
+        if ((CallFilter::active() && !CallFilter::enter(functionId)) || !Aggregation::available()) {
+            recorded = false;
+            return;
+        }
+        if constexpr (Aggregation::kUsesProfile) {
+            profile = &Threading::profile(graph);
+        }
+        Threading::push(functionId);
+        startTime = Clock::now();
+        Sink::template enter<Clock>(sinkState, functionId, startTime);
+        if constexpr (Aggregation::kUsesProfile) {
+            Aggregation::enter(*profile, functionId, context);
+        }
+    }
+
+    ~BasicLogger() {
+        if (CallFilter::active()) {
+            CallFilter::exit(functionId);
+        }
+        if (!recorded) {
+            return;
+        }
+        typename Clock::TimePoint endTime = Clock::now();
+        long long duration = Clock::micros(startTime, endTime);
+        Sink::template exit<Clock>(sinkState, functionId, startTime, endTime, duration);
+        Threading::pop();
+        if constexpr (Aggregation::kUsesProfile) {
+            Aggregation::exit(*profile, context, duration);
+        }
+    }
+
+private:
+    uint32_t functionId;
+    bool recorded = true;
+    ThreadProfile *profile = nullptr;
+    typename Aggregation::State context;
+    typename Sink::State sinkState;
+    typename Clock::TimePoint startTime;
+};
+
+// Carries a calling context to work that runs later or elsewhere: a task
+// handed to a thread pool, or a coroutine resumed on another thread.
+// Capture a handle where the work is created (or where the coroutine
+// suspends) and run the work inside a ContextScope, or through bind(), on
+// the executing thread. Its calls then show up under the creating
+// context, along with a "[queue wait]" counter of the µs it waited.
+//
+//   pool.submit(ContextHandle::capture(graph).bind(task));
+//   pool.submit(ContextHandle::capture(graph).bind(coroutineHandle));
+//
+// A Logger must not stay open across a coroutine suspension: it belongs to
+// the thread it was created on. In bounded mode only the wait is recorded.
+class ContextHandle {
+public:
+    static ContextHandle capture(CallGraph &graph) {
+        return ContextHandle(graph, ThreadProfile::forOwner(graph.id()).current);
+    }
+
+    template <typename Task>
+    auto bind(Task task) const;
+
+private:
+    friend class ContextScope;
+
+    ContextHandle(CallGraph &graph, const ContextNode *node)
+            : graph(&graph), node(node), created(high_resolution_clock::now()) {}
+
+    CallGraph *graph;
+    const ContextNode *node;
+    high_resolution_clock::time_point created;
+};
+
+class ContextScope {
+public:
+    explicit ContextScope(const ContextHandle &handle)
+            : profile(ThreadProfile::forOwner(handle.graph->id())), savedCurrent(profile.current), savedChildTime(profile.childTime) {
+        static const uint32_t queueWaitId = FunctionRegistry::intern("[queue wait]");
+        if (ThreadProfile::pathLimit() == 0) {
+            profile.current = profile.adopt(handle.node);
+        }
+        profile.childTime = 0;
+        Logger::count(queueWaitId, *handle.graph,
+                      duration_cast<microseconds>(high_resolution_clock::now() - handle.created).count());
+    }
+
+    ~ContextScope() {
+        profile.current = savedCurrent;
+        profile.childTime = savedChildTime;
+    }
+
+    ContextScope(const ContextScope &) = delete;
+    ContextScope &operator=(const ContextScope &) = delete;
+
+private:
+    ThreadProfile &profile;
+    ContextNode *savedCurrent;
+    long long savedChildTime;
+};
+
+template <typename Task>
+auto ContextHandle::bind(Task task) const {
+    return [handle = *this, task = move(task)]() mutable {
+        ContextScope scope(handle);
+        return task();
+    };
+}
+
+// Writes every thread's shadow stack and the path profiles when the
+// process dies. The output file is opened in install(); alternate signal
+// stacks (so stack overflows can be reported too) come with each thread's
+// ShadowStack slot. The handlers themselves only use write(2) into fixed
+// buffers, then restore the default action and re-raise so the process
+// still terminates or dumps core. Threads that crash while another one is
+// dumping wait for the dump to finish.
+class CrashHandler {
+public:
+    static bool install(const CallGraph &graph, const string &filename = "crash_dump.txt") {
+        crashGraph = &graph;
+        dumpFd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (dumpFd < 0) {
+            cerr << "Error: Could not open the file " << filename << " for writing." << endl;
+            return false;
+        }
+
+        // Other threads get their signal stack on their first recorded call
+        // or in Logger::prepareThread
+        ShadowStack::prepareThread();
+
+        // Not SA_RESETHAND: that would reset the action for every thread, so
+        // a second crash would kill the process mid-dump
+        struct sigaction action{};
+        action.sa_handler = handle;
+        action.sa_flags = SA_ONSTACK | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        for (int signum : {SIGSEGV, SIGABRT, SIGTERM, SIGBUS, SIGFPE}) {
+            sigaction(signum, &action, nullptr);
+        }
+        return true;
+    }
+
+private:
+    static void handle(int signum) {
+        // A second thread crashing concurrently must not interleave output,
+        // nor end the process before the dump is complete. A crash in the
+        // dumping thread itself gives up on the dump.
+        pid_t self = static_cast<pid_t>(syscall(SYS_gettid));
+        pid_t expected = 0;
+        if (dumper.compare_exchange_strong(expected, self)) {
+            writeDump(signum);
+            dumped.store(true, memory_order_release);
+        } else if (expected != self) {
+            timespec pause{0, 1000000};
+            while (!dumped.load(memory_order_acquire)) {
+                nanosleep(&pause, nullptr);
+            }
+        }
+        signal(signum, SIG_DFL);
+        raise(signum);
+    }
+
+    static void writeDump(int signum) {
+        SignalSafeWriter out(dumpFd);
+        out << "=== Crash dump: signal " << static_cast<long long>(signum) << " (" << signalName(signum) << ") ===\n";
+        for (int i = 0; i < ShadowStack::kMaxThreads; ++i) {
+            const ShadowStack::Slot &slot = ShadowStack::slot(i);
+            if (!slot.inUse.load(memory_order_acquire)) {
+                continue;
+            }
+            int depth = slot.depth.load(memory_order_acquire);
+            out << "--- Thread " << static_cast<long long>(slot.thread) << " (tid " << static_cast<long long>(slot.tid)
+                << "), depth " << static_cast<long long>(depth) << " ---\n";
+            for (int d = 0; d < depth && d < ShadowStack::kMaxDepth; ++d) {
+                out << "  #" << static_cast<long long>(d) << " "
+                    << FunctionRegistry::signalSafeName(slot.frames[d].load(memory_order_relaxed)) << "\n";
+            }
+            if (depth > ShadowStack::kMaxDepth) {
+                out << "  ... " << static_cast<long long>(depth - ShadowStack::kMaxDepth) << " deeper frames not recorded\n";
+            }
+        }
+        out << "--- Path profiles ---\n";
+        if (crashGraph) {
+            crashGraph->writeProfilesSignalSafe(out);
+        }
+        out.flush();
+    }
+
+    static const char *signalName(int signum) {
+        switch (signum) {
+            case SIGSEGV: return "SIGSEGV";
+            case SIGABRT: return "SIGABRT";
+            case SIGTERM: return "SIGTERM";
+            case SIGBUS: return "SIGBUS";
+            case SIGFPE: return "SIGFPE";
+            default: return "signal";
+        }
+    }
+
+    static const CallGraph *crashGraph;
+    static int dumpFd;
+    static atomic<pid_t> dumper;  // tid of the thread writing the dump
+    static atomic<bool> dumped;
+};
+
+inline const CallGraph *CrashHandler::crashGraph = nullptr;
+inline int CrashHandler::dumpFd = -1;
+inline atomic<pid_t> CrashHandler::dumper{0};
+inline atomic<bool> CrashHandler::dumped{false};
+
+// Bookkeeping shared by the instrumented lock wrappers. A lock is always
+// released by the thread that acquired it, so the acquiring context is
+// kept in the thread's profile and matched up again on release. Each lock
+// shows up as a pseudo-frame under the function that acquired it.
+class LockTracker {
+public:
+    // "<kind> 1", "<kind> 2", ... for locks constructed without a name
+    static string generatedName(const char *kind) {
+        static atomic<uint32_t> counter{0};
+        return string(kind) + " " + to_string(++counter);
+    }
+
+    // Acquire via `blockingAcquire` (which must block until the lock is held),
+    // falling back to it only after `tryAcquire` fails so uncontended locks are cheap
+    template <typename TryAcquire, typename Acquire>
+    static void acquire(const void *lock, uint32_t lockId, CallGraph &graph,
+                        TryAcquire tryAcquire, Acquire blockingAcquire) {
+        auto requestTime = high_resolution_clock::now();
+        bool contended = !tryAcquire();
+        if (contended) {
+            blockingAcquire();
+        }
+        auto acquiredTime = high_resolution_clock::now();
+        held(lock, lockId, graph, duration_cast<nanoseconds>(acquiredTime - requestTime).count(), contended);
+    }
+
+    static void held(const void *lock, uint32_t lockId, CallGraph &graph, long long waitTime, bool contended) {
+        ThreadProfile &profile = ThreadProfile::forOwner(graph.id());
+        ContextNode *node = profile.child(profile.current, lockId, ContextNode::Lock);
+        if (node->kind != ContextNode::Lock) {
+            node = nullptr;  // Memory limit reached; still track the hold
+        } else {
+            bump(node->lock->waitTime, waitTime);
+            bump(node->lock->acquireCount, 1LL);
+            bump(node->lock->contentionCount, contended ? 1LL : 0LL);
+        }
+        if (profile.heldLockCount < ThreadProfile::kMaxHeldLocks) {
+            profile.heldLocks[profile.heldLockCount++] = {lock, node, high_resolution_clock::now()};
+        }
+    }
+
+    static void released(const void *lock, CallGraph &graph) {
+        auto releaseTime = high_resolution_clock::now();
+        ThreadProfile &profile = ThreadProfile::forOwner(graph.id());
+        for (int i = profile.heldLockCount - 1; i >= 0; --i) {
+            ThreadProfile::HeldLock &entry = profile.heldLocks[i];
+            if (entry.lock == lock) {
+                if (entry.node) {
+                    bump(entry.node->lock->holdTime, static_cast<long long>(
+                        duration_cast<nanoseconds>(releaseTime - entry.acquiredAt).count()));
+                }
+                for (int j = i + 1; j < profile.heldLockCount; ++j) {
+                    profile.heldLocks[j - 1] = profile.heldLocks[j];
+                }
+                profile.heldLockCount--;
+                return;
+            }
+        }
+    }
+
+    static void conditionWaited(const void *lock, CallGraph &graph, long long waitTime) {
+        ThreadProfile &profile = ThreadProfile::forOwner(graph.id());
+        for (int i = profile.heldLockCount - 1; i >= 0; --i) {
+            ThreadProfile::HeldLock &entry = profile.heldLocks[i];
+            if (entry.lock == lock) {
+                if (entry.node) {
+                    bump(entry.node->lock->condWaitTime, waitTime);
+                    bump(entry.node->lock->condWaitCount, 1LL);
+                }
+                return;
+            }
+        }
+    }
+};
+
+// Drop-in replacement for std::mutex that records wait/hold time and
+// contention against the calling-context path of the acquiring function
+class ProfiledMutex {
+public:
+    ProfiledMutex(const string &name, CallGraph &graph)
+        : lockId(FunctionRegistry::intern("[lock " + name + "]")), callGraph(graph) {}
+
+    // Records into CallGraph::defaultGraph() as "mutex N"
+    ProfiledMutex() : ProfiledMutex(LockTracker::generatedName("mutex"), CallGraph::defaultGraph()) {}
+
+    ProfiledMutex(const ProfiledMutex &) = delete;
+    ProfiledMutex &operator=(const ProfiledMutex &) = delete;
+
+    void lock() {
+        LockTracker::acquire(this, lockId, callGraph,
+                             [this] { return impl.try_lock(); },
+                             [this] { impl.lock(); });
+    }
+
+    bool try_lock() {
+        if (!impl.try_lock()) {
+            return false;
+        }
+        LockTracker::held(this, lockId, callGraph, 0, false);
+        return true;
+    }
+
+    void unlock() {
+        LockTracker::released(this, callGraph);
+        impl.unlock();
+    }
+
+    mutex &native() { return impl; }
+
+private:
+    friend class ProfiledConditionVariable;
+
+    mutex impl;
+    uint32_t lockId;
+    CallGraph &callGraph;
+};
+
+// Drop-in replacement for std::shared_mutex; shared and exclusive
+// acquisitions are reported as separate pseudo-frames
+class ProfiledSharedMutex {
+public:
+    ProfiledSharedMutex(const string &name, CallGraph &graph)
+        : lockId(FunctionRegistry::intern("[lock " + name + "]")),
+          sharedLockId(FunctionRegistry::intern("[shared lock " + name + "]")), callGraph(graph) {}
+
+    // Records into CallGraph::defaultGraph() as "shared mutex N"
+    ProfiledSharedMutex()
+        : ProfiledSharedMutex(LockTracker::generatedName("shared mutex"), CallGraph::defaultGraph()) {}
+
+    ProfiledSharedMutex(const ProfiledSharedMutex &) = delete;
+    ProfiledSharedMutex &operator=(const ProfiledSharedMutex &) = delete;
+
+    void lock() {
+        LockTracker::acquire(this, lockId, callGraph,
+                             [this] { return impl.try_lock(); },
+                             [this] { impl.lock(); });
+    }
+
+    bool try_lock() {
+        if (!impl.try_lock()) {
+            return false;
+        }
+        LockTracker::held(this, lockId, callGraph, 0, false);
+        return true;
+    }
+
+    void unlock() {
+        LockTracker::released(this, callGraph);
+        impl.unlock();
+    }
+
+    void lock_shared() {
+        LockTracker::acquire(this, sharedLockId, callGraph,
+                             [this] { return impl.try_lock_shared(); },
+                             [this] { impl.lock_shared(); });
+    }
+
+    bool try_lock_shared() {
+        if (!impl.try_lock_shared()) {
+            return false;
+        }
+        LockTracker::held(this, sharedLockId, callGraph, 0, false);
+        return true;
+    }
+
+    void unlock_shared() {
+        LockTracker::released(this, callGraph);
+        impl.unlock_shared();
+    }
+
+private:
+    shared_mutex impl;
+    uint32_t lockId;
+    uint32_t sharedLockId;
+    CallGraph &callGraph;
+};
+
+// Drop-in replacement for std::condition_variable working on a
+// unique_lock<ProfiledMutex>. Time blocked waiting for a notification (or
+// the timeout) is reported as condition wait; getting the mutex back
+// afterwards is recorded like any other acquire, with its own wait and
+// contention.
+class ProfiledConditionVariable {
+public:
+    void notify_one() noexcept { impl.notify_one(); }
+    void notify_all() noexcept { impl.notify_all(); }
+
+    void wait(unique_lock<ProfiledMutex> &lock) {
+        WaitingLock waiting(*lock.mutex());
+        impl.wait(waiting);
+    }
+
+    template <typename Predicate>
+    void wait(unique_lock<ProfiledMutex> &lock, Predicate pred) {
+        while (!pred()) {
+            wait(lock);
+        }
+    }
+
+    template <typename Clock, typename Duration>
+    cv_status wait_until(unique_lock<ProfiledMutex> &lock, const time_point<Clock, Duration> &deadline) {
+        WaitingLock waiting(*lock.mutex());
+        return impl.wait_until(waiting, deadline);
+    }
+
+    template <typename Clock, typename Duration, typename Predicate>
+    bool wait_until(unique_lock<ProfiledMutex> &lock, const time_point<Clock, Duration> &deadline, Predicate pred) {
+        while (!pred()) {
+            if (wait_until(lock, deadline) == cv_status::timeout) {
+                return pred();
+            }
+        }
+        return true;
+    }
+
+    template <typename Rep, typename Period>
+    cv_status wait_for(unique_lock<ProfiledMutex> &lock, const chrono::duration<Rep, Period> &timeout) {
+        return wait_until(lock, steady_clock::now() + timeout);
+    }
+
+    template <typename Rep, typename Period, typename Predicate>
+    bool wait_for(unique_lock<ProfiledMutex> &lock, const chrono::duration<Rep, Period> &timeout, Predicate pred) {
+        return wait_until(lock, steady_clock::now() + timeout, move(pred));
+    }
+
+private:
+    // What the condition variable releases and re-locks around the wait.
+    // The wait for a notification ends when it asks for the mutex back.
+    class WaitingLock {
+    public:
+        explicit WaitingLock(ProfiledMutex &m) : m(m) {}
+
+        void unlock() {
+            waitStart = high_resolution_clock::now();
+            m.unlock();
+        }
+
+        void lock() {
+            long long waited = duration_cast<nanoseconds>(high_resolution_clock::now() - waitStart).count();
+            m.lock();
+            LockTracker::conditionWaited(&m, m.callGraph, waited);
+        }
+
+    private:
+        ProfiledMutex &m;
+        high_resolution_clock::time_point waitStart;
+    };
+
+    condition_variable_any impl;
+};
+
+// Rebuilds path profiles from a compressed trace written with
+// EventFormat::Compressed. Event blocks are independent, so they are split
+// across worker threads, each aggregating into its own calling-context
+// trie keyed by (parent node, function id) before the results are merged.
+class TraceDecoder {
+public:
+    // One recorded thread's events in order, for replay. `initialStack` is
+    // what was already on its stack when its first block starts (flight
+    // recorder dumps start mid-run).
+    struct ThreadEvents {
+        vector<uint32_t> initialStack;
+        vector<uint32_t> events;  // functionId << 1 | isExit
+    };
+
+    ~TraceDecoder() {
+        if (mapped) {
+            munmap(mapped, mappedSize);
+        }
+    }
+
+    bool decode(const string &filename, CallGraph &graph) {
+        if (!load(filename)) {
+            return false;
+        }
+
+        unsigned workerCount = max(1u, thread::hardware_concurrency());
+        workerCount = min<unsigned>(workerCount, max<size_t>(1, eventBlocks.size()));
+        vector<Worker> workers(workerCount);
+        vector<thread> threads;
+        for (unsigned w = 0; w < workerCount; ++w) {
+            threads.emplace_back([&, w] {
+                size_t begin = eventBlocks.size() * w / workerCount;
+                size_t end = eventBlocks.size() * (w + 1) / workerCount;
+                for (size_t b = begin; b < end; ++b) {
+                    workers[w].decodeBlock(eventBlocks[b].first, eventBlocks[b].second);
+                }
+            });
+        }
+        for (thread &t : threads) {
+            t.join();
+        }
+
+        size_t damaged = 0;
+        map<string, PathInfo> merged;
+        for (const Worker &worker : workers) {
+            damaged += worker.damagedBlocks;
+            worker.collect(names, merged);
+        }
+        for (const auto &entry : merged) {
+            graph.updatePathProfile(entry.first, entry.second);
+        }
+        // Workers hold consecutive runs of blocks, so this keeps the edges
+        // in first-call order
+        for (const Worker &worker : workers) {
+            for (const auto &edge : worker.edges) {
+                graph.addCall(nameOf(edge.first >> 32), nameOf(edge.first & UINT32_MAX), edge.second);
+            }
+        }
+
+        if (damaged > 0) {
+            cerr << "Warning: Skipped " << damaged << " damaged block(s)." << endl;
+        }
+        return true;
+    }
+
+    // The raw event streams, by recorded thread; ids index functionNames()
+    bool readEvents(const string &filename, map<uint32_t, ThreadEvents> &threads) {
+        if (!load(filename)) {
+            return false;
+        }
+        size_t damaged = 0;
+        for (const auto &block : eventBlocks) {
+            const uint8_t *pos = block.first;
+            const uint8_t *end = block.first + block.second.payloadSize;
+            uint64_t depth, value, delta;
+            if (trace::crc32(pos, block.second.payloadSize) != block.second.checksum || !trace::getVarint(pos, end, depth)) {
+                damaged++;
+                continue;
+            }
+            auto inserted = threads.emplace(block.second.thread, ThreadEvents());
+            ThreadEvents &thread = inserted.first->second;
+            bool intact = true;
+            for (uint64_t i = 0; i < depth && intact; ++i) {
+                intact = trace::getVarint(pos, end, value) && trace::getVarint(pos, end, delta);
+                if (intact && inserted.second) {
+                    thread.initialStack.push_back(static_cast<uint32_t>(value));
+                }
+            }
+            for (uint32_t i = 0; i < block.second.eventCount && intact; ++i) {
+                intact = trace::getVarint(pos, end, value) && trace::getVarint(pos, end, delta);
+                if (intact) {
+                    thread.events.push_back(static_cast<uint32_t>(value));
+                }
+            }
+            damaged += !intact;
+        }
+        if (damaged > 0) {
+            cerr << "Warning: Skipped " << damaged << " damaged block(s)." << endl;
+        }
+        return true;
+    }
+
+    const vector<string> &functionNames() const { return names; }
+
+private:
+    const string &nameOf(uint64_t functionId) const {
+        static const string unknown = "(unknown)";
+        return functionId < names.size() ? names[functionId] : unknown;
+    }
+
+    // Map the trace, load its name table and index its event blocks
+    bool load(const string &filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Error: Could not open the file " << filename << " for reading." << endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            cerr << "Error: " << filename << " is empty." << endl;
+            return false;
+        }
+        mappedSize = static_cast<size_t>(st.st_size);
+        mapped = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            mapped = nullptr;
+            cerr << "Error: Could not map " << filename << "." << endl;
+            return false;
+        }
+        madvise(mapped, mappedSize, MADV_SEQUENTIAL);
+        const uint8_t *data = static_cast<const uint8_t *>(mapped);
+
+        size_t offset = 0;
+        while (offset + trace::kHeaderSize <= mappedSize) {
+            trace::BlockHeader header;
+            if (!header.read(data + offset) || offset + trace::kHeaderSize + header.payloadSize > mappedSize) {
+                cerr << "Warning: Trace is truncated or corrupt at offset " << offset << "." << endl;
+                break;
+            }
+            const uint8_t *payload = data + offset + trace::kHeaderSize;
+            if (header.kind == trace::kNameBlock) {
+                readNames(payload, header);
+            } else if (header.kind == trace::kEventBlock) {
+                eventBlocks.push_back({payload, header});
+            }
+            offset += trace::kHeaderSize + header.payloadSize;
+        }
+        return true;
+    }
+
+    struct Node {
+        uint32_t parent;
+        uint32_t functionId;
+        PathInfo info;
+    };
+
+    struct Worker {
+        static const uint32_t kRoot = UINT32_MAX;
+
+        vector<Node> nodes;
+        unordered_map<uint64_t, uint32_t> children;
+        vector<pair<uint64_t, int>> edges;  // (caller << 32 | callee, calls), in first-call order
+        unordered_map<uint64_t, size_t> edgeIndex;
+        size_t damagedBlocks = 0;
+
+        void addEdge(uint32_t caller, uint32_t callee) {
+            uint64_t key = (static_cast<uint64_t>(caller) << 32) | callee;
+            auto inserted = edgeIndex.emplace(key, edges.size());
+            if (inserted.second) {
+                edges.push_back({key, 0});
+            }
+            edges[inserted.first->second].second++;
+        }
+
+        uint32_t child(uint32_t parent, uint32_t functionId) {
+            uint64_t key = (static_cast<uint64_t>(parent) << 32) | functionId;
+            auto it = children.find(key);
+            if (it != children.end()) {
+                return it->second;
+            }
+            uint32_t index = static_cast<uint32_t>(nodes.size());
+            nodes.push_back({parent, functionId, {}});
+            children.emplace(key, index);
+            return index;
+        }
+
+        void decodeBlock(const uint8_t *payload, const trace::BlockHeader &header) {
+            if (trace::crc32(payload, header.payloadSize) != header.checksum) {
+                damagedBlocks++;
+                return;
+            }
+            const uint8_t *pos = payload;
+            const uint8_t *end = payload + header.payloadSize;
+
+            struct Frame {
+                uint32_t node;
+                uint64_t enterTime;
+            };
+            vector<Frame> stack;
+            uint64_t depth, value, delta;
+            if (!trace::getVarint(pos, end, depth)) {
+                damagedBlocks++;
+                return;
+            }
+            for (uint64_t i = 0; i < depth; ++i) {
+                if (!trace::getVarint(pos, end, value) || !trace::getVarint(pos, end, delta)) {
+                    damagedBlocks++;
+                    return;
+                }
+                uint32_t parent = stack.empty() ? kRoot : stack.back().node;
+                stack.push_back({child(parent, static_cast<uint32_t>(value)),
+                                 header.baseTimestamp + trace::unzigzag(delta)});
+            }
+
+            uint64_t timestamp = header.baseTimestamp;
+            for (uint32_t i = 0; i < header.eventCount; ++i) {
+                if (!trace::getVarint(pos, end, value) || !trace::getVarint(pos, end, delta)) {
+                    damagedBlocks++;
+                    return;
+                }
+                timestamp += trace::unzigzag(delta);
+                uint32_t functionId = static_cast<uint32_t>(value >> 1);
+                if (value & 1) {
+                    if (stack.empty()) {
+                        continue;
+                    }
+                    Node &node = nodes[stack.back().node];
+                    node.info.totalTime += static_cast<long long>(timestamp - stack.back().enterTime) / 1000;
+                    node.info.callCount += 1;
+                    stack.pop_back();
+                } else {
+                    uint32_t parent = stack.empty() ? kRoot : stack.back().node;
+                    if (parent != kRoot) {
+                        addEdge(nodes[parent].functionId, functionId);
+                    }
+                    stack.push_back({child(parent, functionId), timestamp});
+                }
+            }
+        }
+
+        void collect(const vector<string> &names, map<string, PathInfo> &merged) const {
+            vector<string> paths(nodes.size());
+            // Parents are always created before their children
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                const Node &node = nodes[i];
+                const string &name = node.functionId < names.size() ? names[node.functionId] : "(unknown)";
+                paths[i] = node.parent == kRoot ? name : paths[node.parent] + " -> " + name;
+                if (node.info.callCount > 0) {
+                    merged[paths[i]].totalTime += node.info.totalTime;
+                    merged[paths[i]].callCount += node.info.callCount;
+                }
+            }
+        }
+    };
+
+    void readNames(const uint8_t *payload, const trace::BlockHeader &header) {
+        if (trace::crc32(payload, header.payloadSize) != header.checksum) {
+            cerr << "Warning: Name block is damaged; affected functions will show as unknown." << endl;
+            return;
+        }
+        const uint8_t *pos = payload;
+        const uint8_t *end = payload + header.payloadSize;
+        uint64_t id, length;
+        while (pos < end && trace::getVarint(pos, end, id) && trace::getVarint(pos, end, length)) {
+            if (length > static_cast<uint64_t>(end - pos)) {
+                break;
+            }
+            if (id >= names.size()) {
+                names.resize(id + 1, "(unknown)");
+            }
+            names[id].assign(reinterpret_cast<const char *>(pos), length);
+            pos += length;
+        }
+    }
+
+    vector<string> names;
+    void *mapped = nullptr;
+    size_t mappedSize = 0;
+    vector<pair<const uint8_t *, trace::BlockHeader>> eventBlocks;
+};
+
+// SIMD byte search used by the event log parser; falls back to a plain
+// loop for the tail and on targets without SSE2/AVX2
+inline const char *findByte(const char *pos, const char *end, char c) {
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi8(c);
+    while (pos + 32 <= end) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+    while (pos + 16 <= end) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < end && *pos != c) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Rebuilds the call graph and path profiles from text event_log.txt files
+// ("Entering X" / "Exiting X (Execution Time: N µs)").
+//
+// The mapped log is cut into chunks at line boundaries and parsed in
+// parallel. A chunk doesn't know the call stack it starts under, so it
+// records everything relative to it: calls that complete inside the chunk
+// go into a trie rooted at "the caller's stack after k exits of frames
+// opened before this chunk", those k unmatched exits are kept in order,
+// and the frames still open at the end are handed on. Merging the chunks
+// in order then only needs to resolve each root once against the carried
+// stack, so the serial part is proportional to distinct paths per chunk
+// rather than to lines.
+class EventLogAnalyzer {
+public:
+    bool analyze(const string &filename, CallGraph &graph) {
+        auto started = steady_clock::now();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Error: Could not open the file " << filename << " for reading." << endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            cerr << "Error: " << filename << " is empty." << endl;
+            return false;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            cerr << "Error: Could not map " << filename << "." << endl;
+            return false;
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        const char *data = static_cast<const char *>(mapped);
+
+        unsigned threadCount = max(1u, thread::hardware_concurrency());
+        vector<Chunk> chunks = split(data, size, threadCount * 4);
+        atomic<size_t> nextChunk{0};
+        vector<thread> workers;
+        for (unsigned t = 0; t < threadCount; ++t) {
+            workers.emplace_back([&] {
+                for (size_t c = nextChunk++; c < chunks.size(); c = nextChunk++) {
+                    parse(chunks[c]);
+                }
+            });
+        }
+        for (thread &worker : workers) {
+            worker.join();
+        }
+
+        size_t lines = 0, malformed = 0;
+        vector<string> carried;
+        for (Chunk &chunk : chunks) {
+            merge(chunk, carried, graph);
+            lines += chunk.lines;
+            malformed += chunk.malformed;
+        }
+        munmap(mapped, size);
+
+        double elapsed = duration_cast<duration<double>>(steady_clock::now() - started).count();
+        cout << "Parsed " << lines << " lines (" << size / (1024 * 1024) << " MiB) in "
+             << fixed << setprecision(3) << elapsed << " s using " << threadCount << " threads" << endl;
+        cout.unsetf(ios_base::floatfield);
+        if (malformed > 0) {
+            cerr << "Warning: Skipped " << malformed << " malformed line(s)." << endl;
+        }
+        if (!carried.empty()) {
+            cerr << "Warning: " << carried.size() << " call(s) never exited; the log may be truncated." << endl;
+        }
+        return true;
+    }
+
+private:
+    static const uint32_t kNone = UINT32_MAX;
+
+    struct Node {
+        uint32_t parent;  // kNone for chunk roots
+        uint32_t name;    // kNone for chunk roots
+        uint32_t root;    // Number of unmatched exits before this subtree started
+        PathInfo info;
+    };
+
+    // Caller is a name in this chunk, or the root index for calls made
+    // directly from a frame opened before the chunk
+    struct Edge {
+        bool fromOutside;
+        uint32_t caller;
+        uint32_t callee;
+        int count;
+    };
+
+    struct Chunk {
+        const char *begin;
+        const char *end;
+        vector<string_view> names;
+        unordered_map<string_view, uint32_t> nameIds;
+        vector<Node> nodes;
+        unordered_map<uint64_t, uint32_t> children;
+        vector<uint32_t> roots;
+        vector<pair<uint32_t, long long>> unmatchedExits;
+        vector<uint32_t> openFrames;
+        vector<Edge> edges;  // In first-call order, which printGraph depends on
+        unordered_map<uint64_t, uint32_t> edgeIndex;
+        size_t lines = 0;
+        size_t malformed = 0;
+    };
+
+    static vector<Chunk> split(const char *data, size_t size, size_t target) {
+        const size_t minChunk = 1 << 20;
+        size_t chunkSize = max(minChunk, size / max<size_t>(1, target));
+        vector<Chunk> chunks;
+        const char *pos = data;
+        const char *end = data + size;
+        while (pos < end) {
+            const char *cut = pos + min(chunkSize, static_cast<size_t>(end - pos));
+            if (cut < end) {
+                cut = findByte(cut, end, '\n');
+                cut = cut < end ? cut + 1 : end;
+            }
+            Chunk chunk;
+            chunk.begin = pos;
+            chunk.end = cut;
+            chunks.push_back(move(chunk));
+            pos = cut;
+        }
+        return chunks;
+    }
+
+    static uint32_t intern(Chunk &chunk, string_view name) {
+        auto it = chunk.nameIds.find(name);
+        if (it != chunk.nameIds.end()) {
+            return it->second;
+        }
+        uint32_t id = static_cast<uint32_t>(chunk.names.size());
+        chunk.names.push_back(name);
+        chunk.nameIds.emplace(name, id);
+        return id;
+    }
+
+    static void addEdge(Chunk &chunk, bool fromOutside, uint32_t caller, uint32_t callee) {
+        uint64_t key = (static_cast<uint64_t>(caller) << 33) | (static_cast<uint64_t>(fromOutside) << 32) | callee;
+        auto it = chunk.edgeIndex.find(key);
+        if (it != chunk.edgeIndex.end()) {
+            chunk.edges[it->second].count++;
+            return;
+        }
+        chunk.edgeIndex.emplace(key, static_cast<uint32_t>(chunk.edges.size()));
+        chunk.edges.push_back({fromOutside, caller, callee, 1});
+    }
+
+    static uint32_t child(Chunk &chunk, uint32_t parent, uint32_t name) {
+        uint64_t key = (static_cast<uint64_t>(parent) << 32) | name;
+        auto it = chunk.children.find(key);
+        if (it != chunk.children.end()) {
+            return it->second;
+        }
+        uint32_t index = static_cast<uint32_t>(chunk.nodes.size());
+        chunk.nodes.push_back({parent, name, chunk.nodes[parent].root, {}});
+        chunk.children.emplace(key, index);
+        return index;
+    }
+
+    static void parse(Chunk &chunk) {
+        static const string_view kEnter = "Entering ";
+        static const string_view kExit = "Exiting ";
+        static const string_view kTime = " (Execution Time: ";
+
+        vector<uint32_t> stack;
+        auto currentRoot = [&chunk]() {
+            uint32_t k = static_cast<uint32_t>(chunk.unmatchedExits.size());
+            while (chunk.roots.size() <= k) {
+                chunk.roots.push_back(static_cast<uint32_t>(chunk.nodes.size()));
+                chunk.nodes.push_back({kNone, kNone, static_cast<uint32_t>(chunk.roots.size() - 1), {}});
+            }
+            return chunk.roots[k];
+        };
+
+        const char *pos = chunk.begin;
+        while (pos < chunk.end) {
+            const char *eol = findByte(pos, chunk.end, '\n');
+            string_view line(pos, static_cast<size_t>(eol - pos));
+            pos = eol + 1;
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if (line.empty()) {
+                continue;
+            }
+            chunk.lines++;
+
+            if (line.compare(0, kEnter.size(), kEnter) == 0) {
+                uint32_t name = intern(chunk, line.substr(kEnter.size()));
+                uint32_t parent;
+                if (stack.empty()) {
+                    parent = currentRoot();
+                    addEdge(chunk, true, chunk.nodes[parent].root, name);
+                } else {
+                    parent = stack.back();
+                    addEdge(chunk, false, chunk.nodes[parent].name, name);
+                }
+                stack.push_back(child(chunk, parent, name));
+            } else if (line.compare(0, kExit.size(), kExit) == 0) {
+                // The name runs up to the " (Execution Time: " marker
+                const char *nameBegin = line.data() + kExit.size();
+                const char *lineEnd = line.data() + line.size();
+                const char *marker = nameBegin;
+                while ((marker = findByte(marker, lineEnd, '(')) < lineEnd) {
+                    if (marker > nameBegin &&
+                        string_view(marker - 1, static_cast<size_t>(lineEnd - marker + 1)).compare(0, kTime.size(), kTime) == 0) {
+                        break;
+                    }
+                    ++marker;
+                }
+                if (marker >= lineEnd) {
+                    chunk.malformed++;
+                    continue;
+                }
+                long long duration = 0;
+                for (const char *digit = marker + kTime.size() - 1; digit < lineEnd && *digit >= '0' && *digit <= '9'; ++digit) {
+                    duration = duration * 10 + (*digit - '0');
+                }
+                uint32_t name = intern(chunk, string_view(nameBegin, static_cast<size_t>(marker - 1 - nameBegin)));
+                if (stack.empty()) {
+                    chunk.unmatchedExits.push_back({name, duration});
+                } else {
+                    Node &node = chunk.nodes[stack.back()];
+                    node.info.totalTime += duration;
+                    node.info.callCount += 1;
+                    stack.pop_back();
+                }
+            } else {
+                chunk.malformed++;
+            }
+        }
+        for (uint32_t node : stack) {
+            chunk.openFrames.push_back(chunk.nodes[node].name);
+        }
+    }
+
+    static void merge(const Chunk &chunk, vector<string> &carried, CallGraph &graph) {
+        size_t depth = carried.size();
+        size_t pops = chunk.unmatchedExits.size();
+
+        // prefixes[k] is the carried path after k unmatched exits
+        vector<string> prefixes(max(chunk.roots.size(), pops + 1));
+        for (size_t k = 0; k < prefixes.size(); ++k) {
+            for (size_t i = 0; i + k < depth; ++i) {
+                prefixes[k] += (i == 0 ? "" : " -> ") + carried[i];
+            }
+        }
+
+        vector<string> paths(chunk.nodes.size());
+        for (size_t i = 0; i < chunk.nodes.size(); ++i) {
+            const Node &node = chunk.nodes[i];
+            if (node.name == kNone) {
+                paths[i] = prefixes[node.root];
+                continue;
+            }
+            const string &parentPath = paths[node.parent];
+            paths[i] = parentPath.empty() ? string(chunk.names[node.name])
+                                          : parentPath + " -> " + string(chunk.names[node.name]);
+            if (node.info.callCount > 0) {
+                graph.updatePathProfile(paths[i], node.info);
+            }
+        }
+
+        for (size_t k = 0; k < pops; ++k) {
+            const string &path = prefixes[k].empty() ? string(chunk.names[chunk.unmatchedExits[k].first]) : prefixes[k];
+            graph.updatePathProfile(path, PathInfo{chunk.unmatchedExits[k].second, 1});
+        }
+
+        for (const Edge &edge : chunk.edges) {
+            string callee(chunk.names[edge.callee]);
+            if (!edge.fromOutside) {
+                graph.addCall(string(chunk.names[edge.caller]), callee, edge.count);
+            } else if (edge.caller < depth) {
+                graph.addCall(carried[depth - edge.caller - 1], callee, edge.count);
+            }
+        }
+
+        carried.resize(depth > pops ? depth - pops : 0);
+        for (uint32_t name : chunk.openFrames) {
+            carried.emplace_back(chunk.names[name]);
+        }
+    }
+};
+
+// Drives the live recording API (Logger, CallGraph) at full speed with a
+// recorded trace or a synthetic workload, and reports what the profiler
+// costs at that scale: calls per second, memory growth and how long the
+// path report takes to generate.
+class ReplayDriver {
+public:
+    // Synthetic workload. Each thread repeatedly picks one of `paths`
+    // random call paths (1 to `depth` frames, `fanout` candidate functions
+    // per level) and moves its stack there, leaving only the frames that
+    // aren't shared with the path it was on; so consecutive paths nest the
+    // way real call trees do. With `recursion` > 0, every fourth path
+    // re-enters one of its functions that many times.
+    struct Spec {
+        int depth = 8;
+        int fanout = 4;
+        int recursion = 0;
+        size_t paths = 1000;
+        int threads = 1;
+        long long calls = 1000000;  // Per thread
+        long long rate = 0;         // Calls per second per thread; 0 is unthrottled
+    };
+
+    // "key=value": a Spec field, or format (text, compressed or flight),
+    // bounded, fold, exemplars or placement to set up the profiler the
+    // way it will be used. False for an unknown key.
+    static bool parseSetting(const string &setting, Spec &spec) {
+        size_t equals = setting.find('=');
+        string key = setting.substr(0, equals);
+        long long value = equals == string::npos ? 0 : atoll(setting.c_str() + equals + 1);
+        if (key == "depth") {
+            spec.depth = max(1, static_cast<int>(value));
+        } else if (key == "fanout") {
+            spec.fanout = max(1, static_cast<int>(value));
+        } else if (key == "recursion") {
+            spec.recursion = max(0, static_cast<int>(value));
+        } else if (key == "paths") {
+            spec.paths = static_cast<size_t>(max(1LL, value));
+        } else if (key == "threads") {
+            spec.threads = max(1, static_cast<int>(value));
+        } else if (key == "calls") {
+            spec.calls = max(1LL, value);
+        } else if (key == "rate") {
+            spec.rate = max(0LL, value);
+        } else if (key == "format") {
+            string format = setting.substr(equals + 1);
+            Logger::setEventFormat(format == "text" ? EventFormat::Text
+                                   : format == "compressed" ? EventFormat::Compressed
+                                                            : EventFormat::FlightRecorder);
+        } else if (key == "bounded") {
+            Logger::setBoundedPaths(static_cast<size_t>(max(0LL, value)));
+        } else if (key == "fold") {
+            Logger::setRecursionFolding(value != 0);
+        } else if (key == "exemplars") {
+            Logger::setExemplars(static_cast<size_t>(max(0LL, value)));
+        } else if (key == "placement") {
+            Logger::setPlacementTracking(value != 0);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static void runSynthetic(const Spec &spec, CallGraph &graph) {
+        vector<uint32_t> functions;
+        for (int level = 0; level < spec.depth; ++level) {
+            for (int choice = 0; choice < spec.fanout; ++choice) {
+                functions.push_back(FunctionRegistry::intern("L" + to_string(level) + "F" + to_string(choice)));
+            }
+        }
+        vector<vector<uint32_t>> paths(spec.paths);
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        for (size_t p = 0; p < paths.size(); ++p) {
+            int length = 1 + static_cast<int>(next(seed) % spec.depth);
+            for (int level = 0; level < length; ++level) {
+                paths[p].push_back(functions[level * spec.fanout + next(seed) % spec.fanout]);
+            }
+            if (spec.recursion > 0 && p % 4 == 3) {
+                uint32_t recursive = paths[p][next(seed) % paths[p].size()];
+                paths[p].insert(paths[p].end(), spec.recursion, recursive);
+            }
+        }
+
+        run(graph, spec.threads, [&](int thread, long long &calls) {
+            uint64_t random = seed + static_cast<uint64_t>(thread) * 0xBF58476D1CE4E5B9ULL;
+            LoggerStack stack(graph);
+            const vector<uint32_t> *current = nullptr;
+            auto started = high_resolution_clock::now();
+            while (calls < spec.calls) {
+                const vector<uint32_t> &path = paths[next(random) % paths.size()];
+                size_t shared = 0;
+                while (current && shared < current->size() && shared < path.size() && shared < stack.size() &&
+                       (*current)[shared] == path[shared]) {
+                    shared++;
+                }
+                // Re-picking the current path still calls its leaf again
+                shared = min(shared, path.size() - 1);
+                stack.popTo(shared);
+                for (size_t i = shared; i < path.size() && calls < spec.calls; ++i) {
+                    stack.push(path[i]);
+                    calls++;
+                }
+                current = &path;
+                if (spec.rate > 0 && static_cast<size_t>(calls % 1024) < path.size()) {
+                    this_thread::sleep_until(started + microseconds(calls * 1000000 / spec.rate));
+                }
+            }
+            stack.popTo(0);
+        });
+    }
+
+    // Replays each recorded thread's event stream on its own thread,
+    // `repeat` times over
+    static bool runTrace(const string &filename, int repeat, CallGraph &graph) {
+        TraceDecoder decoder;
+        map<uint32_t, TraceDecoder::ThreadEvents> recorded;
+        if (!decoder.readEvents(filename, recorded)) {
+            return false;
+        }
+        vector<uint32_t> ids;
+        for (const string &name : decoder.functionNames()) {
+            ids.push_back(FunctionRegistry::intern(name));
+        }
+        auto idOf = [&](uint32_t traced) {
+            return traced < ids.size() ? ids[traced] : FunctionRegistry::intern("(unknown)");
+        };
+        vector<const TraceDecoder::ThreadEvents *> threads;
+        for (const auto &entry : recorded) {
+            threads.push_back(&entry.second);
+        }
+        if (threads.empty()) {
+            cerr << "Error: " << filename << " has no events to replay." << endl;
+            return false;
+        }
+
+        run(graph, static_cast<int>(threads.size()), [&](int thread, long long &calls) {
+            const TraceDecoder::ThreadEvents &events = *threads[thread];
+            for (int r = 0; r < repeat; ++r) {
+                LoggerStack stack(graph);
+                for (uint32_t functionId : events.initialStack) {
+                    stack.push(idOf(functionId));
+                }
+                for (uint32_t event : events.events) {
+                    if (!(event & 1)) {
+                        stack.push(idOf(event >> 1));
+                        calls++;
+                    } else if (stack.size() > 0) {
+                        stack.popTo(stack.size() - 1);
+                    }
+                }
+                stack.popTo(0);
+            }
+        });
+        return true;
+    }
+
+private:
+    // Loggers opened and closed explicitly, innermost last
+    class LoggerStack {
+    public:
+        explicit LoggerStack(CallGraph &graph) : graph(graph) {}
+        ~LoggerStack() { popTo(0); }
+
+        void push(uint32_t functionId) {
+            if (used == loggers.size()) {
+                loggers.emplace_back(new optional<Logger>());
+            }
+            loggers[used++]->emplace(functionId, graph);
+        }
+
+        void popTo(size_t depth) {
+            while (used > depth) {
+                loggers[--used]->reset();
+            }
+        }
+
+        size_t size() const { return used; }
+
+    private:
+        CallGraph &graph;
+        vector<unique_ptr<optional<Logger>>> loggers;  // Stable addresses; reused across calls
+        size_t used = 0;
+    };
+
+    static uint64_t next(uint64_t &state) {
+        state += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    static size_t residentBytes() {
+        ifstream statm("/proc/self/statm");
+        size_t pages = 0, resident = 0;
+        statm >> pages >> resident;
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+
+    // Runs `body(thread, calls)` on `threads` threads and prints the results
+    template <typename Body>
+    static void run(CallGraph &graph, int threads, Body body) {
+        size_t profilerBefore = ProfilerMemory::reservedBytes();
+        size_t residentBefore = residentBytes();
+        vector<long long> calls(threads, 0);
+        vector<thread> workers;
+        auto start = high_resolution_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] { body(t, calls[t]); });
+        }
+        for (thread &worker : workers) {
+            worker.join();
+        }
+        double seconds = duration_cast<microseconds>(high_resolution_clock::now() - start).count() / 1e6;
+        long long totalCalls = 0;
+        for (long long c : calls) {
+            totalCalls += c;
+        }
+
+        auto reportStart = high_resolution_clock::now();
+        ProfileTables tables = graph.snapshot();
+        auto snapshotDone = high_resolution_clock::now();
+        graph.logPaths();
+        auto reportDone = high_resolution_clock::now();
+
+        cout << "Replayed " << totalCalls << " calls on " << threads << " thread(s) in " << fixed << setprecision(3) << seconds
+             << " s: " << setprecision(0) << (seconds > 0 ? totalCalls / seconds : 0.0) << " calls/s" << endl;
+        cout << "Distinct paths: " << tables.pathProfiles.size() + tables.hotPaths.size() << endl;
+        cout << "Profiler memory growth: " << (ProfilerMemory::reservedBytes() - profilerBefore) / 1024 << " KiB, resident growth: "
+             << (residentBytes() - min(residentBytes(), residentBefore)) / 1024 << " KiB" << endl;
+        cout << "Snapshot: " << duration_cast<microseconds>(snapshotDone - reportStart).count()
+             << " µs, path report: " << duration_cast<microseconds>(reportDone - snapshotDone).count() << " µs" << endl;
+        cout.unsetf(ios::floatfield);
+    }
+};
+
+// Columnar store of path profile snapshots from many runs and hosts, for
+// queries like "how did this path trend over the month".
+//
+// A store is a directory of segment files, one per snapshot. A segment is
+// memory-mapped and read column by column, so a query only touches the
+// columns it needs, and segments whose run, host or time don't match (or
+// whose metric max is below the query minimum) are skipped on their header
+// alone. Layout, little-endian:
+//   header (32 bytes): u32 magic, u32 version, u64 timestamp (unix
+//     seconds), u32 rows, u32 columns, u32 run length, u32 host length
+//   column directory, 40 bytes per column: u32 column, u32 CRC-32,
+//     u64 offset, u64 size, i64 min, i64 max
+//   run and host strings, then the column data
+// Rows are sorted by path. Path and function columns are dictionary
+// encoded: the dictionary is sorted and front-coded (varint shared prefix
+// length, varint suffix length, suffix), so a path prefix is a contiguous
+// range of IDs. ID and metric columns are zigzag varint deltas against the
+// previous row.
+class ProfileArchive {
+public:
+    enum Column : uint32_t { PathDictionary = 1, PathIds, FunctionDictionary, FunctionIds, TotalTime, SelfTime, CallCount };
+
+    enum class GroupBy { Path, Function, Run };
+
+    struct Query {
+        string run;                      // Empty matches every run
+        string host;                     // Empty matches every host
+        long long from = 0;              // Unix seconds, inclusive
+        long long to = LLONG_MAX;
+        string pathPrefix;
+        Column metric = TotalTime;
+        GroupBy groupBy = GroupBy::Path;
+        long long minValue = LLONG_MIN;  // Rows below it are ignored
+    };
+
+    struct Aggregate {
+        long long sum = 0;
+        long long rows = 0;
+        long long min = LLONG_MAX;
+        long long max = LLONG_MIN;
+    };
+
+    // Write `tables` as a new segment of the store in `directory`
+    static bool append(const string &directory, const string &run, const string &host, long long timestamp,
+                       const ProfileTables &tables) {
+        mkdir(directory.c_str(), 0755);
+
+        vector<string_view> paths;
+        vector<string_view> functionNames;
+        for (const auto &entry : tables.pathProfiles) {
+            paths.push_back(entry.first);
+            size_t split = entry.first.rfind(" -> ");
+            functionNames.push_back(split == string::npos ? string_view(entry.first) : string_view(entry.first).substr(split + 4));
+        }
+        vector<string_view> functions(functionNames);
+        sort(functions.begin(), functions.end());
+        functions.erase(unique(functions.begin(), functions.end()), functions.end());
+
+        vector<long long> pathIds, functionIds, totals, selfTimes, calls;
+        for (const auto &entry : tables.pathProfiles) {
+            size_t row = pathIds.size();
+            pathIds.push_back(static_cast<long long>(row));
+            functionIds.push_back(lower_bound(functions.begin(), functions.end(), functionNames[row]) - functions.begin());
+            totals.push_back(entry.second.totalTime);
+            selfTimes.push_back(max(entry.second.selfTime, 0LL));
+            calls.push_back(entry.second.callCount);
+        }
+
+        vector<pair<Column, vector<uint8_t>>> columns;
+        vector<pair<long long, long long>> ranges;
+        auto addColumn = [&](Column column, vector<uint8_t> data, pair<long long, long long> range) {
+            columns.push_back({column, move(data)});
+            ranges.push_back(range);
+        };
+        addColumn(PathDictionary, encodeDictionary(paths), {0, static_cast<long long>(paths.size()) - 1});
+        addColumn(PathIds, encodeNumbers(pathIds), minMax(pathIds));
+        addColumn(FunctionDictionary, encodeDictionary(functions), {0, static_cast<long long>(functions.size()) - 1});
+        addColumn(FunctionIds, encodeNumbers(functionIds), minMax(functionIds));
+        addColumn(TotalTime, encodeNumbers(totals), minMax(totals));
+        addColumn(SelfTime, encodeNumbers(selfTimes), minMax(selfTimes));
+        addColumn(CallCount, encodeNumbers(calls), minMax(calls));
+
+        size_t dataOffset = kHeaderSize + columns.size() * kColumnEntrySize + run.size() + host.size();
+        vector<uint8_t> segment(dataOffset);
+        uint8_t *header = segment.data();
+        trace::putLE(header, kMagic, 4);
+        trace::putLE(header + 4, kVersion, 4);
+        trace::putLE(header + 8, static_cast<uint64_t>(timestamp), 8);
+        trace::putLE(header + 16, paths.size(), 4);
+        trace::putLE(header + 20, columns.size(), 4);
+        trace::putLE(header + 24, run.size(), 4);
+        trace::putLE(header + 28, host.size(), 4);
+        for (size_t c = 0; c < columns.size(); ++c) {
+            const vector<uint8_t> &data = columns[c].second;
+            uint8_t *entry = segment.data() + kHeaderSize + c * kColumnEntrySize;
+            trace::putLE(entry, columns[c].first, 4);
+            trace::putLE(entry + 4, trace::crc32(data.data(), data.size()), 4);
+            trace::putLE(entry + 8, segment.size(), 8);
+            trace::putLE(entry + 16, data.size(), 8);
+            trace::putLE(entry + 24, static_cast<uint64_t>(ranges[c].first), 8);
+            trace::putLE(entry + 32, static_cast<uint64_t>(ranges[c].second), 8);
+            segment.insert(segment.end(), data.begin(), data.end());
+        }
+        memcpy(segment.data() + kHeaderSize + columns.size() * kColumnEntrySize, run.data(), run.size());
+        memcpy(segment.data() + kHeaderSize + columns.size() * kColumnEntrySize + run.size(), host.data(), host.size());
+
+        // Written under a temporary name so queries never see half a segment
+        static atomic<int> segmentCounter{0};
+        string name = directory + "/" + to_string(timestamp) + "-" + to_string(getpid()) + "-" + to_string(segmentCounter++);
+        ReportBuffer file;
+        file << string_view(reinterpret_cast<const char *>(segment.data()), segment.size());
+        if (!file.writeTo(name + ".tmp") || rename((name + ".tmp").c_str(), (name + ".seg").c_str()) != 0) {
+            cerr << "Error: Could not add a segment to " << directory << "." << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Aggregate `query.metric` over the matching rows of every segment,
+    // grouped by path, function or run ("<UTC time> <run> <host>", so runs
+    // sort chronologically)
+    static map<string, Aggregate> query(const string &directory, const Query &query) {
+        map<string, Aggregate> groups;
+        DIR *dir = opendir(directory.c_str());
+        if (!dir) {
+            cerr << "Error: Could not open the profile store " << directory << "." << endl;
+            return groups;
+        }
+        vector<string> files;
+        while (dirent *entry = readdir(dir)) {
+            string name = entry->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0) {
+                files.push_back(directory + "/" + name);
+            }
+        }
+        closedir(dir);
+        sort(files.begin(), files.end());
+
+        for (const string &file : files) {
+            Segment segment;
+            if (!segment.open(file)) {
+                continue;
+            }
+            if ((!query.run.empty() && segment.run != query.run) || (!query.host.empty() && segment.host != query.host) ||
+                segment.timestamp < query.from || segment.timestamp > query.to) {
+                continue;
+            }
+            const ColumnEntry *metric = segment.column(query.metric);
+            if (!metric || segment.rows == 0 || metric->max < query.minValue) {
+                continue;
+            }
+
+            // Prefix filter: the paths starting with the prefix are a contiguous
+            // range of the sorted path dictionary; rows are then checked for a
+            // whole-frame match, so "main -> a" doesn't select "main -> ab"
+            vector<string> paths;
+            if (!segment.decodeDictionary(PathDictionary, paths)) {
+                continue;
+            }
+            size_t first = lower_bound(paths.begin(), paths.end(), query.pathPrefix) - paths.begin();
+            size_t last = first;
+            while (last < paths.size() && paths[last].compare(0, query.pathPrefix.size(), query.pathPrefix) == 0) {
+                last++;
+            }
+            if (first == last) {
+                continue;
+            }
+
+            vector<long long> pathIds, values, functionIds;
+            vector<string> functions;
+            if (!segment.decodeNumbers(PathIds, pathIds) || !segment.decodeNumbers(query.metric, values) ||
+                (query.groupBy == GroupBy::Function &&
+                 (!segment.decodeNumbers(FunctionIds, functionIds) || !segment.decodeDictionary(FunctionDictionary, functions)))) {
+                continue;
+            }
+            string runKey;
+            if (query.groupBy == GroupBy::Run) {
+                char when[32];
+                time_t seconds = static_cast<time_t>(segment.timestamp);
+                tm utc;
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime_r(&seconds, &utc));
+                runKey = string(when) + " " + segment.run + " " + segment.host;
+            }
+            for (size_t row = 0; row < pathIds.size() && row < values.size(); ++row) {
+                size_t path = static_cast<size_t>(pathIds[row]);
+                if (path < first || path >= last || values[row] < query.minValue ||
+                    !(paths[path].size() == query.pathPrefix.size() || query.pathPrefix.empty() ||
+                      ProfileTables::extends(paths[path], query.pathPrefix))) {
+                    continue;
+                }
+                const string *key = &runKey;
+                if (query.groupBy == GroupBy::Path) {
+                    key = &paths[path];
+                } else if (query.groupBy == GroupBy::Function) {
+                    if (row >= functionIds.size() || static_cast<size_t>(functionIds[row]) >= functions.size()) {
+                        continue;
+                    }
+                    key = &functions[static_cast<size_t>(functionIds[row])];
+                }
+                Aggregate &aggregate = groups[*key];
+                aggregate.sum += values[row];
+                aggregate.rows++;
+                aggregate.min = min(aggregate.min, values[row]);
+                aggregate.max = max(aggregate.max, values[row]);
+            }
+        }
+        return groups;
+    }
+
+    static void writeQueryResult(const map<string, Aggregate> &groups, ostream &out) {
+        ReportBuffer table;
+        table.cell("Group", 60);
+        table.cell("Sum", 15);
+        table.cell("Rows", 10);
+        table.cell("Mean", 15);
+        table.cell("Min", 15);
+        table.cell("Max", 15);
+        table << '\n' << string(130, '-') << '\n';
+        for (const auto &entry : groups) {
+            const Aggregate &aggregate = entry.second;
+            table.cell(entry.first, 60);
+            table.cell(aggregate.sum, 15);
+            table.cell(aggregate.rows, 10);
+            table.cell(aggregate.sum / aggregate.rows, 15);
+            table.cell(aggregate.min, 15);
+            table.cell(aggregate.max, 15);
+            table << '\n';
+        }
+        out << table.view();
+    }
+
+    // The path tables of a path_profiles.txt report. Exact rows are the
+    // path, then total time, % of total, self time, % self and call count;
+    // bounded-mode rows are the path, then time, overcount, min and max
+    // calls (time and min calls are kept). Paths may contain spaces, so the
+    // numbers are taken from the right. A table ends at the first line that
+    // isn't a row, such as the summary of omitted paths.
+    static bool readPathReport(const string &filename, ProfileTables &tables) {
+        ifstream report(filename);
+        if (!report) {
+            cerr << "Error: Could not open the file " << filename << " for reading." << endl;
+            return false;
+        }
+        enum class Table { None, Exact, Bounded };
+        Table table = Table::None;
+        string line;
+        while (getline(report, line)) {
+            if (line.rfind("Top ", 0) == 0) {
+                table = Table::Bounded;
+                getline(report, line);  // Column titles
+                getline(report, line);  // Rule
+                continue;
+            }
+            if (line.rfind("Path ", 0) == 0) {
+                table = Table::Exact;
+                getline(report, line);  // Rule
+                continue;
+            }
+            if (table != Table::None && !readPathRow(line, table == Table::Bounded, tables)) {
+                table = Table::None;
+            }
+        }
+        return true;
+    }
+
+private:
+    static bool readPathRow(string_view line, bool bounded, ProfileTables &tables) {
+        size_t fieldCount = bounded ? 4 : 5;
+        vector<string_view> fields;
+        string_view rest = line;
+        while (fields.size() < fieldCount) {
+            size_t end = rest.find_last_not_of(' ');
+            if (end == string_view::npos) {
+                break;
+            }
+            size_t start = rest.find_last_of(' ', end);
+            fields.push_back(rest.substr(start == string_view::npos ? 0 : start + 1,
+                                         start == string_view::npos ? end + 1 : end - start));
+            rest = rest.substr(0, start == string_view::npos ? 0 : start);
+        }
+        size_t pathEnd = rest.find_last_not_of(' ');
+        if (fields.size() < fieldCount || pathEnd == string_view::npos) {
+            return false;
+        }
+
+        long long numbers[5];
+        for (size_t i = 0; i < fieldCount; ++i) {
+            string_view field = fields[i];
+            bool percent = !bounded && (i == 1 || i == 3);
+            if (percent) {
+                if (field.empty() || field.back() != '%') {
+                    return false;
+                }
+                field.remove_suffix(1);
+                double value;
+                if (from_chars(field.data(), field.data() + field.size(), value).ptr != field.data() + field.size()) {
+                    return false;
+                }
+                continue;
+            }
+            if (from_chars(field.data(), field.data() + field.size(), numbers[i]).ptr != field.data() + field.size()) {
+                return false;
+            }
+        }
+
+        PathInfo &info = tables.pathProfiles[string(rest.substr(0, pathEnd + 1))];
+        if (bounded) {
+            info.callCount += static_cast<int>(numbers[1]);
+            info.totalTime += numbers[3];
+        } else {
+            info.callCount += static_cast<int>(numbers[0]);
+            info.selfTime = max(info.selfTime, 0LL) + numbers[2];
+            info.totalTime += numbers[4];
+        }
+        return true;
+    }
+
+    static const uint32_t kMagic = 0x47455350;  // "PSEG"
+    static const uint32_t kVersion = 1;
+    static const size_t kHeaderSize = 32;
+    static const size_t kColumnEntrySize = 40;
+
+    struct ColumnEntry {
+        uint32_t column;
+        uint32_t checksum;
+        uint64_t offset;
+        uint64_t size;
+        long long min;
+        long long max;
+    };
+
+    class Segment {
+    public:
+        ~Segment() {
+            if (data) {
+                munmap(const_cast<uint8_t *>(data), size);
+            }
+        }
+
+        bool open(const string &filename) {
+            int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                cerr << "Error: Could not open the file " << filename << " for reading." << endl;
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kHeaderSize) {
+                ::close(fd);
+                cerr << "Warning: " << filename << " is not a profile segment; skipped." << endl;
+                return false;
+            }
+            size = static_cast<size_t>(st.st_size);
+            void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (mapped == MAP_FAILED) {
+                cerr << "Error: Could not map " << filename << "." << endl;
+                return false;
+            }
+            data = static_cast<const uint8_t *>(mapped);
+
+            size_t columnCount = trace::getLE(data + 20, 4);
+            size_t runLength = trace::getLE(data + 24, 4);
+            size_t hostLength = trace::getLE(data + 28, 4);
+            size_t stringsOffset = kHeaderSize + columnCount * kColumnEntrySize;
+            if (trace::getLE(data, 4) != kMagic || trace::getLE(data + 4, 4) != kVersion ||
+                stringsOffset + runLength + hostLength > size) {
+                cerr << "Warning: " << filename << " is not a profile segment; skipped." << endl;
+                return false;
+            }
+            timestamp = static_cast<long long>(trace::getLE(data + 8, 8));
+            rows = trace::getLE(data + 16, 4);
+            for (size_t c = 0; c < columnCount; ++c) {
+                const uint8_t *entry = data + kHeaderSize + c * kColumnEntrySize;
+                ColumnEntry column{static_cast<uint32_t>(trace::getLE(entry, 4)), static_cast<uint32_t>(trace::getLE(entry + 4, 4)),
+                                   trace::getLE(entry + 8, 8), trace::getLE(entry + 16, 8),
+                                   static_cast<long long>(trace::getLE(entry + 24, 8)),
+                                   static_cast<long long>(trace::getLE(entry + 32, 8))};
+                if (column.offset > size || column.size > size - column.offset) {
+                    cerr << "Warning: " << filename << " is truncated; skipped." << endl;
+                    return false;
+                }
+                columns.push_back(column);
+            }
+            run.assign(reinterpret_cast<const char *>(data + stringsOffset), runLength);
+            host.assign(reinterpret_cast<const char *>(data + stringsOffset + runLength), hostLength);
+            this->filename = filename;
+            return true;
+        }
+
+        const ColumnEntry *column(uint32_t id) const {
+            for (const ColumnEntry &entry : columns) {
+                if (entry.column == id) {
+                    return &entry;
+                }
+            }
+            return nullptr;
+        }
+
+        bool decodeNumbers(uint32_t id, vector<long long> &values) const {
+            const uint8_t *pos, *end;
+            if (!columnData(id, pos, end)) {
+                return false;
+            }
+            values.reserve(rows);
+            long long previous = 0;
+            uint64_t delta;
+            while (pos < end && trace::getVarint(pos, end, delta)) {
+                previous += trace::unzigzag(delta);
+                values.push_back(previous);
+            }
+            return values.size() == rows;
+        }
+
+        bool decodeDictionary(uint32_t id, vector<string> &entries) const {
+            const uint8_t *pos, *end;
+            uint64_t count;
+            if (!columnData(id, pos, end) || !trace::getVarint(pos, end, count)) {
+                return false;
+            }
+            entries.reserve(count);
+            string previous;
+            for (uint64_t i = 0; i < count; ++i) {
+                uint64_t shared, length;
+                if (!trace::getVarint(pos, end, shared) || !trace::getVarint(pos, end, length) || shared > previous.size() ||
+                    length > static_cast<uint64_t>(end - pos)) {
+                    cerr << "Warning: " << filename << " has a corrupt dictionary; skipped." << endl;
+                    return false;
+                }
+                previous.resize(shared);
+                previous.append(reinterpret_cast<const char *>(pos), length);
+                pos += length;
+                entries.push_back(previous);
+            }
+            return true;
+        }
+
+        long long timestamp = 0;
+        size_t rows = 0;
+        string run;
+        string host;
+
+    private:
+        bool columnData(uint32_t id, const uint8_t *&pos, const uint8_t *&end) const {
+            const ColumnEntry *entry = column(id);
+            if (!entry) {
+                return false;
+            }
+            pos = data + entry->offset;
+            end = pos + entry->size;
+            if (trace::crc32(pos, entry->size) != entry->checksum) {
+                cerr << "Warning: " << filename << " failed its checksum; skipped." << endl;
+                return false;
+            }
+            return true;
+        }
+
+        const uint8_t *data = nullptr;
+        size_t size = 0;
+        vector<ColumnEntry> columns;
+        string filename;
+    };
+
+    static vector<uint8_t> encodeDictionary(const vector<string_view> &sorted) {
+        vector<uint8_t> out;
+        trace::putVarint(out, sorted.size());
+        string_view previous;
+        for (string_view entry : sorted) {
+            size_t shared = 0;
+            while (shared < previous.size() && shared < entry.size() && previous[shared] == entry[shared]) {
+                shared++;
+            }
+            trace::putVarint(out, shared);
+            trace::putVarint(out, entry.size() - shared);
+            out.insert(out.end(), entry.begin() + shared, entry.end());
+            previous = entry;
+        }
+        return out;
+    }
+
+    static vector<uint8_t> encodeNumbers(const vector<long long> &values) {
+        vector<uint8_t> out;
+        long long previous = 0;
+        for (long long value : values) {
+            trace::putVarint(out, trace::zigzag(value - previous));
+            previous = value;
+        }
+        return out;
+    }
+
+    static pair<long long, long long> minMax(const vector<long long> &values) {
+        if (values.empty()) {
+            return {0, -1};
+        }
+        auto range = minmax_element(values.begin(), values.end());
+        return {*range.first, *range.second};
+    }
+};
+
+} // namespace profiler
+
+#endif // PROFILER_HPP
@@ -0,0 +1,1038 @@
+#include "profiler.hpp"
+
+#include <random>
+#include <sstream>
+#include <sys/wait.h>
+
+using namespace std;
+using namespace std::chrono;
+using namespace profiler;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << endl; \
+            failures++; \
+        } \
+    } while (0)
+
+using TreeLogger = BasicLogger<SteadyClock, NullSink, ContextTreeAggregation, MultiThreaded>;
+using FastLogger = BasicLogger<TscClock, NullSink, ContextTreeAggregation, SingleThreaded>;
+using TimerOnly = BasicLogger<TscClock, NullSink, NoAggregation, SingleThreaded>;
+using BoundedLogger = BasicLogger<SteadyClock, NullSink, BoundedPathAggregation>;
+using FoldedLogger = BasicLogger<SteadyClock, NullSink, FoldedRecursionAggregation>;
+
+void inner(CallGraph &graph) {
+    LOG_CALL_AS(FastLogger, graph);
+    this_thread::sleep_for(milliseconds(2));
+}
+
+void outer(CallGraph &graph) {
+    LOG_CALL_AS(TreeLogger, graph);
+    inner(graph);
+    inner(graph);
+}
+
+void untracked(CallGraph &graph) {
+    LOG_CALL_AS(TimerOnly, graph);
+    inner(graph);
+}
+
+void bounded(CallGraph &graph) {
+    LOG_CALL_AS(BoundedLogger, graph);
+}
+
+void mixed(CallGraph &graph) {
+    LOG_CALL(graph);
+    outer(graph);
+}
+
+// Policy loggers build the same context tree as Logger
+void testContextTree() {
+    CallGraph graph;
+    outer(graph);
+    ProfileTables tables = graph.snapshot();
+    CHECK(tables.pathProfiles.count("outer") == 1);
+    CHECK(tables.pathProfiles["outer"].callCount == 1);
+    CHECK(tables.pathProfiles["outer -> inner"].callCount == 2);
+    const PathInfo &outerPath = tables.pathProfiles["outer"];
+    CHECK(outerPath.totalTime >= 4000);
+    CHECK(outerPath.selfTime >= 0 && outerPath.selfTime < outerPath.totalTime);
+    CHECK(tables.callCounts[make_pair(string("outer"), string("inner"))] == 2);
+}
+
+// A graph built where a destroyed one lived starts empty
+void testGraphReuse() {
+    for (int run = 0; run < 2; ++run) {
+        CallGraph graph;
+        outer(graph);
+        CHECK(graph.snapshot().pathProfiles["outer"].callCount == 1);
+    }
+}
+
+// NoAggregation leaves no trace of its own call in the tree
+void testNoAggregation() {
+    CallGraph graph;
+    untracked(graph);
+    ProfileTables tables = graph.snapshot();
+    CHECK(tables.pathProfiles.count("untracked") == 0);
+    CHECK(tables.pathProfiles["inner"].callCount == 1);
+}
+
+void testMixedLoggers() {
+    CallGraph graph;
+    mixed(graph);
+    ProfileTables tables = graph.snapshot();
+    CHECK(tables.pathProfiles["mixed -> outer -> inner"].callCount == 2);
+}
+
+void testTscClock() {
+    TscClock::TimePoint start = TscClock::now();
+    auto steadyStart = SteadyClock::now();
+    this_thread::sleep_for(milliseconds(5));
+    long long micros = TscClock::micros(start, TscClock::now());
+    long long steadyMicros = SteadyClock::micros(steadyStart, SteadyClock::now());
+    CHECK(micros >= 4000 && micros <= steadyMicros + 1000);
+    long long skew = static_cast<long long>(TscClock::timestampNs(TscClock::now()) - SteadyClock::timestampNs(SteadyClock::now()));
+    CHECK(llabs(skew) < 1000000);
+}
+
+// BasicLogger honours the call filter, and records nothing into a sketch
+// that has no capacity
+void testBasicLoggerLimits() {
+    CallGraph graph;
+    CallFilter::configure("max-depth=1", ';');
+    outer(graph);
+    CallFilter::reset();
+    ProfileTables tables = graph.snapshot();
+    CHECK(tables.pathProfiles["outer"].callCount == 1);
+    CHECK(tables.pathProfiles.count("outer -> inner") == 0);
+
+    bounded(graph);
+    CHECK(graph.snapshot().pathProfiles.count("bounded") == 0);
+}
+
+// init does the startup work up front and reports what it cost
+void testInit() {
+    CallGraph graph;
+    Logger::InitOptions options;
+    options.background = true;
+    Logger::init(graph, options);
+    CHECK(Logger::startupCost().threads >= 0);
+    mixed(graph);
+    ProfileTables tables = graph.snapshot();
+    CHECK(tables.pathProfiles["mixed -> outer -> inner"].callCount == 2);
+    CHECK(Logger::prepareThread(graph) >= 0);
+
+    // A second background init waits for the first one's worker
+    options.names = {"preInterned"};
+    Logger::init(graph, options);
+    Logger::init(graph, options);
+    vector<string> names = FunctionRegistry::namesSince(0);
+    CHECK(find(names.begin(), names.end(), "preInterned") != names.end());
+}
+
+// A condition wait is reported apart from re-acquiring the mutex, which
+// counts as one more acquire
+void testConditionVariable() {
+    CallGraph graph;
+    ProfiledMutex mutex("cv", graph);
+    ProfiledConditionVariable ready;
+    bool done = false;
+    {
+        unique_lock<ProfiledMutex> lock(mutex);
+        CHECK(ready.wait_for(lock, milliseconds(2)) == cv_status::timeout);
+        CHECK(!ready.wait_for(lock, milliseconds(2), [&] { return done; }));
+        thread notifier([&] {
+            lock_guard<ProfiledMutex> guard(mutex);
+            done = true;
+            ready.notify_one();
+        });
+        ready.wait(lock, [&] { return done; });
+        lock.unlock();
+        notifier.join();
+    }
+    ProfileTables tables = graph.snapshot();
+    LockInfo total;
+    for (const auto &entry : tables.lockProfiles) {
+        total.acquireCount += entry.second.acquireCount;
+        total.condWaitCount += entry.second.condWaitCount;
+        total.condWaitTime += entry.second.condWaitTime;
+    }
+    CHECK(total.condWaitCount >= 3);
+    CHECK(total.acquireCount == 2 + total.condWaitCount);
+    CHECK(total.condWaitTime >= 4000000);
+}
+
+void testGlobMatch() {
+    CHECK(CallFilter::globMatch("net*", "networkRead"));
+    CHECK(CallFilter::globMatch("parse?", "parse1"));
+    CHECK(!CallFilter::globMatch("parse?", "parse"));
+    CHECK(CallFilter::globMatch("*Loop", "eventLoop"));
+}
+
+// Varints, zigzag and the CRC round-trip; the decoder rebuilds paths and
+// call edges from a trace and skips a block whose checksum is wrong
+void testCompressedTrace() {
+    for (uint64_t value : vector<uint64_t>{0, 1, 127, 128, 300, UINT64_MAX}) {
+        vector<uint8_t> bytes;
+        trace::putVarint(bytes, value);
+        const uint8_t *pos = bytes.data();
+        uint64_t decoded = 0;
+        CHECK(trace::getVarint(pos, bytes.data() + bytes.size(), decoded) && decoded == value);
+        CHECK(pos == bytes.data() + bytes.size());
+        pos = bytes.data();
+        CHECK(bytes.size() == 1 || !trace::getVarint(pos, bytes.data() + bytes.size() - 1, decoded));
+    }
+    for (int64_t value : vector<int64_t>{0, 1, -1, 1000, -1000, INT64_MIN, INT64_MAX}) {
+        CHECK(trace::unzigzag(trace::zigzag(value)) == value);
+    }
+    CHECK(trace::zigzag(-1) == 1 && trace::zigzag(1) == 2);
+    const char *check = "123456789";
+    CHECK(trace::crc32(reinterpret_cast<const uint8_t *>(check), 9) == 0xCBF43926u);
+
+    const string filename = "test_trace.bin";
+    uint32_t a = FunctionRegistry::intern("traceA");
+    uint32_t b = FunctionRegistry::intern("traceB");
+    {
+        trace::TraceSink sink;
+        sink.open(filename);
+        trace::TraceEncoder encoder(sink, 0);
+        encoder.enter(a, 0);
+        encoder.enter(b, 10000);
+        encoder.exit(b, 30000);
+        encoder.exit(a, 50000);
+        encoder.flush();
+        // Written last, so its payload ends the file
+        encoder.enter(a, 100000);
+        encoder.exit(a, 400000);
+        encoder.flush();
+    }
+    {
+        fstream file(filename, ios::in | ios::out | ios::binary);
+        file.seekg(-1, ios::end);
+        char last = static_cast<char>(file.get());
+        file.seekp(-1, ios::end);
+        file.put(static_cast<char>(last ^ 0x55));
+    }
+
+    CallGraph graph;
+    TraceDecoder decoder;
+    CHECK(decoder.decode(filename, graph));
+    ProfileTables tables = graph.snapshot();
+    CHECK(tables.pathProfiles["traceA"].callCount == 1);
+    CHECK(tables.pathProfiles["traceA"].totalTime == 50);
+    CHECK(tables.pathProfiles["traceA -> traceB"].callCount == 1);
+    CHECK(tables.pathProfiles["traceA -> traceB"].totalTime == 20);
+    CHECK(tables.callCounts[make_pair(string("traceA"), string("traceB"))] == 1);
+    remove(filename.c_str());
+}
+
+// A wrapped ring still attributes the frames whose enter was overwritten
+void testFlightRecorderWrap() {
+    uint32_t outerId = FunctionRegistry::intern("ringOuter");
+    uint32_t innerId = FunctionRegistry::intern("ringInner");
+    FlightRecorder::setCapacity(4);
+    thread recorder([&] {
+        uint64_t start = 1000000;
+        FlightRecorder::record(outerId, false, start, 0);
+        for (uint64_t i = 0; i < 10; ++i) {
+            uint64_t enter = start + (i + 1) * 5000;
+            FlightRecorder::record(innerId, false, enter, 0);
+            FlightRecorder::record(innerId, true, enter + 2000, enter);
+        }
+        FlightRecorder::record(outerId, true, start + 100000, start);
+    });
+    recorder.join();
+    FlightRecorder::setCapacity(16384);
+
+    const string filename = "test_flight.bin";
+    CHECK(FlightRecorder::dump(filename));
+    CallGraph graph;
+    TraceDecoder decoder;
+    CHECK(decoder.decode(filename, graph));
+    ProfileTables tables = graph.snapshot();
+    // Only the last four events survive: the exits of two inner calls, the
+    // enter of the second and the outer exit
+    CHECK(tables.pathProfiles["ringOuter"].callCount == 1);
+    CHECK(tables.pathProfiles["ringOuter"].totalTime == 100);
+    CHECK(tables.pathProfiles["ringOuter -> ringInner"].callCount == 2);
+    CHECK(tables.pathProfiles["ringOuter -> ringInner"].totalTime == 4);
+    remove(filename.c_str());
+}
+
+// A log big enough to be split into several chunks, with call stacks that
+// straddle the cuts, gives the same paths and edges as one sequential pass
+void testEventLogChunks() {
+    const string filename = "test_event_log.txt";
+    map<string, PathInfo> paths;
+    map<pair<string, string>, int> edges;
+    {
+        ofstream log(filename);
+        vector<string> stack;
+        mt19937 random(7);
+        for (int i = 0; i < 300000; ++i) {
+            if (stack.size() < 12 && (stack.empty() || random() % 2 == 0)) {
+                string name = "chunk" + to_string(random() % 6);
+                if (!stack.empty()) {
+                    edges[make_pair(stack.back(), name)]++;
+                }
+                stack.push_back(name);
+                log << "Entering " << name << "\n";
+            } else {
+                string path;
+                for (const string &frame : stack) {
+                    path += (path.empty() ? "" : " -> ") + frame;
+                }
+                long long duration = static_cast<long long>(random() % 1000);
+                paths[path].totalTime += duration;
+                paths[path].callCount++;
+                log << "Exiting " << stack.back() << " (Execution Time: " << duration << " µs)\n";
+                stack.pop_back();
+            }
+        }
+        while (!stack.empty()) {
+            string path;
+            for (const string &frame : stack) {
+                path += (path.empty() ? "" : " -> ") + frame;
+            }
+            paths[path].callCount++;
+            log << "Exiting " << stack.back() << " (Execution Time: 0 µs)\n";
+            stack.pop_back();
+        }
+    }
+
+    CallGraph graph;
+    EventLogAnalyzer analyzer;
+    CHECK(analyzer.analyze(filename, graph));
+    ProfileTables tables = graph.snapshot();
+    CHECK(tables.pathProfiles.size() == paths.size());
+    for (const auto &entry : paths) {
+        const PathInfo &info = tables.pathProfiles[entry.first];
+        CHECK(info.callCount == entry.second.callCount);
+        CHECK(info.totalTime == entry.second.totalTime);
+    }
+    CHECK(tables.callCounts == edges);
+    remove(filename.c_str());
+}
+
+// Space-Saving: every path with more than total/k of the time is kept, and
+// its time and error bracket the true total
+void testPathSketch() {
+    const size_t k = 16;
+    ProfilerArena arena;
+    PathSketch sketch;
+    CHECK(sketch.init(arena, k));
+
+    map<uint64_t, long long> truth;
+    mt19937 random(11);
+    for (int i = 0; i < 20000; ++i) {
+        // A few heavy paths among many light ones, interleaved
+        uint64_t key = i % 5 == 0 ? 1 + random() % 4 : 100 + random() % 500;
+        long long time = key < 100 ? 40 : 1 + random() % 10;
+        uint32_t frame = static_cast<uint32_t>(key);
+        sketch.add(key, time, &frame, 1, false);
+        truth[key] += time;
+    }
+
+    CHECK(sketch.size() == k && sketch.full());
+    long long total = 0;
+    for (const auto &entry : truth) {
+        total += entry.second;
+    }
+    CHECK(sketch.total() == total);
+    map<uint64_t, const PathSketch::Counter *> kept;
+    for (size_t i = 0; i < sketch.size(); ++i) {
+        const PathSketch::Counter &counter = sketch.counter(i);
+        kept[counter.key] = &counter;
+        CHECK(counter.time >= truth[counter.key]);
+        CHECK(counter.time - counter.timeError <= truth[counter.key]);
+        CHECK(counter.time - truth[counter.key] <= total / static_cast<long long>(k));
+    }
+    int heavy = 0;
+    for (const auto &entry : truth) {
+        if (entry.second > total / static_cast<long long>(k)) {
+            heavy++;
+            CHECK(kept.count(entry.first) == 1);
+        }
+    }
+    CHECK(heavy == 4);
+}
+
+void pong(CallGraph &graph, int depth);
+
+void ping(CallGraph &graph, int depth) {
+    LOG_CALL_AS(FoldedLogger, graph);
+    this_thread::sleep_for(milliseconds(1));
+    if (depth > 0) {
+        pong(graph, depth - 1);
+    }
+}
+
+void pong(CallGraph &graph, int depth) {
+    LOG_CALL_AS(FoldedLogger, graph);
+    this_thread::sleep_for(milliseconds(1));
+    if (depth > 0) {
+        ping(graph, depth - 1);
+    }
+}
+
+// Mutual recursion folds into one node per function, and only the
+// outermost activation adds to a node's time
+void testRecursionFolding() {
+    CallGraph graph;
+    auto start = steady_clock::now();
+    ping(graph, 5);
+    long long elapsed = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+    ProfileTables tables = graph.snapshot();
+    const PathInfo &pingPath = tables.pathProfiles["ping"];
+    const PathInfo &pongPath = tables.pathProfiles["ping -> pong"];
+    CHECK(pingPath.callCount == 3);
+    CHECK(pongPath.callCount == 3);
+    CHECK(tables.pathProfiles.count("ping -> pong -> ping") == 0);
+    CHECK(pingPath.totalTime >= 6000 && pingPath.totalTime <= elapsed);
+    CHECK(pongPath.totalTime >= 5000 && pongPath.totalTime < pingPath.totalTime);
+    CHECK(tables.recursionDepths.count("ping") == 1);
+}
+
+void sharedChild(CallGraph &graph) {
+    LOG_CALL(graph);
+}
+
+void sharedParent(CallGraph &graph) {
+    LOG_CALL(graph);
+    sharedChild(graph);
+    sharedChild(graph);
+}
+
+// Two processes recording into one shared store add up
+void testSharedStore() {
+    const string name = "/profiler_test_" + to_string(getpid());
+    vector<pid_t> children;
+    for (int p = 0; p < 2; ++p) {
+        pid_t child = fork();
+        if (child == 0) {
+            CallGraph graph;
+            bool attached = Logger::setSharedStore(name);
+            for (int i = 0; attached && i < 3; ++i) {
+                sharedParent(graph);
+            }
+            _exit(attached ? 0 : 1);
+        }
+        children.push_back(child);
+    }
+    for (pid_t child : children) {
+        int status = 0;
+        CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    unique_ptr<SharedProfileStore> store = SharedProfileStore::attach(name);
+    CHECK(store != nullptr);
+    if (store) {
+        CallGraph graph;
+        store->importInto(graph);
+        ProfileTables tables = graph.snapshot();
+        CHECK(tables.pathProfiles["sharedParent"].callCount == 6);
+        CHECK(tables.pathProfiles["sharedParent -> sharedChild"].callCount == 12);
+        CHECK(tables.callCounts[make_pair(string("sharedParent"), string("sharedChild"))] == 12);
+    }
+    SharedProfileStore::unlink(name);
+}
+
+void exemplarStep(CallGraph &graph, int ms) {
+    LOG_CALL(graph);
+    this_thread::sleep_for(milliseconds(ms));
+}
+
+void exemplarWork(CallGraph &graph, int ms) {
+    LOG_CALL(graph);
+    this_thread::sleep_for(milliseconds(ms));
+    exemplarStep(graph, 0);
+    exemplarStep(graph, 2);
+    exemplarStep(graph, 1);
+}
+
+// The slowest calls of a path are kept, slowest first, each with its
+// longest sub-calls in start order
+void testExemplars() {
+    CallGraph graph;
+    Logger::setExemplars(3, 2);
+    for (int ms : {1, 12, 2, 16, 3, 8}) {
+        exemplarWork(graph, ms);
+    }
+    ProfileTables tables = graph.snapshot();
+    Logger::setExemplars(0);
+
+    const auto &kept = tables.exemplars["exemplarWork"];
+    CHECK(kept.size() == 3);
+    if (kept.size() == 3) {
+        CHECK(kept[0].duration >= kept[1].duration && kept[1].duration >= kept[2].duration);
+        CHECK(kept[2].duration >= 11000);
+        for (const auto &exemplar : kept) {
+            CHECK(exemplar.truncated);
+            CHECK(exemplar.calls.size() == 2);
+            if (exemplar.calls.size() == 2) {
+                CHECK(exemplar.calls[0].function == "exemplarStep" && exemplar.calls[0].depth == 1);
+                CHECK(exemplar.calls[0].offset < exemplar.calls[1].offset);
+                CHECK(exemplar.calls[0].duration > exemplar.calls[1].duration);
+            }
+        }
+    }
+}
+
+// Each butterfly entry lists its callers above it and callees below it,
+// heaviest edge first, with the time and calls of that edge
+void testButterfly() {
+    CallGraph graph;
+    graph.updatePathProfile("main", PathInfo{100, 1});
+    graph.updatePathProfile("main -> a", PathInfo{60, 2});
+    graph.updatePathProfile("main -> b", PathInfo{30, 1});
+    graph.updatePathProfile("main -> a -> b", PathInfo{20, 3});
+    const string filename = "test_butterfly.txt";
+    graph.writeButterfly(filename);
+
+    vector<vector<string>> rows;
+    ifstream report(filename);
+    string line;
+    while (getline(report, line)) {
+        istringstream words(line);
+        rows.emplace_back();
+        for (string word; words >> word;) {
+            rows.back().push_back(word);
+        }
+    }
+    auto entry = [&](const string &index) {
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (!rows[i].empty() && rows[i][0] == index) {
+                return i;
+            }
+        }
+        return rows.size();
+    };
+    size_t b = entry("[3]");
+    CHECK(b >= 2 && b < rows.size());
+    if (b >= 2 && b < rows.size()) {
+        CHECK((rows[b] == vector<string>{"[3]", "50.00%", "50", "50", "4", "b", "[3]"}));
+        CHECK((rows[b - 2] == vector<string>{"30", "30", "1/4", "main", "[1]"}));
+        CHECK((rows[b - 1] == vector<string>{"20", "20", "3/4", "a", "[2]"}));
+    }
+    size_t main = entry("[1]");
+    CHECK(main >= 1 && main + 2 < rows.size());
+    if (main >= 1 && main + 2 < rows.size()) {
+        CHECK((rows[main - 1] == vector<string>{"100", "10", "1/1", "<spontaneous>"}));
+        CHECK(rows[main][2] == "100" && rows[main][3] == "10");
+        CHECK((rows[main + 1] == vector<string>{"60", "40", "2/2", "a", "[2]"}));
+        CHECK((rows[main + 2] == vector<string>{"30", "30", "1/4", "b", "[3]"}));
+    }
+    remove(filename.c_str());
+}
+
+// Segments appended for two runs are filtered by run, time, path prefix
+// (whole frames only) and minimum value, and grouped by path, function or run
+void testProfileArchive() {
+    const string directory = "test_archive_" + to_string(getpid());
+    ProfileTables first, second;
+    first.pathProfiles["main"] = PathInfo{100, 1, 10};
+    first.pathProfiles["main -> a"] = PathInfo{60, 2, 40};
+    first.pathProfiles["main -> a -> b"] = PathInfo{20, 3, 20};
+    first.pathProfiles["main -> b"] = PathInfo{30, 1, 30};
+    first.pathProfiles["main -> ab"] = PathInfo{0, 1, 0};
+    second.pathProfiles["main"] = PathInfo{200, 1, 20};
+    second.pathProfiles["main -> a"] = PathInfo{150, 5, 150};
+    CHECK(ProfileArchive::append(directory, "before", "host1", 1000, first));
+    CHECK(ProfileArchive::append(directory, "after", "host1", 2000, second));
+
+    ProfileArchive::Query query;
+    query.pathPrefix = "main -> a";
+    map<string, ProfileArchive::Aggregate> byPath = ProfileArchive::query(directory, query);
+    CHECK(byPath.size() == 2);
+    CHECK(byPath["main -> a"].sum == 210 && byPath["main -> a"].rows == 2);
+    CHECK(byPath["main -> a"].min == 60 && byPath["main -> a"].max == 150);
+    CHECK(byPath["main -> a -> b"].sum == 20);
+
+    query.run = "before";
+    query.metric = ProfileArchive::CallCount;
+    CHECK(ProfileArchive::query(directory, query)["main -> a"].sum == 2);
+
+    query.run.clear();
+    query.pathPrefix.clear();
+    query.from = 1500;
+    CHECK(ProfileArchive::query(directory, query).size() == 2);
+
+    query.from = 0;
+    query.metric = ProfileArchive::SelfTime;
+    query.minValue = 25;
+    query.groupBy = ProfileArchive::GroupBy::Function;
+    map<string, ProfileArchive::Aggregate> byFunction = ProfileArchive::query(directory, query);
+    CHECK(byFunction.size() == 2);
+    CHECK(byFunction["a"].sum == 190 && byFunction["b"].sum == 30);
+
+    query.minValue = LLONG_MIN;
+    query.groupBy = ProfileArchive::GroupBy::Run;
+    map<string, ProfileArchive::Aggregate> byRun = ProfileArchive::query(directory, query);
+    CHECK(byRun.size() == 2);
+    CHECK(byRun.begin()->first.find(" before host1") != string::npos && byRun.begin()->second.sum == 100);
+
+    DIR *dir = opendir(directory.c_str());
+    while (dirent *entry = dir ? readdir(dir) : nullptr) {
+        remove((directory + "/" + entry->d_name).c_str());
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    rmdir(directory.c_str());
+}
+
+void filterLeaf(CallGraph &graph, int depth) {
+    LOG_CALL(graph);
+    if (depth > 0) {
+        filterLeaf(graph, depth - 1);
+    }
+}
+
+void filterInside(CallGraph &graph) {
+    LOG_CALL(graph);
+    filterLeaf(graph, 3);
+}
+
+void filterOuter(CallGraph &graph) {
+    LOG_CALL(graph);
+    filterInside(graph);
+    filterLeaf(graph, 0);
+}
+
+// Only calls under an "inside" function and within the depth limit are
+// recorded, hanging off the nearest recorded caller
+void testCallFilter() {
+    CallGraph graph;
+    CHECK(CallFilter::configure("inside=filterInside; max-depth=3", ';'));
+    filterOuter(graph);
+    CallFilter::reset();
+    CHECK(!CallFilter::active());
+    ProfileTables tables = graph.snapshot();
+    CHECK(tables.pathProfiles.size() == 2);
+    CHECK(tables.pathProfiles["filterInside"].callCount == 1);
+    CHECK(tables.pathProfiles["filterInside -> filterLeaf"].callCount == 1);
+
+    CallGraph excluded;
+    CHECK(CallFilter::configure("exclude=*Leaf", ';'));
+    filterOuter(excluded);
+    CallFilter::reset();
+    tables = excluded.snapshot();
+    CHECK(tables.pathProfiles.size() == 2);
+    CHECK(tables.pathProfiles["filterOuter -> filterInside"].callCount == 1);
+    CHECK(!CallFilter::configure("depth=1", ';'));
+}
+
+// Callees below the DOT threshold are merged into one "other" node per
+// caller; the rest keep their own nodes and timed edges
+void testDotPruning() {
+    CallGraph graph;
+    graph.updatePathProfile("main", PathInfo{100, 1});
+    for (const auto &callee : vector<pair<string, long long>>{{"a", 60}, {"b", 30}, {"tinyX", 1}, {"tinyY", 1}}) {
+        graph.addCall("main", callee.first, 2);
+        graph.updatePathProfile("main -> " + callee.first, PathInfo{callee.second, 2});
+    }
+    const string filename = "test_graph.dot";
+    graph.generateDotFile(false, filename, "test_graph.png", 5.0);
+
+    ifstream file(filename);
+    stringstream dot;
+    dot << file.rdbuf();
+    string text = dot.str();
+    CHECK(text.find("\"main\" -> \"a\" [") != string::npos);
+    CHECK(text.find("2 calls\\n60 µs") != string::npos);
+    CHECK(text.find("\"main\" -> \"b\" [") != string::npos);
+    CHECK(text.find("\"tinyX\"") == string::npos && text.find("\"tinyY\"") == string::npos);
+    CHECK(text.find("\"main (other)\" [label=\"2 other functions\\n2 µs\"") != string::npos);
+    CHECK(text.find("\"main\" -> \"main (other)\" [") != string::npos);
+    remove(filename.c_str());
+    remove("test_graph.png");
+}
+
+// Self times subtract only a path's own callees, even when a sibling's
+// name starts with another's; the report sorts by the chosen column and
+// folds the paths below the threshold into one line
+void testPathReport() {
+    ProfileTables tables;
+    tables.pathProfiles["a"] = PathInfo{100, 1};
+    tables.pathProfiles["a -> b"] = PathInfo{10, 1};
+    tables.pathProfiles["a -> b -> c"] = PathInfo{4, 1};
+    tables.pathProfiles["a -> bb"] = PathInfo{50, 1};
+    tables.pathProfiles["ab"] = PathInfo{5, 1};
+    tables.deriveSelfTimes();
+    CHECK(tables.pathProfiles["a"].selfTime == 40);
+    CHECK(tables.pathProfiles["a -> b"].selfTime == 6);
+    CHECK(tables.pathProfiles["a -> bb"].selfTime == 50);
+    CHECK(tables.pathProfiles["ab"].selfTime == 5);
+
+    CallGraph graph;
+    for (const auto &entry : tables.pathProfiles) {
+        graph.updatePathProfile(entry.first, PathInfo{entry.second.totalTime, entry.second.callCount});
+    }
+    graph.logPaths(PathOrder::SelfTime, 5.0);
+    ifstream report("path_profiles.txt");
+    vector<string> paths;
+    string line;
+    while (getline(report, line)) {
+        paths.push_back(line.substr(0, line.find_last_not_of(' ', 59) + 1));
+    }
+    // Self times total 105, so 5% is 5.25 µs: "a -> b -> c" and "ab" go
+    CHECK(paths.size() == 6);
+    if (paths.size() == 6) {
+        CHECK(paths[2] == "a -> bb" && paths[3] == "a" && paths[4] == "a -> b");
+        CHECK(paths[5] == "2 path(s) below 5% of the total omitted (9 µs self time)");
+    }
+    remove("path_profiles.txt");
+}
+
+// Synthetic replays make exactly the requested calls, including specs
+// whose paths are all the same
+void testSyntheticReplay() {
+    CallGraph single;
+    ReplayDriver::Spec spec;
+    spec.depth = 1;
+    spec.fanout = 1;
+    spec.paths = 1;
+    spec.calls = 1000;
+    ReplayDriver::runSynthetic(spec, single);
+    CHECK(single.snapshot().pathProfiles["L0F0"].callCount == 1000);
+
+    CallGraph mixed;
+    spec.depth = 4;
+    spec.fanout = 2;
+    spec.paths = 20;
+    spec.threads = 2;
+    spec.recursion = 3;
+    ReplayDriver::runSynthetic(spec, mixed);
+    long long calls = 0;
+    for (const auto &entry : mixed.snapshot().pathProfiles) {
+        calls += entry.second.callCount;
+    }
+    CHECK(calls == 2000);
+    remove("path_profiles.txt");
+}
+
+// Threads that exit hand their rings on, so short-lived threads don't
+// each leave one behind
+void testFlightRecorderReuse() {
+    uint32_t id = FunctionRegistry::intern("shortLived");
+    size_t before = ProfilerMemory::reservedBytes();
+    for (int t = 0; t < 50; ++t) {
+        thread worker([id, t] {
+            FlightRecorder::record(id, false, 1000000 + t * 1000, 0);
+            FlightRecorder::record(id, true, 1000000 + t * 1000 + 500, 1000000 + t * 1000);
+        });
+        worker.join();
+    }
+    size_t ringBytes = ProfilerMemory::pageRound(16384 * 24 + 4096);
+    CHECK(ProfilerMemory::reservedBytes() - before <= ringBytes);
+
+    // A reused ring only dumps its current thread's calls
+    const string filename = "test_flight_reuse.bin";
+    CHECK(FlightRecorder::dump(filename));
+    CallGraph graph;
+    TraceDecoder decoder;
+    CHECK(decoder.decode(filename, graph));
+    CHECK(graph.snapshot().pathProfiles["shortLived"].callCount == 1);
+    remove(filename.c_str());
+}
+
+// The signal trigger dumps without waiting for an instrumented call
+void testFlightRecorderSignal() {
+    FlightRecorder::installSignalTrigger(SIGUSR1);
+    raise(SIGUSR1);
+    bool dumped = false;
+    for (int attempt = 0; attempt < 200 && !dumped; ++attempt) {
+        this_thread::sleep_for(milliseconds(5));
+        dumped = ifstream("flight_recorder_0.bin").good();
+    }
+    CHECK(dumped);
+    remove("flight_recorder_0.bin");
+}
+
+// Index queries, and incremental updates that end where a fresh index does
+void testCallGraphIndex() {
+    CallGraph graph;
+    graph.updatePathProfile("main", PathInfo{100, 1});
+    graph.updatePathProfile("main -> a", PathInfo{60, 2});
+    graph.updatePathProfile("main -> a -> c", PathInfo{45, 3});
+    graph.updatePathProfile("main -> a -> c -> d", PathInfo{5, 1});
+    graph.updatePathProfile("main -> b", PathInfo{30, 1});
+    graph.updatePathProfile("main -> b -> c", PathInfo{10, 1});
+    graph.addCall("main", "a", 2);
+    graph.addCall("main", "b", 1);
+    graph.addCall("a", "c", 3);
+    graph.addCall("b", "c", 1);
+    graph.addCall("c", "d", 1);
+
+    CallGraphIndex index;
+    index.update(graph);
+    uint32_t main = index.find("main"), a = index.find("a"), b = index.find("b");
+    uint32_t c = index.find("c"), d = index.find("d");
+    CHECK(index.find("missing") == CallGraphIndex::kUnknown);
+    CHECK(index.name(c) == "c");
+
+    map<string, long long> callees, callers;
+    for (const CallGraphIndex::Edge &edge : index.callees(main)) {
+        callees[index.name(edge.function)] = edge.calls;
+    }
+    for (const CallGraphIndex::Edge &edge : index.callers(c)) {
+        callers[index.name(edge.function)] = edge.calls;
+    }
+    CHECK((callees == map<string, long long>{{"a", 2}, {"b", 1}}));
+    CHECK((callers == map<string, long long>{{"a", 3}, {"b", 1}}));
+
+    CHECK(index.statsOf(c).calls == 4 && index.statsOf(c).selfTime == 50 && index.statsOf(c).totalTime == 55);
+    vector<uint32_t> reached = index.closure(main);
+    CHECK((set<uint32_t>(reached.begin(), reached.end()) == set<uint32_t>{a, b, c, d}));
+    vector<uint32_t> reaching = index.closure(d, true);
+    CHECK((set<uint32_t>(reaching.begin(), reaching.end()) == set<uint32_t>{main, a, b, c}));
+    CHECK((index.hottestDescendants(main, 2) == vector<uint32_t>{c, b}));
+    CHECK((index.pathToHotspot(main, 40.0) == vector<uint32_t>{main, a, c}));
+    CHECK((index.pathToHotspot(c, 40.0) == vector<uint32_t>{c}));
+    CHECK(index.pathToHotspot(d, 40.0).empty());
+
+    // New time, a heavier edge and a new function, applied as deltas
+    graph.updatePathProfile("main -> a -> c", PathInfo{10, 1});
+    graph.updatePathProfile("main -> a -> e", PathInfo{8, 1});
+    graph.addCall("a", "c", 1);
+    graph.addCall("a", "e", 1);
+    index.update(graph);
+    CallGraphIndex fresh;
+    fresh.update(graph);
+    for (const char *function : {"main", "a", "b", "c", "d", "e"}) {
+        const CallGraphIndex::FunctionStats &incremental = index.statsOf(index.find(function));
+        const CallGraphIndex::FunctionStats &rebuilt = fresh.statsOf(fresh.find(function));
+        CHECK(incremental.calls == rebuilt.calls && incremental.selfTime == rebuilt.selfTime &&
+              incremental.totalTime == rebuilt.totalTime);
+    }
+    CHECK(index.callees(a).size() == 2 && index.callees(a).begin()->calls == 4);
+
+    // Edges and paths that leave the snapshot leave the index
+    ProfileTables smaller = graph.snapshot();
+    smaller.callCounts.erase(make_pair(string("b"), string("c")));
+    smaller.pathProfiles.erase("main -> b -> c");
+    smaller.deriveSelfTimes();
+    index.update(smaller);
+    CHECK(index.callers(c).size() == 1 && index.statsOf(c).calls == 4);
+}
+
+void threadCall(CallGraph &graph) {
+    LOG_CALL_AS(TreeLogger, graph);
+}
+
+size_t profileCount() {
+    size_t count = 0;
+    for (const ThreadProfile *profile = ThreadProfile::first(); profile; profile = profile->nextProfile()) {
+        count++;
+    }
+    return count;
+}
+
+// Profiles of destroyed graphs are reused, by their own thread or, once
+// that has exited, by any other, and start out empty
+void testThreadProfileReuse() {
+    {
+        CallGraph graph;
+        threadCall(graph);
+    }
+    size_t profiles = profileCount();
+    for (int run = 0; run < 3; ++run) {
+        CallGraph graph;
+        threadCall(graph);
+        CHECK(graph.snapshot().pathProfiles["threadCall"].callCount == 1);
+    }
+    CHECK(profileCount() == profiles);
+
+    {
+        CallGraph graph;
+        thread([&] { threadCall(graph); }).join();
+        profiles = profileCount();
+    }
+    CallGraph graph;
+    thread([&] { threadCall(graph); }).join();
+    CHECK(profileCount() == profiles);
+    CHECK(graph.snapshot().pathProfiles["threadCall"].callCount == 1);
+
+    // An exited thread's profile stays with its graph while that lives
+    CallGraph other;
+    thread([&] { threadCall(other); }).join();
+    CHECK(other.snapshot().pathProfiles["threadCall"].callCount == 1);
+    CHECK(graph.snapshot().pathProfiles["threadCall"].callCount == 1);
+}
+
+volatile bool keepRecursing = true;
+
+int overflowStack(int depth) {
+    volatile char frame[1024];
+    frame[0] = static_cast<char>(depth);
+    return keepRecursing ? overflowStack(depth + 1) + frame[0] : depth;
+}
+
+void overflowingCall(CallGraph &graph) {
+    LOG_CALL_AS(TreeLogger, graph);
+    overflowStack(0);
+}
+
+// A stack overflow on a thread other than the one that installed the
+// handler is still dumped, from that thread's own signal stack
+void testCrashOnWorkerThread() {
+    const string filename = "test_crash_" + to_string(getpid()) + ".txt";
+    pid_t child = fork();
+    if (child == 0) {
+        CallGraph graph;
+        CrashHandler::install(graph, filename);
+        thread([&] { overflowingCall(graph); }).join();
+        _exit(0);
+    }
+    int status = 0;
+    CHECK(waitpid(child, &status, 0) == child && WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    ifstream file(filename);
+    string dump((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    CHECK(dump.find("=== Crash dump: signal 11 (SIGSEGV) ===") != string::npos);
+    CHECK(dump.find("overflowingCall") != string::npos);
+    remove(filename.c_str());
+}
+
+// Mutexes constructed without arguments record into the default graph
+// under generated names
+void testDefaultMutexes() {
+    ProfiledMutex plain;
+    ProfiledSharedMutex shared;
+    {
+        lock_guard<ProfiledMutex> guard(plain);
+        shared_lock<ProfiledSharedMutex> reading(shared);
+    }
+    lock_guard<ProfiledSharedMutex> writing(shared);
+
+    int plainLocks = 0, sharedLocks = 0, exclusiveLocks = 0;
+    for (const auto &entry : CallGraph::defaultGraph().snapshot().lockProfiles) {
+        plainLocks += entry.first.find("[lock mutex ") != string::npos;
+        sharedLocks += entry.first.find("[shared lock shared mutex ") != string::npos;
+        exclusiveLocks += entry.first.find("[lock shared mutex ") != string::npos;
+    }
+    CHECK(plainLocks == 1 && sharedLocks == 1 && exclusiveLocks == 1);
+}
+
+// Traversals start at the roots, then at nodes only reachable inside a
+// cycle; the tree marks shared subtrees and recursion
+void testGraphTraversal() {
+    map<string, vector<string>> graph;
+    graph["main"] = {"a", "b"};
+    graph["a"] = {"c", "a", "c"};
+    graph["b"] = {"c"};
+    graph["x"] = {"y"};
+    graph["y"] = {"x"};
+    GraphTraversal traversal(graph);
+
+    ostringstream tree, depthFirst, breadthFirst;
+    traversal.writeTree(tree);
+    traversal.writeDepthFirst(depthFirst);
+    traversal.writeBreadthFirst(breadthFirst);
+    CHECK(tree.str() == "main\n  a\n    c\n    a (recursive)\n  b\n    c (see above)\nx\n  y\n    x (recursive)\n");
+    CHECK(depthFirst.str() == "0 main\n1 a\n2 c\n1 b\n0 x\n1 y\n");
+    CHECK(breadthFirst.str() == "0 main\n1 a\n1 b\n2 c\n0 x\n1 y\n");
+}
+
+// Hot callees join their heaviest caller's cluster unless that would make
+// it too big, and clusters are laid out densest first; pseudo-frames
+// aren't functions
+void testFunctionOrder() {
+    CallGraph graph;
+    graph.updatePathProfile("main", PathInfo{150, 1});
+    graph.updatePathProfile("main -> hot", PathInfo{90, 10});
+    graph.updatePathProfile("main -> cold", PathInfo{5, 1});
+    graph.updatePathProfile("main -> [lock m]", PathInfo{0, 1});
+    graph.updatePathProfile("other", PathInfo{50, 1});
+    graph.updatePathProfile("other -> helper", PathInfo{40, 5});
+    graph.addCall("main", "hot", 10);
+    graph.addCall("main", "cold", 1);
+    graph.addCall("other", "helper", 5);
+
+    const string filename = "test_order_" + to_string(getpid()) + ".txt";
+    auto order = [&](size_t maxClusterFunctions) {
+        graph.writeFunctionOrder(filename, maxClusterFunctions);
+        ifstream file(filename);
+        vector<string> names;
+        for (string name; getline(file, name);) {
+            names.push_back(name);
+        }
+        return names;
+    };
+    CHECK((order(32) == vector<string>{"main", "hot", "cold", "other", "helper"}));
+    CHECK((order(2) == vector<string>{"main", "hot", "other", "helper", "cold"}));
+    remove(filename.c_str());
+}
+
+void handoffTask(CallGraph &graph) {
+    LOG_CALL_AS(TreeLogger, graph);
+}
+
+ContextHandle handoffSubmit(CallGraph &graph) {
+    LOG_CALL_AS(TreeLogger, graph);
+    return ContextHandle::capture(graph);
+}
+
+// A task bound to a captured context runs under it on another thread,
+// with the time until it started as queue wait; the thread's own context
+// is back afterwards
+void testContextHandoff() {
+    CallGraph graph;
+    ContextHandle handle = handoffSubmit(graph);
+    this_thread::sleep_for(milliseconds(5));
+    thread([&] {
+        handle.bind([&] { handoffTask(graph); })();
+        handoffTask(graph);
+    }).join();
+
+    ProfileTables tables = graph.snapshot();
+    CHECK(tables.pathProfiles["handoffSubmit -> handoffTask"].callCount == 1);
+    CHECK(tables.pathProfiles["handoffTask"].callCount == 1);
+    const CounterInfo &wait = tables.counterProfiles["handoffSubmit -> [queue wait]"];
+    CHECK(wait.updates == 1 && wait.total >= 5000);
+}
+
+int main() {
+    Logger::setEventFormat(EventFormat::FlightRecorder);
+    testInit();
+    testContextTree();
+    testGraphReuse();
+    testNoAggregation();
+    testBasicLoggerLimits();
+    testMixedLoggers();
+    testTscClock();
+    testConditionVariable();
+    testGlobMatch();
+    testCompressedTrace();
+    testFlightRecorderWrap();
+    testEventLogChunks();
+    testPathSketch();
+    testRecursionFolding();
+    testSharedStore();
+    testExemplars();
+    testButterfly();
+    testProfileArchive();
+    testCallFilter();
+    testDotPruning();
+    testPathReport();
+    testSyntheticReplay();
+    testFlightRecorderReuse();
+    testFlightRecorderSignal();
+    testCallGraphIndex();
+    testThreadProfileReuse();
+    testCrashOnWorkerThread();
+    testDefaultMutexes();
+    testGraphTraversal();
+    testFunctionOrder();
+    testContextHandoff();
+    if (failures > 0) {
+        cerr << failures << " check(s) failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}